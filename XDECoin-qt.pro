@@ -106,6 +106,12 @@ contains(USE_DBUS, 1) {
     QT += dbus
 }
 
+# use: qmake "USE_SECP256K1=1"
+contains(USE_SECP256K1, 1) {
+    message(Building with the in-tree secp256k1 signature code)
+    DEFINES += USE_SECP256K1
+}
+
 # use: qmake "USE_IPV6=1" ( enabled by default; default)
 #  or: qmake "USE_IPV6=0" (disabled by default)
 #  or: qmake "USE_IPV6=-" (not supported)
@@ -128,6 +134,7 @@ LIBS += $$PWD/src/leveldb/libleveldb.a $$PWD/src/leveldb/libmemenv.a
 SOURCES += src/txdb-leveldb.cpp \
     src/bloom.cpp \
     src/hash.cpp \
+    src/hashblock.cpp \
     src/aes_helper.c \
     src/blake.c \
     src/bmw.c \
@@ -221,6 +228,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/miner.h \
     src/net.h \
     src/key.h \
+    src/secp256k1.h \
     src/db.h \
     src/txdb.h \
     src/walletdb.h \
@@ -390,6 +398,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/util.cpp \
     src/netbase.cpp \
     src/key.cpp \
+    src/secp256k1.cpp \
     src/script.cpp \
     src/main.cpp \
     src/miner.cpp \
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+# Copyright (c) 2014 The XDECoin developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+# Local P2P load test: open N loopback peers against a running xdecoind,
+# complete the version handshake on each, then keep every peer pinging and
+# report the ping -> pong round trip through the node's socket and message
+# handler threads.
+#
+#   share/p2p-loadtest.py --peers 2000 --seconds 60
+#
+# Raise the node's -maxconnections (and ulimit -n on both sides) first.
+# The node's own view, per command, is in "getmessagestats true" (the
+# argument resets the counters, so call it once before a run).
+
+import argparse
+import hashlib
+import random
+import selectors
+import socket
+import struct
+import time
+
+PROTOCOL_VERSION = 60015
+MAGIC_MAIN = bytes([0x7f, 0x31, 0xe2, 0x05])
+MAGIC_TEST = bytes([0x70, 0x35, 0x22, 0x05])
+
+
+def checksum(payload):
+    return hashlib.sha256(hashlib.sha256(payload).digest()).digest()[:4]
+
+
+def message(magic, command, payload=b""):
+    return (magic + command.encode().ljust(12, b"\0") +
+            struct.pack("<I", len(payload)) + checksum(payload) + payload)
+
+
+def address(host, port):
+    ip = b"\0" * 10 + b"\xff\xff" + socket.inet_aton(host)
+    return struct.pack("<IQ", int(time.time()), 1) + ip + struct.pack(">H", port)
+
+
+def version_payload(host, port):
+    subver = b"/p2p-loadtest:0.1/"
+    return (struct.pack("<iQq", PROTOCOL_VERSION, 1, int(time.time())) +
+            address(host, port) + address("127.0.0.1", 0) +
+            struct.pack("<Q", random.getrandbits(64)) +
+            bytes([len(subver)]) + subver + struct.pack("<i", 0))
+
+
+class Peer(object):
+    def __init__(self, sock):
+        self.sock = sock
+        self.recv = b""
+        self.send = b""
+        self.ready = False
+        self.ping_sent = {}
+
+    def messages(self, magic):
+        while len(self.recv) >= 24:
+            if self.recv[:4] != magic:
+                raise ValueError("bad message start")
+            command = self.recv[4:16].rstrip(b"\0").decode()
+            length = struct.unpack("<I", self.recv[16:20])[0]
+            if len(self.recv) < 24 + length:
+                return
+            payload = self.recv[24:24 + length]
+            self.recv = self.recv[24 + length:]
+            yield command, payload
+
+
+def flush(sel, peer):
+    # Write what the socket takes; only ask for writability while data is left
+    if peer.send:
+        try:
+            n = peer.sock.send(peer.send)
+            peer.send = peer.send[n:]
+        except BlockingIOError:
+            pass
+    events = selectors.EVENT_READ | (selectors.EVENT_WRITE if peer.send else 0)
+    sel.modify(peer.sock, events, peer)
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=26080)
+    parser.add_argument("--testnet", action="store_true")
+    parser.add_argument("--peers", type=int, default=100)
+    parser.add_argument("--seconds", type=float, default=30)
+    parser.add_argument("--interval", type=float, default=1.0, help="seconds between pings per peer")
+    args = parser.parse_args()
+    if args.testnet and args.port == 26080:
+        args.port = 26081
+    magic = MAGIC_TEST if args.testnet else MAGIC_MAIN
+
+    sel = selectors.DefaultSelector()
+    peers = []
+    for i in range(args.peers):
+        sock = socket.create_connection((args.host, args.port))
+        sock.setblocking(False)
+        peer = Peer(sock)
+        peer.send = message(magic, "version", version_payload(args.host, args.port))
+        sel.register(sock, selectors.EVENT_READ, peer)
+        flush(sel, peer)
+        peers.append(peer)
+
+    rtts = []
+    lost = 0
+    start = time.time()
+    next_ping = dict((id(peer), start + random.random() * args.interval) for peer in peers)
+    while time.time() - start < args.seconds and peers:
+        now = time.time()
+        for peer in peers:
+            if peer.ready and next_ping[id(peer)] <= now:
+                nonce = random.getrandbits(64)
+                peer.ping_sent[nonce] = now
+                peer.send += message(magic, "ping", struct.pack("<Q", nonce))
+                next_ping[id(peer)] = now + args.interval
+                flush(sel, peer)
+        for key, events in sel.select(timeout=0.01):
+            peer = key.data
+            try:
+                if events & selectors.EVENT_READ:
+                    data = peer.sock.recv(65536)
+                    if not data:
+                        raise ConnectionError("closed by node")
+                    peer.recv += data
+                    for command, payload in peer.messages(magic):
+                        if command == "version":
+                            peer.send += message(magic, "verack")
+                        elif command == "verack":
+                            peer.ready = True
+                        elif command == "pong":
+                            nonce = struct.unpack("<Q", payload[:8])[0]
+                            sent = peer.ping_sent.pop(nonce, None)
+                            if sent is not None:
+                                rtts.append(time.time() - sent)
+                flush(sel, peer)
+            except (OSError, ValueError) as e:
+                print("peer dropped: %s" % e)
+                sel.unregister(peer.sock)
+                peer.sock.close()
+                peers.remove(peer)
+
+    for peer in peers:
+        lost += len(peer.ping_sent)
+    elapsed = time.time() - start
+    print("%d/%d peers connected, %d pongs in %.1fs (%.0f/s), %d unanswered" %
+          (len(peers), args.peers, len(rtts), elapsed, len(rtts) / elapsed, lost))
+    print("ping rtt ms: p50 %.2f  p90 %.2f  p99 %.2f  max %.2f" %
+          tuple(1000 * x for x in (percentile(rtts, 50), percentile(rtts, 90),
+                                   percentile(rtts, 99), percentile(rtts, 100))))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,34 @@
+// Copyright (c) 2014 The XDECoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BENCH_H
+#define BITCOIN_BENCH_H
+
+#include <string>
+#include <vector>
+
+/** A benchmark returns a line describing its results */
+typedef std::string (*BenchFunction)();
+
+/** A benchmark registered at startup by BENCHMARK() */
+class CBenchmark
+{
+private:
+    const char* pszName;
+    BenchFunction function;
+
+    static std::vector<CBenchmark*>& Registered();
+
+public:
+    CBenchmark(const char* pszNameIn, BenchFunction functionIn);
+
+    /** Run every benchmark whose name contains strFilter, printing its results */
+    static void RunAll(const std::string& strFilter);
+};
+
+#define BENCHMARK(name) \
+    static std::string name(); \
+    static CBenchmark benchmark_##name(#name, name); \
+    static std::string name()
+
+#endif
@@ -0,0 +1,65 @@
+// Copyright (c) 2014 The XDECoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include <iostream>
+
+#include "bench.h"
+#include "db.h"
+#include "main.h"
+#include "wallet.h"
+
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+extern void noui_connect();
+
+void Shutdown(void* parg)
+{
+  exit(0);
+}
+
+void StartShutdown()
+{
+  exit(0);
+}
+
+std::vector<CBenchmark*>& CBenchmark::Registered()
+{
+    // Function-local, so it exists before the first BENCHMARK registers
+    static std::vector<CBenchmark*> vBenchmarks;
+    return vBenchmarks;
+}
+
+CBenchmark::CBenchmark(const char* pszNameIn, BenchFunction functionIn) : pszName(pszNameIn), function(functionIn)
+{
+    Registered().push_back(this);
+}
+
+void CBenchmark::RunAll(const std::string& strFilter)
+{
+    BOOST_FOREACH(const CBenchmark* pbenchmark, Registered())
+        if (std::string(pbenchmark->pszName).find(strFilter) != std::string::npos)
+            std::cout << pbenchmark->pszName << ": " << pbenchmark->function() << std::endl;
+}
+
+// The same setup as test_bitcoin: a mock wallet database and a block index
+// holding the genesis block
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    fPrintToDebugger = true; // don't want to write to debug.log file
+    noui_connect();
+    bitdb.MakeMock();
+    LoadBlockIndex(true);
+    bool fFirstRun;
+    pwalletMain = new CWallet("wallet.dat");
+    pwalletMain->LoadWallet(fFirstRun);
+    RegisterWallet(pwalletMain);
+
+    CBenchmark::RunAll(GetArg("-filter", ""));
+
+    delete pwalletMain;
+    pwalletMain = NULL;
+    bitdb.Flush(true);
+    return 0;
+}
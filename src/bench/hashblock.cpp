@@ -0,0 +1,30 @@
+// Copyright (c) 2014 The XDECoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "bench.h"
+#include "hashblock.h"
+#include "util.h"
+
+// 80 byte headers per second hashed one at a time by Hash9 and in one
+// batch by Hash9Batch, and the batch's rate for each X13 stage
+BENCHMARK(hash9_headers)
+{
+    static const size_t nCount = 10000;
+    std::vector<unsigned char> vHeaders(nCount * 80);
+    for (size_t i = 0; i < vHeaders.size(); i++)
+        vHeaders[i] = GetRandInt(256);
+    std::vector<uint256> vHash(nCount), vHashBatch(nCount);
+
+    int64_t nStart = GetTimeMicros();
+    for (size_t i = 0; i < nCount; i++)
+        vHash[i] = Hash9(&vHeaders[i * 80], &vHeaders[(i + 1) * 80]);
+    int64_t nSingle = std::max(GetTimeMicros() - nStart, (int64_t)1);
+
+    CHash9BatchStats stats;
+    nStart = GetTimeMicros();
+    Hash9Batch(&vHeaders[0], 80, 80, nCount, &vHashBatch[0], &stats);
+    int64_t nBatch = std::max(GetTimeMicros() - nStart, (int64_t)1);
+
+    return strprintf("Hash9 %.0f/s, Hash9Batch %.0f/s%s; %s", 1000000.0 * nCount / nSingle, 1000000.0 * nCount / nBatch,
+                     vHash == vHashBatch ? "" : " (HASHES DIFFER)", stats.ToString().c_str());
+}
@@ -0,0 +1,43 @@
+// Copyright (c) 2014 The XDECoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "bench.h"
+#include "kernel.h"
+#include "main.h"
+#include "util.h"
+
+// Kernel hashes per microsecond over a minute of timestamps at a time:
+// CheckStakeKernelHash hashing each in full, against SearchStakeKernelHash
+// reusing the midstate of the fixed part
+BENCHMARK(kernel_search)
+{
+    CStakeCandidate candidate;
+    candidate.prevout = COutPoint(GetRandHash(), 1);
+    candidate.nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+    candidate.nTimeBlockFrom = 1400000000;
+    candidate.nTxPrevOffset = 81;
+    candidate.nTimeTxPrev = 1400000000;
+    candidate.nValue = 1000 * COIN;
+    candidate.fStakeModifier = true;
+
+    // An impossible target makes both test every timestamp
+    unsigned int nBits = 0x03000001;
+    unsigned int nTimeStart = candidate.nTimeBlockFrom + 30 * 24 * 60 * 60;
+    const unsigned int nRounds = 2000;
+    unsigned int nTimeTx = 0;
+    uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < nRounds; i++)
+        for (unsigned int n = 0; n < 60; n++)
+            CheckStakeKernelHash(nBits, candidate, nTimeStart + 60 * i - n, hashProofOfStake, targetProofOfStake);
+    int64_t nCheck = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < nRounds; i++)
+        SearchStakeKernelHash(nBits, candidate, nTimeStart + 60 * i, 60, nTimeTx, hashProofOfStake, targetProofOfStake);
+    int64_t nSearch = GetTimeMicros() - nStart;
+
+    return strprintf("full hashing %.2f kernels/us, midstate %.2f kernels/us",
+                     60.0 * nRounds / std::max(nCheck, (int64_t)1), 60.0 * nRounds / std::max(nSearch, (int64_t)1));
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2014 The XDECoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include <boost/filesystem.hpp>
+
+#include "bench.h"
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+// The bench chain only holds the genesis block, so it is read over and over
+static const int nReads = 10000;
+
+// Microseconds per read of the block at nFile, nBlockPos through the block
+// file handle cache
+static double TimeCachedReads(unsigned int nFile, unsigned int nBlockPos)
+{
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nReads; i++)
+    {
+        CBlock block;
+        block.ReadFromDisk(nFile, nBlockPos);
+    }
+    return (double)(GetTimeMicros() - nStart) / nReads;
+}
+
+// Block reads with fopen and fseek for every read, against the handle
+// cache's pread, a handle opened for every read, and the mmap of a
+// finalised block file
+BENCHMARK(block_read)
+{
+    unsigned int nFile = pindexGenesisBlock->nFile;
+    unsigned int nBlockPos = pindexGenesisBlock->nBlockPos;
+    CBlock blockGenesis;
+    if (!blockGenesis.ReadFromDisk(pindexGenesisBlock))
+        return "can't read the genesis block";
+
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nReads; i++)
+    {
+        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
+        CBlock block;
+        filein >> block;
+    }
+    double dOpen = (double)(GetTimeMicros() - nStart) / nReads;
+
+    double dCached = TimeCachedReads(nFile, nBlockPos);
+
+    unsigned int nCacheSizeSave = nBlockFileCacheSize;
+    nBlockFileCacheSize = 0;
+    double dUncached = TimeCachedReads(nFile, nBlockPos);
+    nBlockFileCacheSize = nCacheSizeSave;
+
+    // Only a block file grown to its size limit is mapped: copy the block
+    // into a sparse file that large
+    unsigned int nFileFull = 9999, nBlockPosFull = 0;
+    {
+        CAutoFile fileout = CAutoFile(OpenBlockFile(nFileFull, 0, "wb"), SER_DISK, CLIENT_VERSION);
+        if (!fileout)
+            return "can't write a block file";
+        fileout << FLATDATA(pchMessageStart) << (unsigned int)fileout.GetSerializeSize(blockGenesis);
+        nBlockPosFull = ftell(fileout);
+        fileout << blockGenesis;
+        fflush(fileout);
+        if (ftruncate(fileno(fileout), 0x7F000000) != 0)
+            return "can't grow a block file";
+    }
+    bool fMmapSave = fBlockFileMmap;
+    fBlockFileMmap = true;
+    double dMmap = TimeCachedReads(nFileFull, nBlockPosFull);
+    fBlockFileMmap = fMmapSave;
+    boost::filesystem::remove(GetDataDir() / strprintf("blk%04u.dat", nFileFull));
+
+    return strprintf("fopen+fseek %.2fus/read, cached pread %.2fus/read, open per read %.2fus/read, mmap %.2fus/read",
+                     dOpen, dCached, dUncached, dMmap);
+}
+
+// Serving getdata: deserialise and reserialise, or copy the raw bytes
+BENCHMARK(block_serve)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nReads; i++)
+    {
+        CBlock block;
+        block.ReadFromDisk(pindexGenesisBlock);
+        node.PushMessage("block", block);
+        node.vSend.clear();
+    }
+    int64_t nServe = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nReads; i++)
+    {
+        PushBlockFromDisk(&node, pindexGenesisBlock);
+        node.vSend.clear();
+    }
+    int64_t nServeRaw = GetTimeMicros() - nStart;
+
+    return strprintf("reserialised %.2fus/block, raw %.2fus/block",
+                     (double)nServe / nReads, (double)nServeRaw / nReads);
+}
@@ -0,0 +1,61 @@
+// Copyright (c) 2014 The XDECoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "bench.h"
+#include "main.h"
+#include "util.h"
+
+extern uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
+// The SIGHASH_ALL signature hash as it was computed, on a modified copy of
+// the transaction
+static uint256 SignatureHashCopy(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    CTransaction txTmp(txTo);
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+        txTmp.vin[i].scriptSig = CScript();
+    txTmp.vin[nIn].scriptSig = scriptCode;
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss.reserve(10000);
+    ss << txTmp << nHashType;
+    return Hash(ss.begin(), ss.end());
+}
+
+// Every input of a signed 500 input transaction, as block validation
+// hashes them, copying the transaction or streaming it
+BENCHMARK(sighash_500_inputs)
+{
+    static const int nInputs = 500;
+    CTransaction tx;
+    tx.nTime = GetAdjustedTime();
+    tx.vin.resize(nInputs);
+    for (int i = 0; i < nInputs; i++)
+    {
+        tx.vin[i].prevout = COutPoint(GetRandHash(), GetRandInt(4));
+        tx.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+    }
+    tx.vout.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        tx.vout[i].nValue = GetRand(100 * COIN);
+        tx.vout[i].scriptPubKey << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    CScript scriptCode;
+    scriptCode << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    uint256 hashCopy = 0, hashStream = 0;
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nInputs; i++)
+        hashCopy ^= SignatureHashCopy(scriptCode, tx, i, SIGHASH_ALL);
+    int64_t nCopy = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nInputs; i++)
+        hashStream ^= SignatureHash(scriptCode, tx, i, SIGHASH_ALL);
+    int64_t nStream = GetTimeMicros() - nStart;
+
+    return strprintf("copied %.2fms, streamed %.2fms%s", nCopy / 1000.0, nStream / 1000.0,
+                     hashCopy == hashStream ? "" : " (HASHES DIFFER)");
+}
@@ -0,0 +1,74 @@
+// Copyright (c) 2014 The XDECoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "bench.h"
+#include "main.h"
+#include "util.h"
+#include "wallet.h"
+
+using namespace std;
+
+extern int64_t nStakeCombineThreshold;
+
+static CWallet wallet;
+
+static void AddCoin(vector<COutput>& vCoins, int64_t nValue)
+{
+    static int i;
+    CTransaction tx;
+    tx.nLockTime = i++;        // so all transactions get different hashes
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    vCoins.push_back(COutput(new CWalletTx(&wallet, tx), 0, 6*24));
+}
+
+// Time per payment, how many payments need no change output and how many
+// inputs they take, for 5000 coins of each of three value distributions
+BENCHMARK(coin_selection)
+{
+    static const char* pszDistribution[] = {"dust-heavy", "staking-heavy", "uniform"};
+    static const int nCoins = 5000, nTargets = 20;
+    const unsigned int nSpendTime = numeric_limits<unsigned int>::max();
+    int64_t nCostOfChange = max(nTransactionFee, MIN_TX_FEE) * (34 + 148) / 1000;
+    string strResult;
+
+    for (int nDist = 0; nDist < 3; nDist++)
+    {
+        vector<COutput> vCoins;
+        int64_t nTotal = 0;
+        for (int i = 0; i < nCoins; i++)
+        {
+            int64_t nValue;
+            if (nDist == 0)
+                nValue = (i % 10) ? CENT / 10 + GetRand(CENT) : CENT + GetRand(100 * COIN);
+            else if (nDist == 1)
+                nValue = (i % 10) ? nStakeCombineThreshold / 2 + GetRand(nStakeCombineThreshold / 2) : COIN + GetRand(10 * COIN);
+            else
+                nValue = 1 + GetRand(100 * COIN);
+            AddCoin(vCoins, nValue);
+            nTotal += nValue;
+        }
+
+        int nChangeless = 0, nInputs = 0;
+        int64_t nStart = GetTimeMicros();
+        for (int i = 0; i < nTargets; i++)
+        {
+            set<pair<const CWalletTx*,unsigned int> > setCoinsRet;
+            int64_t nValueRet;
+            int64_t nTarget = 1 + GetRand(nTotal / 4);
+            if (!wallet.SelectCoinsMinConf(nTarget, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet))
+                continue;
+            if (nValueRet - nTarget <= nCostOfChange)
+                nChangeless++;
+            nInputs += setCoinsRet.size();
+        }
+        int64_t nTime = GetTimeMicros() - nStart;
+
+        strResult += strprintf("%s%s %.2fms/payment, %d/%d changeless, %.1f inputs",
+                               nDist ? "; " : "", pszDistribution[nDist], nTime / 1000.0 / nTargets,
+                               nChangeless, nTargets, (double)nInputs / nTargets);
+        BOOST_FOREACH(const COutput& output, vCoins)
+            delete output.tx;
+    }
+    return strResult;
+}
@@ -7,6 +7,7 @@
 #include <map>
 #include "net.h"
 #include "util.h"
+#include "main.h"
 
 #define CHECKPOINT_MAX_SPAN (60 * 60) // max 1 hour before latest block
 
@@ -43,7 +44,7 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex);
 
     extern uint256 hashSyncCheckpoint;
     extern CSyncCheckpoint checkpointMessage;
@@ -5,6 +5,8 @@
 #ifndef CHECKQUEUE_H
 #define CHECKQUEUE_H
 
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
@@ -147,12 +149,41 @@ public:
             condWorker.notify_all();
     }
 
+    // Let the worker threads return once the queue is drained
+    void Quit() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+        condWorker.notify_all();
+    }
+
     ~CCheckQueue() {
     }
 
     friend class CCheckQueueControl<T>;
 };
 
+/** A CCheckQueue with its own worker threads, for work that only lasts as
+ *  long as one function. The workers are started on construction and
+ *  stopped and joined on destruction, however the function is left.
+ */
+template<typename T> class CCheckQueuePool {
+private:
+    boost::thread_group threadGroup;
+
+public:
+    CCheckQueue<T> queue;
+
+    CCheckQueuePool(int nThreads, unsigned int nBatchSize) : queue(nBatchSize) {
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<T>::Thread, &queue));
+    }
+
+    ~CCheckQueuePool() {
+        queue.Quit();
+        threadGroup.join_all();
+    }
+};
+
 /** RAII-style controller object for a CCheckQueue that guarantees the passed
  *  queue is finished before continuing.
  */
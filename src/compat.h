@@ -28,6 +28,12 @@
 typedef u_int SOCKET;
 #endif
 
+// The socket handler uses edge-triggered epoll where it exists and
+// select() everywhere else (or with -epoll=0)
+#ifdef __linux__
+#define USE_EPOLL 1
+#endif
+
 
 #ifdef WIN32
 #define MSG_NOSIGNAL        0
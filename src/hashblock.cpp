@@ -0,0 +1,132 @@
+// Copyright (c) 2014 The XDECoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#define GLOBALDEFINED
+#include "hashblock.h"
+#include "util.h"
+
+#include <string.h>
+
+// Pre-initialised contexts, filled once at startup. Every lane starts from
+// a copy of these instead of re-running the *_init functions.
+static struct CHash9Init
+{
+    CHash9Init() { fillz(); }
+} hash9init;
+
+typedef void (*Hash9UpdateFn)(void* cc, const void* data, size_t len);
+typedef void (*Hash9CloseFn)(void* cc, void* dst);
+
+union CHash9Context
+{
+    sph_blake512_context     blake;
+    sph_bmw512_context       bmw;
+    sph_groestl512_context   groestl;
+    sph_jh512_context        jh;
+    sph_keccak512_context    keccak;
+    sph_skein512_context     skein;
+    sph_luffa512_context     luffa;
+    sph_cubehash512_context  cubehash;
+    sph_shavite512_context   shavite;
+    sph_simd512_context      simd;
+    sph_echo512_context      echo;
+    sph_hamsi512_context     hamsi;
+    sph_fugue512_context     fugue;
+};
+
+struct CHash9Stage
+{
+    const char* pszName;
+    const void* pctxInit;
+    size_t nCtxSize;
+    Hash9UpdateFn update;
+    Hash9CloseFn close;
+};
+
+// Same order as Hash9()
+static const CHash9Stage vStages[HASH9_STAGES] =
+{
+    { "blake",    &z_blake,    sizeof(z_blake),    sph_blake512,    sph_blake512_close },
+    { "bmw",      &z_bmw,      sizeof(z_bmw),      sph_bmw512,      sph_bmw512_close },
+    { "groestl",  &z_groestl,  sizeof(z_groestl),  sph_groestl512,  sph_groestl512_close },
+    { "skein",    &z_skein,    sizeof(z_skein),    sph_skein512,    sph_skein512_close },
+    { "jh",       &z_jh,       sizeof(z_jh),       sph_jh512,       sph_jh512_close },
+    { "keccak",   &z_keccak,   sizeof(z_keccak),   sph_keccak512,   sph_keccak512_close },
+    { "luffa",    &z_luffa,    sizeof(z_luffa),    sph_luffa512,    sph_luffa512_close },
+    { "cubehash", &z_cubehash, sizeof(z_cubehash), sph_cubehash512, sph_cubehash512_close },
+    { "shavite",  &z_shavite,  sizeof(z_shavite),  sph_shavite512,  sph_shavite512_close },
+    { "simd",     &z_simd,     sizeof(z_simd),     sph_simd512,     sph_simd512_close },
+    { "echo",     &z_echo,     sizeof(z_echo),     sph_echo512,     sph_echo512_close },
+    { "hamsi",    &z_hamsi,    sizeof(z_hamsi),    sph_hamsi512,    sph_hamsi512_close },
+    { "fugue",    &z_fugue,    sizeof(z_fugue),    sph_fugue512,    sph_fugue512_close },
+};
+
+// Lanes processed per pass; two uint512 buffers of this size live on the stack
+static const size_t HASH9_LANES = 64;
+
+const char* Hash9StageName(int nStage)
+{
+    if (nStage < 0 || nStage >= HASH9_STAGES)
+        return "unknown";
+    return vStages[nStage].pszName;
+}
+
+void CHash9BatchStats::SetNull()
+{
+    for (int i = 0; i < HASH9_STAGES; i++)
+        nStageMicros[i] = 0;
+    nHashes = 0;
+}
+
+std::string CHash9BatchStats::ToString() const
+{
+    std::string str = strprintf("%"PRIu64" hashes:", nHashes);
+    for (int i = 0; i < HASH9_STAGES; i++)
+        str += strprintf(" %s=%.0f/s", vStages[i].pszName,
+                         nStageMicros[i] > 0 ? 1000000.0 * nHashes / nStageMicros[i] : 0.0);
+    return str;
+}
+
+void Hash9Batch(const unsigned char* pbegin, size_t nLen, size_t nStride, size_t nCount,
+                uint256* phashRet, CHash9BatchStats* pstats)
+{
+    static unsigned char pblank[1];
+    CHash9Context ctx;
+    uint512 hashA[HASH9_LANES];
+    uint512 hashB[HASH9_LANES];
+
+    for (size_t nFirst = 0; nFirst < nCount; nFirst += HASH9_LANES)
+    {
+        size_t nLanes = std::min(HASH9_LANES, nCount - nFirst);
+        uint512* pin = hashA;
+        uint512* pout = hashB;
+
+        for (int nStage = 0; nStage < HASH9_STAGES; nStage++)
+        {
+            const CHash9Stage& stage = vStages[nStage];
+            int64_t nStart = pstats ? GetTimeMicros() : 0;
+
+            for (size_t i = 0; i < nLanes; i++)
+            {
+                memcpy(&ctx, stage.pctxInit, stage.nCtxSize);
+                if (nStage == 0)
+                    stage.update(&ctx, nLen ? pbegin + (nFirst + i) * nStride : pblank, nLen);
+                else
+                    stage.update(&ctx, &pin[i], 64);
+                stage.close(&ctx, &pout[i]);
+            }
+
+            if (pstats)
+                pstats->nStageMicros[nStage] += GetTimeMicros() - nStart;
+            std::swap(pin, pout);
+        }
+
+        // After the last swap the final stage output is in pin
+        for (size_t i = 0; i < nLanes; i++)
+            phashRet[nFirst + i] = pin[i].trim256();
+    }
+
+    if (pstats)
+        pstats->nHashes += nCount;
+}
@@ -17,9 +17,7 @@
 #include "sph_hamsi.h"
 #include "sph_fugue.h"
 
-#ifndef QT_NO_DEBUG
 #include <string>
-#endif
 
 #ifdef GLOBALDEFINED
 #define GLOBAL
@@ -149,6 +147,30 @@ inline uint256 Hash9(const T1 pbegin, const T1 pend)
     return hash[12].trim256();
 }
 
+/** Number of chained algorithms in X13 */
+static const int HASH9_STAGES = 13;
+
+/** Per-stage timings collected by Hash9Batch */
+struct CHash9BatchStats
+{
+    int64_t nStageMicros[HASH9_STAGES];
+    uint64_t nHashes;
+
+    CHash9BatchStats() { SetNull(); }
+    void SetNull();
+    std::string ToString() const;
+};
+
+const char* Hash9StageName(int nStage);
+
+/** Hash nCount equally sized inputs (e.g. 80 byte block headers) laid out
+ *  nStride bytes apart. The batch runs X13 one algorithm at a time across
+ *  all lanes, starting every lane from a pre-initialised context, so each
+ *  stage's tables stay hot in cache. Results match Hash9() exactly.
+ */
+void Hash9Batch(const unsigned char* pbegin, size_t nLen, size_t nStride, size_t nCount,
+                uint256* phashRet, CHash9BatchStats* pstats = NULL);
+
 
 
 
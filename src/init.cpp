@@ -86,6 +86,10 @@ void Shutdown(void* parg)
 //        CTxDB().Close();
         bitdb.Flush(false);
         StopNode();
+        {
+            LOCK(cs_main);
+            CTxDB().FlushBatch();
+        }
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -235,6 +239,13 @@ std::string HelpMessage()
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -blockfilecache=<n>    " + _("Keep up to <n> block files open for reading (default: 16)") + "\n" +
+        "  -blockfilemmap         " + _("Memory-map block files that are no longer appended to") + "\n" +
+        "  -txcache=<n>           " + _("Cache up to <n> megabytes of transaction index entries and outputs (default: 32)") + "\n" +
+        "  -sigcachesize=<n>      " + _("Cache up to <n> megabytes of verified signatures (default: 4, 0 disables)") + "\n" +
+        "  -dbbatchblocks=<n>     " + _("Write up to <n> blocks per database commit during initial block download (default: 32)") + "\n" +
+        "  -dbsyncall             " + _("Sync every database commit to disk, not only those that move the chain tip") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
@@ -243,6 +254,9 @@ std::string HelpMessage()
         "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + "\n" +
         "  -port=<port>           " + _("Listen for connections on <port> (default: 25080 or testnet: 25081)") + "\n" +
         "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n" +
+#ifdef USE_EPOLL
+        "  -epoll                 " + _("Use epoll instead of select() for peer sockets (default: 1)") + "\n" +
+#endif
         "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n" +
         "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n" +
         "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n" +
@@ -253,6 +267,7 @@ std::string HelpMessage()
         "  -listen                " + _("Accept connections from outside (default: 1 if no -proxy or -connect)") + "\n" +
         "  -bind=<addr>           " + _("Bind to given address. Use [host]:port notation for IPv6") + "\n" +
         "  -dnsseed               " + _("Find peers using DNS lookup (default: 1)") + "\n" +
+        "  -headersfirst          " + _("Download block headers first, then the blocks from several peers at once (default: 1)") + "\n" +
         "  -staking               " + _("Stake your coins to support network and gain reward (default: 1)") + "\n" +
         "  -synctime              " + _("Sync time with other nodes. Disable if time on your system is precise e.g. syncing with NTP (default: 1)") + "\n" +
         "  -cppolicy              " + _("Sync checkpoints policy (default: strict)") + "\n" +
@@ -278,7 +293,10 @@ std::string HelpMessage()
 #endif
         "  -testnet               " + _("Use the test network") + "\n" +
         "  -debug                 " + _("Output extra debugging information. Implies all other -debug* options") + "\n" +
+        "  -debug=<category>      " + _("Output debugging information for <category> only (net)") + "\n" +
         "  -debugnet              " + _("Output extra network debugging information") + "\n" +
+        "  -benchmark             " + _("Output block connection and script verification timings") + "\n" +
+        "  -perfstatsinterval=<n> " + _("Write message handling and block acceptance timings to the debug log every <n> seconds (default: 0, off)") + "\n" +
         "  -logtimestamps         " + _("Prepend debug output with timestamp") + "\n" +
         "  -shrinkdebugfile       " + _("Shrink debug.log file on client startup (default: 1 when no -debug)") + "\n" +
         "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n" +
@@ -370,6 +388,23 @@ bool AppInit2()
     fUseFastIndex = GetBoolArg("-fastindex", true);
     nMinerSleep = GetArg("-minersleep", 500);
 
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    InitSignatureCache(std::max((int64_t)0, GetArg("-sigcachesize", DEFAULT_SIGCACHE_SIZE)));
+    nBlockFileCacheSize = std::max((int64_t)0, GetArg("-blockfilecache", 16));
+    fBlockFileMmap = GetBoolArg("-blockfilemmap");
+    nDBBatchBlocks = std::min((int64_t)1000, std::max((int64_t)1, GetArg("-dbbatchblocks", 32)));
+    fDBSyncAll = GetBoolArg("-dbsyncall");
+    nTxCacheSize = std::max((int64_t)0, GetArg("-txcache", 32)) * 1048576;
+    fHeadersFirst = GetBoolArg("-headersfirst", true);
+
     CheckpointsMode = Checkpoints::STRICT;
     std::string strCpMode = GetArg("-cppolicy", "strict");
 
@@ -425,13 +460,22 @@ bool AppInit2()
 
     // ********************************************************* Step 3: parameter-to-internal-flags
 
-    fDebug = GetBoolArg("-debug");
+    // -debug (or -debug=1) logs everything, -debug=<category> only that category
+    BOOST_FOREACH(const std::string& strCategory, mapMultiArgs["-debug"])
+    {
+        if (strCategory.empty() || strCategory == "1")
+            fDebug = true;
+        else if (strCategory != "0")
+            setDebugCategories.insert(strCategory);
+    }
 
     // -debug implies fDebug*
-    if (fDebug)
+    if (fDebug || setDebugCategories.count("net"))
         fDebugNet = true;
     else
         fDebugNet = GetBoolArg("-debugnet");
+    if (fDebugNet)
+        setDebugCategories.insert("net");
 
     bitdb.SetDetach(GetBoolArg("-detachdb", false));
 
@@ -450,6 +494,7 @@ bool AppInit2()
 #if !defined(QT_GUI)
     fServer = true;
 #endif
+    fBenchmark = GetBoolArg("-benchmark");
     fPrintToConsole = GetBoolArg("-printtoconsole");
     fPrintToDebugger = GetBoolArg("-printtodebugger");
     fLogTimestamps = GetBoolArg("-logtimestamps");
@@ -519,6 +564,7 @@ bool AppInit2()
 
     if (GetBoolArg("-shrinkdebugfile", !fDebug))
         ShrinkDebugFile();
+    StartDebugLogWriter();
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("XDECoin version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
@@ -531,6 +577,13 @@ bool AppInit2()
     if (fDaemon)
         fprintf(stdout, "XDECoin server starting\n");
 
+    if (nScriptCheckThreads) {
+        printf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            if (!NewThread(ThreadScriptCheck, NULL))
+                return InitError(_("Error: could not start script verification threads"));
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -733,7 +786,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
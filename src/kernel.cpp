@@ -215,9 +215,16 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+{
+    uint256 hashModifierBlock;
+    return GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, hashModifierBlock, fPrintProofOfStake);
+}
+
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, uint256& hashModifierBlock, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
+    hashModifierBlock = 0;
     if (!mapBlockIndex.count(hashBlockFrom))
         return error("GetKernelStakeModifier() : block not indexed");
     const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
@@ -244,9 +251,20 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+    hashModifierBlock = pindex->GetBlockHash();
     return true;
 }
 
+// The modifier only depends on the main chain between the coin's block and
+// the block it was read from, so it holds as long as that block stays in it
+bool CStakeCandidate::IsModifierCurrent() const
+{
+    if (!fStakeModifier)
+        return false;
+    BlockMap::const_iterator mi = mapBlockIndex.find(hashModifierBlock);
+    return mi != mapBlockIndex.end() && mi->second->IsInMainChain();
+}
+
 // XDECoin kernel protocol
 // coinstake must meet hash target according to the protocol:
 // kernel (input 0) must meet the formula
@@ -329,6 +347,316 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return true;
 }
 
+bool CheckStakeKernelHash(unsigned int nBits, const CStakeCandidate& candidate, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake)
+{
+    if (nTimeTx < candidate.nTimeTxPrev)  // Transaction timestamp violation
+        return false;
+    if (candidate.nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
+        return false;
+    if (!candidate.fStakeModifier)
+        return false;
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
+    CBigNum bnCoinDayWeight = CBigNum(candidate.nValue) * GetWeight((int64_t)candidate.nTimeTxPrev, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
+    targetProofOfStake = (bnCoinDayWeight * bnTargetPerCoinDay).getuint256();
+
+    // Same preimage as CheckStakeKernelHash() above
+    CDataStream ss(SER_GETHASH, 0);
+    ss << candidate.nStakeModifier;
+    ss << candidate.nTimeBlockFrom << candidate.nTxPrevOffset << candidate.nTimeTxPrev << candidate.prevout.n << nTimeTx;
+    hashProofOfStake = Hash(ss.begin(), ss.end());
+
+    if (CBigNum(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay)
+        return false;
+    if (fDebug)
+        printf("CheckStakeKernelHash() : pass modifier=0x%016"PRIx64" nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
+            candidate.nStakeModifier,
+            candidate.nTimeBlockFrom, candidate.nTxPrevOffset, candidate.nTimeTxPrev, candidate.prevout.n, nTimeTx,
+            hashProofOfStake.ToString().c_str());
+    return true;
+}
+
+//
+// Stake kernel search
+//
+// The kernel preimage is 28 bytes: nStakeModifier, nTimeBlockFrom,
+// nTxPrevOffset, nTimeTxPrev and prevout.n (24 constant bytes) followed by
+// nTimeTx. It fits in one SHA-256 block whose first six words never change
+// during a search, so the first six rounds are run once per coin and only
+// the remaining rounds and the second SHA-256 are run per timestamp, for
+// KERNEL_SEARCH_LANES timestamps at a time. The lanes are laid out so the
+// compiler can keep them in vector registers where the target supports it.
+//
+
+static const unsigned int KERNEL_SEARCH_LANES = 8;
+
+static const uint32_t pSHA256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t pSHA256Init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t KernelRotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+static inline uint32_t KernelReadLE32(const unsigned char* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+static inline uint32_t KernelByteSwap(uint32_t x) { return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24); }
+
+// One SHA-256 round on all lanes
+#define KERNEL_ROUND(i, W) \
+    for (unsigned int l = 0; l < KERNEL_SEARCH_LANES; l++) { \
+        uint32_t t1 = h[l] + (KernelRotr(e[l], 6) ^ KernelRotr(e[l], 11) ^ KernelRotr(e[l], 25)) + \
+                      ((e[l] & f[l]) ^ (~e[l] & g[l])) + pSHA256K[i] + W[i][l]; \
+        uint32_t t2 = (KernelRotr(a[l], 2) ^ KernelRotr(a[l], 13) ^ KernelRotr(a[l], 22)) + \
+                      ((a[l] & b[l]) ^ (a[l] & c[l]) ^ (b[l] & c[l])); \
+        h[l] = g[l]; g[l] = f[l]; f[l] = e[l]; e[l] = d[l] + t1; \
+        d[l] = c[l]; c[l] = b[l]; b[l] = a[l]; a[l] = t1 + t2; \
+    }
+
+static void KernelExpand(uint32_t W[64][KERNEL_SEARCH_LANES])
+{
+    for (int i = 16; i < 64; i++)
+        for (unsigned int l = 0; l < KERNEL_SEARCH_LANES; l++)
+        {
+            uint32_t s0 = KernelRotr(W[i-15][l], 7) ^ KernelRotr(W[i-15][l], 18) ^ (W[i-15][l] >> 3);
+            uint32_t s1 = KernelRotr(W[i-2][l], 17) ^ KernelRotr(W[i-2][l], 19) ^ (W[i-2][l] >> 10);
+            W[i][l] = W[i-16][l] + s0 + W[i-7][l] + s1;
+        }
+}
+
+class CKernelSearchState
+{
+public:
+    uint32_t pnMidstate[8];  // working variables after rounds 0-5
+    uint32_t pnWord[6];      // constant message words 0-5
+
+    explicit CKernelSearchState(const CStakeCandidate& candidate)
+    {
+        unsigned char pchPreimage[24];
+        uint64_t nModifier = candidate.nStakeModifier;
+        for (int i = 0; i < 8; i++)
+            pchPreimage[i] = (nModifier >> (8 * i)) & 0xff;
+        uint32_t pnFields[4] = { candidate.nTimeBlockFrom, candidate.nTxPrevOffset, candidate.nTimeTxPrev, candidate.prevout.n };
+        for (int j = 0; j < 4; j++)
+            for (int i = 0; i < 4; i++)
+                pchPreimage[8 + 4 * j + i] = (pnFields[j] >> (8 * i)) & 0xff;
+        for (int i = 0; i < 6; i++)
+            pnWord[i] = KernelByteSwap(KernelReadLE32(&pchPreimage[4 * i]));
+
+        uint32_t s[8];
+        memcpy(s, pSHA256Init, sizeof(s));
+        for (int i = 0; i < 6; i++)
+        {
+            uint32_t t1 = s[7] + (KernelRotr(s[4], 6) ^ KernelRotr(s[4], 11) ^ KernelRotr(s[4], 25)) +
+                          ((s[4] & s[5]) ^ (~s[4] & s[6])) + pSHA256K[i] + pnWord[i];
+            uint32_t t2 = (KernelRotr(s[0], 2) ^ KernelRotr(s[0], 13) ^ KernelRotr(s[0], 22)) +
+                          ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+            s[7] = s[6]; s[6] = s[5]; s[5] = s[4]; s[4] = s[3] + t1;
+            s[3] = s[2]; s[2] = s[1]; s[1] = s[0]; s[0] = t1 + t2;
+        }
+        memcpy(pnMidstate, s, sizeof(s));
+    }
+
+    // Double SHA-256 of the preimage for each lane's nTimeTx. pnHash receives
+    // the result as uint256 limbs (least significant first).
+    void Hash(const uint32_t pnTimeTx[KERNEL_SEARCH_LANES], uint32_t pnHash[KERNEL_SEARCH_LANES][8]) const
+    {
+        uint32_t W[64][KERNEL_SEARCH_LANES];
+        uint32_t a[KERNEL_SEARCH_LANES], b[KERNEL_SEARCH_LANES], c[KERNEL_SEARCH_LANES], d[KERNEL_SEARCH_LANES];
+        uint32_t e[KERNEL_SEARCH_LANES], f[KERNEL_SEARCH_LANES], g[KERNEL_SEARCH_LANES], h[KERNEL_SEARCH_LANES];
+
+        // First SHA-256: 28 byte message, padding and bit length are constant
+        for (unsigned int l = 0; l < KERNEL_SEARCH_LANES; l++)
+        {
+            for (int i = 0; i < 6; i++)
+                W[i][l] = pnWord[i];
+            W[6][l] = KernelByteSwap(pnTimeTx[l]);
+            W[7][l] = 0x80000000;
+            for (int i = 8; i < 15; i++)
+                W[i][l] = 0;
+            W[15][l] = 28 * 8;
+            a[l] = pnMidstate[0]; b[l] = pnMidstate[1]; c[l] = pnMidstate[2]; d[l] = pnMidstate[3];
+            e[l] = pnMidstate[4]; f[l] = pnMidstate[5]; g[l] = pnMidstate[6]; h[l] = pnMidstate[7];
+        }
+        KernelExpand(W);
+        for (int i = 6; i < 64; i++)
+            KERNEL_ROUND(i, W);
+
+        // Second SHA-256 over the 32 byte digest
+        for (unsigned int l = 0; l < KERNEL_SEARCH_LANES; l++)
+        {
+            W[0][l] = a[l] + pSHA256Init[0]; W[1][l] = b[l] + pSHA256Init[1];
+            W[2][l] = c[l] + pSHA256Init[2]; W[3][l] = d[l] + pSHA256Init[3];
+            W[4][l] = e[l] + pSHA256Init[4]; W[5][l] = f[l] + pSHA256Init[5];
+            W[6][l] = g[l] + pSHA256Init[6]; W[7][l] = h[l] + pSHA256Init[7];
+            W[8][l] = 0x80000000;
+            for (int i = 9; i < 15; i++)
+                W[i][l] = 0;
+            W[15][l] = 32 * 8;
+            a[l] = pSHA256Init[0]; b[l] = pSHA256Init[1]; c[l] = pSHA256Init[2]; d[l] = pSHA256Init[3];
+            e[l] = pSHA256Init[4]; f[l] = pSHA256Init[5]; g[l] = pSHA256Init[6]; h[l] = pSHA256Init[7];
+        }
+        KernelExpand(W);
+        for (int i = 0; i < 64; i++)
+            KERNEL_ROUND(i, W);
+
+        for (unsigned int l = 0; l < KERNEL_SEARCH_LANES; l++)
+        {
+            pnHash[l][0] = KernelByteSwap(a[l] + pSHA256Init[0]); pnHash[l][1] = KernelByteSwap(b[l] + pSHA256Init[1]);
+            pnHash[l][2] = KernelByteSwap(c[l] + pSHA256Init[2]); pnHash[l][3] = KernelByteSwap(d[l] + pSHA256Init[3]);
+            pnHash[l][4] = KernelByteSwap(e[l] + pSHA256Init[4]); pnHash[l][5] = KernelByteSwap(f[l] + pSHA256Init[5]);
+            pnHash[l][6] = KernelByteSwap(g[l] + pSHA256Init[6]); pnHash[l][7] = KernelByteSwap(h[l] + pSHA256Init[7]);
+        }
+    }
+};
+
+#undef KERNEL_ROUND
+
+// Multiply the nLimbs least significant first limbs in pn by n in place,
+// returning the carry out of the top limb
+static uint32_t KernelMulLimbs(uint32_t* pn, int nLimbs, uint32_t n)
+{
+    uint64_t nCarry = 0;
+    for (int i = 0; i < nLimbs; i++)
+    {
+        nCarry += (uint64_t)pn[i] * n;
+        pn[i] = (uint32_t)nCarry;
+        nCarry >>= 32;
+    }
+    return (uint32_t)nCarry;
+}
+
+static void KernelDivLimbs(uint32_t* pn, int nLimbs, uint32_t n)
+{
+    uint64_t nRem = 0;
+    for (int i = nLimbs - 1; i >= 0; i--)
+    {
+        nRem = (nRem << 32) | pn[i];
+        pn[i] = (uint32_t)(nRem / n);
+        nRem %= n;
+    }
+}
+
+// targetProofOfStake for a given coin weight, computed the same way as the
+// CBigNum expression in CheckStakeKernelHash. Returns false if the product
+// doesn't fit in 256 bits, i.e. every hash meets it.
+static bool KernelTarget(const uint32_t pnTargetPerCoinDay[8], int64_t nValue, uint32_t nWeight, uint32_t pnTarget[8])
+{
+    // nCoinDayWeight = nValue * nWeight / COIN / (24 * 60 * 60), at most 96 bits
+    uint32_t pnCoinDayWeight[3] = { (uint32_t)nValue, (uint32_t)((uint64_t)nValue >> 32), 0 };
+    pnCoinDayWeight[2] = KernelMulLimbs(pnCoinDayWeight, 2, nWeight);
+    KernelDivLimbs(pnCoinDayWeight, 3, (uint32_t)COIN);
+    KernelDivLimbs(pnCoinDayWeight, 3, 24 * 60 * 60);
+
+    uint32_t pnProduct[11];
+    memset(pnProduct, 0, sizeof(pnProduct));
+    for (int j = 0; j < 3; j++)
+    {
+        uint64_t nCarry = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            nCarry += (uint64_t)pnTargetPerCoinDay[i] * pnCoinDayWeight[j] + pnProduct[i + j];
+            pnProduct[i + j] = (uint32_t)nCarry;
+            nCarry >>= 32;
+        }
+        for (int k = j + 8; nCarry && k < 11; k++)
+        {
+            nCarry += pnProduct[k];
+            pnProduct[k] = (uint32_t)nCarry;
+            nCarry >>= 32;
+        }
+    }
+    memcpy(pnTarget, pnProduct, 8 * sizeof(uint32_t));
+    return !(pnProduct[8] | pnProduct[9] | pnProduct[10]);
+}
+
+static bool KernelHashMeetsTarget(const uint32_t pnHash[8], const uint32_t pnTarget[8])
+{
+    for (int i = 7; i >= 0; i--)
+        if (pnHash[i] != pnTarget[i])
+            return pnHash[i] < pnTarget[i];
+    return true;
+}
+
+static uint256 KernelLimbsToUint256(const uint32_t pn[8])
+{
+    uint256 n;
+    unsigned char* p = n.begin();
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 4; j++)
+            p[4 * i + j] = (pn[i] >> (8 * j)) & 0xff;
+    return n;
+}
+
+bool SearchStakeKernelHash(unsigned int nBits, const CStakeCandidate& candidate, unsigned int nTimeTxFrom, unsigned int nSearch, unsigned int& nTimeTxRet, uint256& hashProofOfStake, uint256& targetProofOfStake)
+{
+    if (!candidate.fStakeModifier || nSearch == 0)
+        return false;
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    uint256 targetPerCoinDay = bnTargetPerCoinDay.getuint256();
+    uint32_t pnTargetPerCoinDay[8];
+    const unsigned char* p = targetPerCoinDay.begin();
+    for (int i = 0; i < 8; i++)
+        pnTargetPerCoinDay[i] = KernelReadLE32(p + 4 * i);
+
+    CKernelSearchState state(candidate);
+    for (unsigned int nDone = 0; nDone < nSearch; nDone += KERNEL_SEARCH_LANES)
+    {
+        uint32_t pnTimeTx[KERNEL_SEARCH_LANES];
+        for (unsigned int l = 0; l < KERNEL_SEARCH_LANES; l++)
+            pnTimeTx[l] = nTimeTxFrom - nDone - l;
+
+        uint32_t pnHash[KERNEL_SEARCH_LANES][8];
+        state.Hash(pnTimeTx, pnHash);
+
+        // Lanes are in descending time order, so the first hit is the latest
+        for (unsigned int l = 0; l < KERNEL_SEARCH_LANES && nDone + l < nSearch; l++)
+        {
+            unsigned int nTimeTx = pnTimeTx[l];
+            if (nTimeTx < candidate.nTimeTxPrev || candidate.nTimeBlockFrom + nStakeMinAge > nTimeTx)
+                continue;
+            int64_t nWeight = GetWeight((int64_t)candidate.nTimeTxPrev, (int64_t)nTimeTx);
+            if (nWeight <= 0 || nWeight > (int64_t)0xffffffff || candidate.nValue < 0)
+            {
+                // Outside the range of the fast target arithmetic
+                if (CheckStakeKernelHash(nBits, candidate, nTimeTx, hashProofOfStake, targetProofOfStake))
+                {
+                    nTimeTxRet = nTimeTx;
+                    return true;
+                }
+                continue;
+            }
+
+            uint32_t pnTarget[8];
+            bool fFits = KernelTarget(pnTargetPerCoinDay, candidate.nValue, (uint32_t)nWeight, pnTarget);
+            if (fFits && !KernelHashMeetsTarget(pnHash[l], pnTarget))
+                continue;
+
+            nTimeTxRet = nTimeTx;
+            hashProofOfStake = KernelLimbsToUint256(pnHash[l]);
+            targetProofOfStake = KernelLimbsToUint256(pnTarget);
+            if (fDebug)
+                printf("SearchStakeKernelHash() : pass modifier=0x%016"PRIx64" nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
+                    candidate.nStakeModifier,
+                    candidate.nTimeBlockFrom, candidate.nTxPrevOffset, candidate.nTimeTxPrev, candidate.prevout.n, nTimeTx,
+                    hashProofOfStake.ToString().c_str());
+            return true;
+        }
+    }
+    return false;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
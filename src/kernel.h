@@ -20,6 +20,56 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
+// Everything the kernel hash needs to know about a staking coin, so that
+// the stake search can run without reading blocks or transactions from disk
+class CStakeCandidate
+{
+public:
+    COutPoint prevout;
+    uint256 hashBlockFrom;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    int64_t nValue;
+    uint64_t nStakeModifier;
+    bool fStakeModifier; // modifier is only known once the chain has moved past the selection interval
+    uint256 hashModifierBlock; // main chain block the modifier was read from
+
+    CStakeCandidate()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        prevout.SetNull();
+        hashBlockFrom = 0;
+        nTimeBlockFrom = 0;
+        nTxPrevOffset = 0;
+        nTimeTxPrev = 0;
+        nValue = 0;
+        nStakeModifier = 0;
+        fStakeModifier = false;
+        hashModifierBlock = 0;
+    }
+
+    // False once a reorg has taken the modifier's block out of the main chain
+    bool IsModifierCurrent() const;
+};
+
+// Get the stake modifier of the kernel whose coin was confirmed in hashBlockFrom
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake);
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, uint256& hashModifierBlock, bool fPrintProofOfStake);
+
+// Check whether a cached stake candidate meets hash target at nTimeTx
+bool CheckStakeKernelHash(unsigned int nBits, const CStakeCandidate& candidate, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake);
+
+// Search timestamps nTimeTxFrom, nTimeTxFrom-1, ... (nSearch of them) for the
+// latest one at which the cached candidate meets hash target. Same result as
+// calling CheckStakeKernelHash for each timestamp, but the constant part of
+// the SHA-256 preimage is absorbed once and several timestamps are hashed per pass
+bool SearchStakeKernelHash(unsigned int nBits, const CStakeCandidate& candidate, unsigned int nTimeTxFrom, unsigned int nSearch, unsigned int& nTimeTxRet, uint256& hashProofOfStake, uint256& targetProofOfStake);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake);
@@ -6,8 +6,10 @@
 
 #include <openssl/ecdsa.h>
 #include <openssl/obj_mac.h>
+#include <openssl/rand.h>
 
 #include "key.h"
+#include "secp256k1.h"
 
 // Generate a private key from just the secret parameter
 int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
@@ -258,11 +260,16 @@ CPrivKey CKey::GetPrivKey() const
 
 bool CKey::SetPubKey(const CPubKey& vchPubKey)
 {
-    const unsigned char* pbegin = &vchPubKey.vchPubKey[0];
-    if (o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.vchPubKey.size()))
+    return SetPubKey(vchPubKey.vchPubKey.empty() ? NULL : &vchPubKey.vchPubKey[0], vchPubKey.vchPubKey.size());
+}
+
+bool CKey::SetPubKey(const unsigned char* pchPubKey, size_t nSize)
+{
+    const unsigned char* pbegin = pchPubKey;
+    if (o2i_ECPublicKey(&pkey, &pbegin, nSize))
     {
         fSet = true;
-        if (vchPubKey.vchPubKey.size() == 33)
+        if (nSize == 33)
             SetCompressedPubKey();
         return true;
     }
@@ -286,6 +293,24 @@ CPubKey CKey::GetPubKey() const
 bool CKey::Sign(uint256 hash, std::vector<unsigned char>& vchSig)
 {
     vchSig.clear();
+#ifdef USE_SECP256K1
+    if (EC_KEY_get0_private_key(pkey) != NULL)
+    {
+        bool fCompressed;
+        CSecret vchSecret = GetSecret(fCompressed);
+        CSecret vchNonce(32);
+        bool fOk = false;
+        // A nonce out of range or giving a zero r or s is all but impossible
+        for (int i = 0; i < 8 && !fOk; i++)
+        {
+            if (RAND_bytes(&vchNonce[0], 32) != 1)
+                break;
+            fOk = Secp256k1::Sign((unsigned char*)&hash, &vchSecret[0], &vchNonce[0], vchSig);
+        }
+        if (fOk)
+            return true;
+    }
+#endif
     ECDSA_SIG *sig = ECDSA_do_sign((unsigned char*)&hash, sizeof(hash), pkey);
     if (sig == NULL)
         return false;
@@ -391,13 +416,42 @@ bool CKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>& v
 
 bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
 {
+    return Verify(hash, vchSig.empty() ? NULL : &vchSig[0], vchSig.size());
+}
+
+bool CKey::Verify(uint256 hash, const unsigned char* pchSig, size_t nSigSize)
+{
+#ifdef USE_SECP256K1
+    if (fSet)
+    {
+        std::vector<unsigned char> vchPubKey = GetPubKey().Raw();
+        int nResult = Secp256k1::Verify((unsigned char*)&hash, pchSig, nSigSize, &vchPubKey[0], vchPubKey.size());
+        if (nResult >= 0)
+            return nResult == 1;
+    }
+#endif
     // -1 = error, 0 = bad sig, 1 = good
-    if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) != 1)
+    if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), pchSig, nSigSize, pkey) != 1)
         return false;
 
     return true;
 }
 
+bool CKey::VerifyPubKey(const unsigned char* pchPubKey, size_t nPubKeySize, uint256 hash, const unsigned char* pchSig, size_t nSigSize)
+{
+#ifdef USE_SECP256K1
+    // Anything other than strict DER and plain keys is left to OpenSSL,
+    // which decides what the network accepts
+    int nResult = Secp256k1::Verify((unsigned char*)&hash, pchSig, nSigSize, pchPubKey, nPubKeySize);
+    if (nResult >= 0)
+        return nResult == 1;
+#endif
+    CKey key;
+    if (!key.SetPubKey(pchPubKey, nPubKeySize))
+        return false;
+    return ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), pchSig, nSigSize, key.pkey) == 1;
+}
+
 bool CKey::VerifyCompact(uint256 hash, const std::vector<unsigned char>& vchSig)
 {
     CKey key;
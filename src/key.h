@@ -136,6 +136,7 @@ public:
     CSecret GetSecret(bool &fCompressed) const;
     CPrivKey GetPrivKey() const;
     bool SetPubKey(const CPubKey& vchPubKey);
+    bool SetPubKey(const unsigned char* pchPubKey, size_t nSize);
     CPubKey GetPubKey() const;
 
     bool Sign(uint256 hash, std::vector<unsigned char>& vchSig);
@@ -153,6 +154,10 @@ public:
     bool SetCompactSignature(uint256 hash, const std::vector<unsigned char>& vchSig);
 
     bool Verify(uint256 hash, const std::vector<unsigned char>& vchSig);
+    bool Verify(uint256 hash, const unsigned char* pchSig, size_t nSigSize);
+
+    // Check a signature against a serialized public key without setting up a CKey for it
+    static bool VerifyPubKey(const unsigned char* pchPubKey, size_t nPubKeySize, uint256 hash, const unsigned char* pchSig, size_t nSigSize);
 
     // Verify a compact signature
     bool VerifyCompact(uint256 hash, const std::vector<unsigned char>& vchSig);
@@ -6,6 +6,7 @@
 
 #include "alert.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "txdb.h"
 #include "net.h"
@@ -16,6 +17,13 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 
 using namespace std;
 using namespace boost;
@@ -32,7 +40,7 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); // PoW starting difficulty = 0.0002441
@@ -68,9 +76,43 @@ map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 
+// Headers-first sync: the best header chain past the blocks we have, the
+// blocks asked for along it, and those that came in ahead of their parent
+class CHeaderEntry
+{
+public:
+    uint256 hashPrev;
+    int nHeight;
+    int64_t nTime;
+    uint256 nChainTrust;
+};
+class CWaitingBlock
+{
+public:
+    CBlock block;
+    CNode* pfrom; // held with AddRef
+    unsigned int nSize;
+};
+bool fHeadersFirst = true;
+static map<uint256, CHeaderEntry> mapHeaders;
+static deque<uint256> deqHeaderChain;
+static int nHeaderChainStart = 0; // height of deqHeaderChain.front()
+static CNode* pnodeHeaderChain = NULL; // peer that sent the best header, held with AddRef
+static int64_t nHeaderChainProgress = 0; // last time a block along the header chain connected
+static map<uint256, int64_t> mapBlocksInFlight;
+static map<uint256, CWaitingBlock> mapBlocksWaiting;
+static unsigned int nBlocksWaitingSize = 0;
+static int64_t nLastGetHeaders = 0;
+static set<uint256> setBadHeaders;
+
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
+bool fBenchmark = false;
+int nScriptCheckThreads = 0;
+unsigned int nBlockFileCacheSize = 16;
+bool fBlockFileMmap = false;
+
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
 
@@ -449,7 +491,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -546,6 +588,53 @@ int64_t CTransaction::GetMinFee(unsigned int nBlockSize, enum GetMinFee_mode mod
 }
 
 
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& tx)
+{
+    ptx = NULL;
+    nFee = nValueIn = nChainValueIn = 0;
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nSigOps = tx.GetLegacySigOpCount();
+    dFeePerKb = dPriority = 0;
+    nHeight = nBestHeight;
+    nCoinBaseHeight = -1;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& tx, const MapPrevTx& mapInputs)
+{
+    *this = CTxMemPoolEntry(tx);
+    nValueIn = tx.GetValueIn(mapInputs);
+    nFee = nValueIn - tx.GetValueOut();
+    nSigOps += tx.GetP2SHSigOpCount(mapInputs);
+    // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+    // client code rounds up the size to the nearest 1K. That's good, because it gives an
+    // incentive to create smaller transactions.
+    dFeePerKb = double(nFee) / (double(nTxSize)/1000.0);
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        MapPrevTx::const_iterator mi = mapInputs.find(txin.prevout.hash);
+        if (mi == mapInputs.end())
+            continue;
+        const CTxIndex& txindex = mi->second.first;
+        const CTransaction& txPrev = mi->second.second;
+        // Inputs still in the memory pool don't add to priority yet
+        if (txindex.pos.IsNull() || txindex.pos == CDiskTxPos(1,1,1))
+            continue;
+        int nConf = txindex.GetDepthInMainChain();
+        if (nConf <= 0)
+            continue;
+
+        // Priority is sum(valuein * age) / txsize
+        int64_t nValue = txPrev.vout[txin.prevout.n].nValue;
+        dPriority += (double)nValue * nConf;
+        nChainValueIn += nValue;
+        if (txPrev.IsCoinBase() || txPrev.IsCoinStake())
+            nCoinBaseHeight = max(nCoinBaseHeight, nHeight - nConf + 1);
+    }
+    dPriority /= nTxSize;
+}
+
+
 bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
                         bool* pfMissingInputs)
 {
@@ -610,6 +699,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         }
     }
 
+    CTxMemPoolEntry entry(tx);
     if (fCheckInputs)
     {
         MapPrevTx mapInputs;
@@ -673,6 +763,17 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
+        entry = CTxMemPoolEntry(tx, mapInputs);
+    }
+    else
+    {
+        // Still worth knowing the fee and priority for block assembly, if
+        // the inputs can be had
+        MapPrevTx mapInputs;
+        map<uint256, CTxIndex> mapUnused;
+        bool fInvalid = false;
+        if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+            entry = CTxMemPoolEntry(tx, mapInputs);
     }
 
     // Store transaction in memory
@@ -683,7 +784,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+        addUnchecked(hash, tx, entry);
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
@@ -703,13 +804,46 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
 }
 
 bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+{
+    return addUnchecked(hash, tx, CTxMemPoolEntry(tx));
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entryIn)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
-        mapTx[hash] = tx;
+        CTransaction& txPool = mapTx[hash];
+        txPool = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&txPool, i);
+
+        CTxMemPoolEntry& entry = mapEntry.insert(make_pair(hash, entryIn)).first->second;
+        entry.ptx = &txPool;
+        entry.hash = hash;
+        entry.setDependsOn.clear();
+        entry.setDependers.clear();
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(txin.prevout.hash);
+            if (mi == mapEntry.end())
+                continue;
+            entry.setDependsOn.insert(txin.prevout.hash);
+            mi->second.setDependers.insert(hash);
+        }
+        // A transaction put back by a reorganisation may already have spenders here
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(it->second.ptx->GetHash());
+            if (mi == mapEntry.end())
+                continue;
+            entry.setDependers.insert(mi->first);
+            mi->second.setDependsOn.insert(hash);
+        }
+        setFeeRate.insert(make_pair(entry.dFeePerKb, hash));
         nTransactionsUpdated++;
     }
     return true;
@@ -733,6 +867,17 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
             }
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+            if (mi != mapEntry.end())
+            {
+                const CTxMemPoolEntry& entry = mi->second;
+                BOOST_FOREACH(const uint256& hashParent, entry.setDependsOn)
+                    mapEntry.find(hashParent)->second.setDependers.erase(hash);
+                BOOST_FOREACH(const uint256& hashChild, entry.setDependers)
+                    mapEntry.find(hashChild)->second.setDependsOn.erase(hash);
+                setFeeRate.erase(make_pair(entry.dFeePerKb, hash));
+                mapEntry.erase(mi);
+            }
             mapTx.erase(hash);
             nTransactionsUpdated++;
         }
@@ -760,6 +905,8 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    setFeeRate.clear();
     ++nTransactionsUpdated;
 }
 
@@ -782,7 +929,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -873,7 +1020,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -920,22 +1067,81 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+// Active chain indexed by height, kept in step with pindexBest
+static std::vector<CBlockIndex*> vBlockIndexByHeight;
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (nHeight < 0 || nHeight >= (int)vBlockIndexByHeight.size())
+        return NULL;
+    return vBlockIndexByHeight[nHeight];
+}
+
+void UpdateBlockIndexByHeight(CBlockIndex* pindexNew)
+{
+    if (pindexNew == NULL)
+    {
+        vBlockIndexByHeight.clear();
+        return;
+    }
+    vBlockIndexByHeight.resize(pindexNew->nHeight + 1);
+    // Walk back only until we meet the part of the old chain still in place
+    for (CBlockIndex* pindex = pindexNew; pindex && vBlockIndexByHeight[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vBlockIndexByHeight[pindex->nHeight] = pindex;
+}
+
+//
+// CBlockIndex slab allocator
+//
+static const size_t BLOCKINDEX_SLAB_ENTRIES = 4096;
+static CCriticalSection cs_BlockIndexArena;
+static std::vector<unsigned char*> vBlockIndexSlabs;
+static size_t nBlockIndexSlabUsed = BLOCKINDEX_SLAB_ENTRIES;
+static std::vector<void*> vBlockIndexFree;
+static size_t nBlockIndexEntries = 0;
+
+void* CBlockIndex::operator new(size_t nSize)
+{
+    // Derived classes (CDiskBlockIndex) go to the regular heap
+    if (nSize != sizeof(CBlockIndex))
+        return ::operator new(nSize);
+
+    LOCK(cs_BlockIndexArena);
+    nBlockIndexEntries++;
+    if (!vBlockIndexFree.empty())
+    {
+        void* p = vBlockIndexFree.back();
+        vBlockIndexFree.pop_back();
+        return p;
+    }
+    if (nBlockIndexSlabUsed == BLOCKINDEX_SLAB_ENTRIES)
+    {
+        vBlockIndexSlabs.push_back(static_cast<unsigned char*>(::operator new(BLOCKINDEX_SLAB_ENTRIES * sizeof(CBlockIndex))));
+        nBlockIndexSlabUsed = 0;
+    }
+    return vBlockIndexSlabs.back() + sizeof(CBlockIndex) * nBlockIndexSlabUsed++;
+}
+
+void CBlockIndex::operator delete(void* p, size_t nSize)
+{
+    if (p == NULL)
+        return;
+    if (nSize != sizeof(CBlockIndex))
+    {
+        ::operator delete(p);
+        return;
+    }
+
+    LOCK(cs_BlockIndexArena);
+    nBlockIndexEntries--;
+    vBlockIndexFree.push_back(p);
+}
+
+void GetBlockIndexArenaStats(size_t& nEntries, size_t& nBytes)
+{
+    LOCK(cs_BlockIndexArena);
+    nEntries = nBlockIndexEntries;
+    nBytes = vBlockIndexSlabs.size() * BLOCKINDEX_SLAB_ENTRIES * sizeof(CBlockIndex);
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1328,8 +1534,8 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         }
         else
         {
-            // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
+            // Get prev tx outputs from the transaction cache or disk
+            if (!txdb.ReadTxOutputs(prevout.hash, txindex.pos, txPrev))
                 return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
         }
     }
@@ -1395,8 +1601,15 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
     return nSigOps;
 }
 
+bool CScriptCheck::operator()() const {
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed on input %u", ptxTo->GetHash().ToString().substr(0,10).c_str(), nIn);
+    return true;
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1453,11 +1666,13 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
-                // Verify signature
-                if (!VerifySignature(txPrev, *this, i, 0))
-                {
+                // Verify signature, or defer it to the script check queue
+                CScriptCheck check(txPrev, *this, i, 0);
+                if (pvChecks) {
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
+                } else if (!check())
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
-                }
             }
 
             // Mark outpoints as spent
@@ -1567,6 +1782,13 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck(void* parg) {
+    RenameThread("XDECoin-scriptch");
+    scriptcheckqueue.Thread();
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
@@ -1582,12 +1804,18 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
+    int64_t nStart = GetTimeMicros();
     map<uint256, CTxIndex> mapQueuedChanges;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
     int64_t nStakeReward = 0;
     unsigned int nSigOps = 0;
+    unsigned int nInputs = 0;
+    int64_t nFetchTime = 0;
+    int64_t nVerifyTime = 0;
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         uint256 hashTx = tx.GetHash();
@@ -1619,14 +1847,18 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         if (!fJustCheck)
             nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
 
+        nInputs += tx.vin.size();
+
         MapPrevTx mapInputs;
         if (tx.IsCoinBase())
             nValueOut += tx.GetValueOut();
         else
         {
             bool fInvalid;
+            int64_t nFetchStart = GetTimeMicros();
             if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
                 return false;
+            nFetchTime += GetTimeMicros() - nFetchStart;
 
             // Add in sigops done by pay-to-script-hash inputs;
             // this is to prevent a "rogue miner" from creating
@@ -1644,13 +1876,29 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false))
+            std::vector<CScriptCheck> vChecks;
+            int64_t nVerifyStart = GetTimeMicros();
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            nVerifyTime += GetTimeMicros() - nVerifyStart;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
+    int64_t nTime = GetTimeMicros() - nStart;
+    if (fBenchmark)
+        printf("- Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin)\n", (unsigned)vtx.size(), 0.001 * nTime, 0.001 * nTime / vtx.size(), nInputs <= 1 ? 0 : 0.001 * nTime / (nInputs-1));
+
+    int64_t nWaitStart = GetTimeMicros();
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+    int64_t nTime2 = GetTimeMicros() - nStart;
+    nVerifyTime += GetTimeMicros() - nWaitStart;
+    if (fBenchmark)
+        printf("- Verify %u txins: %.2fms (%.3fms/txin)\n", nInputs - 1, 0.001 * nTime2, nInputs <= 1 ? 0 : 0.001 * nTime2 / (nInputs-1));
+
     if (IsProofOfWork())
     {
         int64_t nReward = GetProofOfWorkReward(nFees);
@@ -1694,6 +1942,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     if (fJustCheck)
         return true;
 
+    RecordBlockPhase(BLOCKPHASE_FETCHINPUTS, nFetchTime);
+    RecordBlockPhase(BLOCKPHASE_VERIFY, nVerifyTime);
+
     // Write queued txindex changes
     for (map<uint256, CTxIndex>::iterator mi = mapQueuedChanges.begin(); mi != mapQueuedChanges.end(); ++mi)
     {
@@ -1712,8 +1963,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     }
 
     // Watch for transactions paying to me
+    int64_t nWalletStart = GetTimeMicros();
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, true);
+    RecordBlockPhase(BLOCKPHASE_WALLET, GetTimeMicros() - nWalletStart);
 
     return true;
 }
@@ -1829,15 +2082,21 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
         InvalidChainFound(pindexNew);
         return false;
     }
-    if (!txdb.TxnCommit())
+    // During initial download several blocks go out in one LevelDB commit
+    int64_t nCommitStart = GetTimeMicros();
+    if (!txdb.TxnCommit(IsInitialBlockDownload()))
         return error("SetBestChain() : TxnCommit failed");
+    RecordBlockPhase(BLOCKPHASE_DBWRITE, GetTimeMicros() - nCommitStart);
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
 
-    // Delete redundant memory transactions
-    BOOST_FOREACH(CTransaction& tx, vtx)
+    // Delete redundant memory transactions, and any that spend the same
+    // outputs, which block assembly would otherwise keep picking up
+    BOOST_FOREACH(CTransaction& tx, vtx) {
         mempool.remove(tx);
+        mempool.removeConflicts(tx);
+    }
 
     return true;
 }
@@ -1918,7 +2177,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    UpdateBlockIndexByHeight(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -2041,7 +2300,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2067,7 +2326,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2077,7 +2336,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     if (!txdb.TxnBegin())
         return false;
     txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
-    if (!txdb.TxnCommit())
+    if (!txdb.TxnCommit(IsInitialBlockDownload()))
         return false;
 
     // New best
@@ -2196,7 +2455,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2297,8 +2556,59 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
+static CCriticalSection cs_vBlockPhase;
+static CMessageLatency vBlockPhase[BLOCKPHASE_COUNT];
+static const char* pszBlockPhase[BLOCKPHASE_COUNT] = { "check", "fetchinputs", "verify", "dbwrite", "wallet", "total" };
+
+void RecordBlockPhase(BlockPhase phase, int64_t nMicros)
+{
+    LOCK(cs_vBlockPhase);
+    vBlockPhase[phase].Add(0, nMicros);
+}
+
+void GetBlockPhaseStats(vector<pair<string, CMessageLatency> >& vRet, bool fReset)
+{
+    LOCK(cs_vBlockPhase);
+    vRet.clear();
+    for (int i = 0; i < BLOCKPHASE_COUNT; i++)
+    {
+        vRet.push_back(make_pair(string(pszBlockPhase[i]), vBlockPhase[i]));
+        if (fReset)
+            vBlockPhase[i] = CMessageLatency();
+    }
+}
+
+void PrintPerfStats()
+{
+    map<string, CMessageLatency> mapLatency;
+    GetMessageLatency(mapLatency, false);
+    for (map<string, CMessageLatency>::iterator mi = mapLatency.begin(); mi != mapLatency.end(); ++mi)
+    {
+        const CMessageLatency& latency = mi->second;
+        if (latency.nCount == 0)
+            continue;
+        printf("perfstats: message %-12s count %"PRIu64" bytes %"PRIu64" process %.3fms avg %.3fms p90 %.3fms max %.3fms\n",
+               mi->first.c_str(), latency.nCount, latency.nBytes, latency.nProcessTotal * 0.001,
+               latency.nProcessTotal * 0.001 / latency.nCount, latency.Percentile(90) * 0.001, latency.nMax * 0.001);
+    }
+
+    vector<pair<string, CMessageLatency> > vPhase;
+    GetBlockPhaseStats(vPhase, false);
+    for (unsigned int i = 0; i < vPhase.size(); i++)
+    {
+        const CMessageLatency& latency = vPhase[i].second;
+        if (latency.nCount == 0)
+            continue;
+        printf("perfstats: block %-12s count %"PRIu64" total %.3fms avg %.3fms p90 %.3fms max %.3fms\n",
+               vPhase[i].first.c_str(), latency.nCount, latency.nProcessTotal * 0.001,
+               latency.nProcessTotal * 0.001 / latency.nCount, latency.Percentile(90) * 0.001, latency.nMax * 0.001);
+    }
+}
+
 bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 {
+    int64_t nStart = GetTimeMicros();
+
     // Check for duplicate
     uint256 hash = pblock->GetHash();
     if (mapBlockIndex.count(hash))
@@ -2313,8 +2623,10 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, hash.ToString().c_str());
 
     // Preliminary checks
+    int64_t nCheckStart = GetTimeMicros();
     if (!pblock->CheckBlock())
         return error("ProcessBlock() : CheckBlock FAILED");
+    RecordBlockPhase(BLOCKPHASE_CHECK, GetTimeMicros() - nCheckStart);
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
     if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
@@ -2397,6 +2709,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     }
 
     printf("ProcessBlock: ACCEPTED\n");
+    RecordBlockPhase(BLOCKPHASE_TOTAL, GetTimeMicros() - nStart);
 
     // XDECoin: if responsible for sync-checkpoint send it
     if (pfrom && !CSyncCheckpoint::strMasterPrivKey.empty())
@@ -2524,6 +2837,213 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
+// FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB.
+// A block file that has grown past this is never appended to again.
+static const long MAX_BLOCKFILE_SIZE = 0x7F000000 - MAX_SIZE;
+
+/** An open, read-only block file shared by the handle cache and its readers */
+class CBlockFileHandle
+{
+public:
+#ifdef WIN32
+    FILE* file;
+    CCriticalSection cs;
+#else
+    int fd;
+#endif
+    const char* pmap;
+    size_t nMapSize;
+
+    CBlockFileHandle()
+    {
+#ifdef WIN32
+        file = NULL;
+#else
+        fd = -1;
+#endif
+        pmap = NULL;
+        nMapSize = 0;
+    }
+
+    ~CBlockFileHandle()
+    {
+#ifdef WIN32
+        if (file)
+            fclose(file);
+#else
+        if (pmap)
+            munmap((void*)pmap, nMapSize);
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+    // Read up to nSize bytes at nPos, returns the number of bytes read
+    size_t ReadAt(char* pch, size_t nSize, unsigned int nPos)
+    {
+        if (pmap)
+        {
+            if (nPos >= nMapSize)
+                return 0;
+            nSize = min(nSize, nMapSize - nPos);
+            memcpy(pch, pmap + nPos, nSize);
+            return nSize;
+        }
+#ifdef WIN32
+        LOCK(cs);
+        if (fseek(file, nPos, SEEK_SET) != 0)
+            return 0;
+        return fread(pch, 1, nSize, file);
+#else
+        ssize_t nRead;
+        do {
+            nRead = pread(fd, pch, nSize, nPos);
+        } while (nRead < 0 && errno == EINTR);
+        return nRead < 0 ? 0 : nRead;
+#endif
+    }
+};
+
+// Most recently used block file handles, front is newest
+static CCriticalSection cs_BlockFileCache;
+static list<pair<unsigned int, boost::shared_ptr<CBlockFileHandle> > > lruBlockFiles;
+static uint64_t nBlockFileCacheHits = 0;
+static uint64_t nBlockFileCacheMisses = 0;
+
+static boost::shared_ptr<CBlockFileHandle> OpenBlockFileHandle(unsigned int nFile)
+{
+    boost::shared_ptr<CBlockFileHandle> handle;
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return handle;
+
+    LOCK(cs_BlockFileCache);
+    for (list<pair<unsigned int, boost::shared_ptr<CBlockFileHandle> > >::iterator it = lruBlockFiles.begin(); it != lruBlockFiles.end(); ++it)
+    {
+        if (it->first == nFile)
+        {
+            nBlockFileCacheHits++;
+            lruBlockFiles.splice(lruBlockFiles.begin(), lruBlockFiles, it);
+            return it->second;
+        }
+    }
+    nBlockFileCacheMisses++;
+
+    handle.reset(new CBlockFileHandle());
+#ifdef WIN32
+    handle->file = fopen(BlockFilePath(nFile).string().c_str(), "rb");
+    if (!handle->file)
+        return boost::shared_ptr<CBlockFileHandle>();
+#else
+    handle->fd = open(BlockFilePath(nFile).string().c_str(), O_RDONLY);
+    if (handle->fd < 0)
+        return boost::shared_ptr<CBlockFileHandle>();
+    struct stat st;
+    if (fBlockFileMmap && fstat(handle->fd, &st) == 0 && st.st_size >= MAX_BLOCKFILE_SIZE)
+    {
+        // Finalised file: map it once and read without system calls
+        void* pmap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, handle->fd, 0);
+        if (pmap != MAP_FAILED)
+        {
+            handle->pmap = (const char*)pmap;
+            handle->nMapSize = st.st_size;
+        }
+    }
+#endif
+
+    if (nBlockFileCacheSize > 0)
+    {
+        lruBlockFiles.push_front(make_pair(nFile, handle));
+        while (lruBlockFiles.size() > nBlockFileCacheSize)
+            lruBlockFiles.pop_back();
+    }
+    return handle;
+}
+
+void GetBlockFileCacheStats(uint64_t& nHits, uint64_t& nMisses)
+{
+    LOCK(cs_BlockFileCache);
+    nHits = nBlockFileCacheHits;
+    nMisses = nBlockFileCacheMisses;
+}
+
+CBlockFileReader::CBlockFileReader(unsigned int nFile, unsigned int nPos, int nTypeIn, int nVersionIn)
+    : handle(OpenBlockFileHandle(nFile)), nFilePos(nPos), nFillSize(4096), pbegin(NULL), pend(NULL),
+      nType(nTypeIn), nVersion(nVersionIn)
+{
+}
+
+bool CBlockFileReader::Fill()
+{
+    if (handle->pmap)
+    {
+        if (nFilePos >= handle->nMapSize)
+            return false;
+        pbegin = handle->pmap + nFilePos;
+        pend = handle->pmap + handle->nMapSize;
+        nFilePos = handle->nMapSize;
+        return true;
+    }
+
+    vchBuf.resize(nFillSize);
+    size_t nRead = handle->ReadAt(&vchBuf[0], nFillSize, nFilePos);
+    if (nRead == 0)
+        return false;
+    pbegin = &vchBuf[0];
+    pend = pbegin + nRead;
+    nFilePos += nRead;
+    // Small reads (single transactions) stay small, blocks ramp up quickly
+    nFillSize = min(nFillSize * 4, (unsigned int)MAX_BLOCK_SIZE);
+    return true;
+}
+
+CBlockFileReader& CBlockFileReader::read(char* pch, size_t nSize)
+{
+    while (nSize > 0)
+    {
+        if (pbegin == pend && !Fill())
+            throw std::ios_base::failure("CBlockFileReader::read() : end of data");
+        size_t nChunk = min(nSize, (size_t)(pend - pbegin));
+        memcpy(pch, pbegin, nChunk);
+        pbegin += nChunk;
+        pch += nChunk;
+        nSize -= nChunk;
+    }
+    return (*this);
+}
+
+bool PushBlockFromDisk(CNode* pnode, const CBlockIndex* pindex)
+{
+    // The network and disk serialisations of a block are identical, so the
+    // bytes WriteToDisk stored can go out as they are. They are read straight
+    // into the send buffer; the message checksum still has to be computed.
+    boost::shared_ptr<CBlockFileHandle> handle = OpenBlockFileHandle(pindex->nFile);
+    if (!handle || pindex->nBlockPos < sizeof(pchMessageStart) + sizeof(unsigned int))
+        return false;
+
+    // Index header: message start and block size, just before the block
+    char pchHeader[sizeof(pchMessageStart) + sizeof(unsigned int)];
+    unsigned int nSize;
+    if (handle->ReadAt(pchHeader, sizeof(pchHeader), pindex->nBlockPos - sizeof(pchHeader)) != sizeof(pchHeader))
+        return false;
+    memcpy(&nSize, pchHeader + sizeof(pchMessageStart), sizeof(nSize));
+    if (memcmp(pchHeader, pchMessageStart, sizeof(pchMessageStart)) != 0 || nSize > MAX_BLOCK_SIZE || nSize < 80)
+        return false;
+
+    CBlock header = pindex->GetBlockHeader();
+    pnode->BeginMessage("block");
+    CDataStream& vSend = pnode->vSend;
+    unsigned int nStart = vSend.size();
+    vSend.resize(nStart + nSize);
+    if (handle->ReadAt(&vSend[nStart], nSize, pindex->nBlockPos) != nSize ||
+        memcmp(&vSend[nStart], BEGIN(header.nVersion), END(header.nNonce) - BEGIN(header.nVersion)) != 0)
+    {
+        pnode->AbortMessage();
+        return error("PushBlockFromDisk() : block %s not found at %u:%u", pindex->GetBlockHash().ToString().substr(0,20).c_str(), pindex->nFile, pindex->nBlockPos);
+    }
+    pnode->EndMessage();
+    return true;
+}
+
 static unsigned int nCurrentBlockFile = 1;
 
 FILE* AppendBlockFile(unsigned int& nFileRet)
@@ -2536,8 +3056,7 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
             return NULL;
         if (fseek(file, 0, SEEK_END) != 0)
             return NULL;
-        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
+        if (ftell(file) < MAX_BLOCKFILE_SIZE)
         {
             nFileRet = nCurrentBlockFile;
             return file;
@@ -2650,7 +3169,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2776,7 +3295,9 @@ bool LoadExternalBlockFile(FILE* fileIn)
                    __PRETTY_FUNCTION__);
         }
     }
-    printf("Loaded %i blocks from external file in %"PRId64"ms\n", nLoaded, GetTimeMillis() - nStart);
+    int64_t nElapsed = GetTimeMillis() - nStart;
+    printf("Loaded %i blocks from external file in %"PRId64"ms (%.2f blocks/s, %d script check threads)\n",
+           nLoaded, nElapsed, nElapsed > 0 ? 1000.0 * nLoaded / nElapsed : 0.0, nScriptCheckThreads ? nScriptCheckThreads : 1);
     return nLoaded > 0;
 }
 
@@ -2865,8 +3386,13 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
         }
 
     case MSG_BLOCK:
+        {
+        map<uint256, int64_t>::iterator mi = mapBlocksInFlight.find(inv.hash);
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               mapOrphanBlocks.count(inv.hash) ||
+               mapBlocksWaiting.count(inv.hash) ||
+               (mi != mapBlocksInFlight.end() && GetTime() - mi->second <= BLOCK_DOWNLOAD_TIMEOUT);
+        }
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -2880,12 +3406,351 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 // a large 4-byte int at any alignment.
 unsigned char pchMessageStart[4] = { 0x7f, 0x31, 0xe2, 0x05 };
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Headers-first sync
+//
+
+// Median time of the 11 blocks up to and including hash, going through the
+// headers and then the block index, as CBlockIndex::GetMedianTimePast
+static int64_t GetHeaderMedianTimePast(uint256 hash)
+{
+    vector<int64_t> vTimes;
+    while (vTimes.size() < (size_t)CBlockIndex::nMedianTimeSpan)
+    {
+        map<uint256, CHeaderEntry>::iterator mi = mapHeaders.find(hash);
+        if (mi == mapHeaders.end())
+            break;
+        vTimes.push_back(mi->second.nTime);
+        hash = mi->second.hashPrev;
+    }
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    for (CBlockIndex* pindex = (mi == mapBlockIndex.end() ? NULL : mi->second);
+         pindex && vTimes.size() < (size_t)CBlockIndex::nMedianTimeSpan; pindex = pindex->pprev)
+        vTimes.push_back(pindex->GetBlockTime());
+    if (vTimes.empty())
+        return 0;
+    sort(vTimes.begin(), vTimes.end());
+    return vTimes[vTimes.size()/2];
+}
+
+int GetBestHeaderHeight()
+{
+    if (deqHeaderChain.empty())
+        return nBestHeight;
+    return max(nBestHeight, nHeaderChainStart + (int)deqHeaderChain.size() - 1);
+}
+
+static uint256 GetBestHeaderTrust()
+{
+    if (deqHeaderChain.empty())
+        return pindexBest ? pindexBest->nChainTrust : 0;
+    return mapHeaders[deqHeaderChain.back()].nChainTrust;
+}
+
+// A header carries no coinstake, so proof-of-stake can't be told from
+// proof-of-work until the block is in. Only a header whose hash meets its
+// own target, at a height that still allows proof-of-work, gets the trust
+// of its target; anything else is a stake claim and counts as the least
+// trust a proof-of-stake block can have.
+static uint256 GetHeaderTrust(const CBlock& header, const uint256& hash, int nHeight)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    if (nHeight > LAST_POW_BLOCK || bnTarget <= 0 || bnTarget > bnProofOfWorkLimit || hash > bnTarget.getuint256())
+        bnTarget = bnProofOfStakeLimit;
+    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+}
+
+static void SetHeaderChainSource(CNode* pnode)
+{
+    if (pnodeHeaderChain == pnode)
+        return;
+    if (pnodeHeaderChain)
+        pnodeHeaderChain->Release();
+    pnodeHeaderChain = pnode ? pnode->AddRef() : NULL;
+}
+
+static void EraseWaitingBlock(map<uint256, CWaitingBlock>::iterator mi)
+{
+    mi->second.pfrom->Release();
+    nBlocksWaitingSize -= mi->second.nSize;
+    mapBlocksWaiting.erase(mi);
+}
+
+static void ClearWaitingBlocks()
+{
+    while (!mapBlocksWaiting.empty())
+        EraseWaitingBlock(mapBlocksWaiting.begin());
+}
+
+// Drop the front of the header chain as its blocks come in
+static void TrimHeaderChain()
+{
+    while (!deqHeaderChain.empty() && mapBlockIndex.count(deqHeaderChain.front()))
+    {
+        mapHeaders.erase(deqHeaderChain.front());
+        deqHeaderChain.pop_front();
+        nHeaderChainStart++;
+        nHeaderChainProgress = GetTime();
+    }
+}
+
+// Make room in mapHeaders by dropping the headers that are off the best
+// header chain
+static void PruneHeaders()
+{
+    set<uint256> setChain(deqHeaderChain.begin(), deqHeaderChain.end());
+    for (map<uint256, CHeaderEntry>::iterator it = mapHeaders.begin(); it != mapHeaders.end(); )
+    {
+        if (setChain.count(it->first))
+            ++it;
+        else
+            mapHeaders.erase(it++);
+    }
+}
+
+// The header chain led to a block that didn't connect. Forget it all and
+// let the peers offer another, though not one through a block that was
+// found invalid.
+void ForgetHeaderChain(const uint256& hashFailed, bool fInvalid)
+{
+    printf("ForgetHeaderChain() : block %s failed, dropping %"PRIszu" headers\n",
+           hashFailed.ToString().substr(0,20).c_str(), mapHeaders.size());
+    if (fInvalid)
+        setBadHeaders.insert(hashFailed);
+    mapHeaders.clear();
+    deqHeaderChain.clear();
+    ClearWaitingBlocks();
+    SetHeaderChainSource(NULL);
+    nLastGetHeaders = 0;
+}
+
+// Check a header as far as can be done without its block: that it links up,
+// matches the hardened checkpoints, and has a sane time and target, and
+// that it has the proof-of-work it would be counted for. The proof-of-stake
+// kernel and block signature need the coinstake, so those wait for
+// ProcessBlock along with everything else.
+// hash is header.GetHash(), worked out by the caller
+bool AcceptBlockHeader(const CBlock& header, const uint256& hash, CNode* pfrom)
+{
+    if (mapBlockIndex.count(hash) || mapHeaders.count(hash))
+        return true;
+    if (setBadHeaders.count(hash) || setBadHeaders.count(header.hashPrevBlock))
+    {
+        setBadHeaders.insert(hash);
+        return header.DoS(100, error("AcceptBlockHeader() : header %s leads from a bad block", hash.ToString().substr(0,20).c_str()));
+    }
+
+    int nHeight;
+    int64_t nTimePrev;
+    uint256 nChainTrustPrev;
+    map<uint256, CHeaderEntry>::iterator mi = mapHeaders.find(header.hashPrevBlock);
+    if (mi != mapHeaders.end())
+    {
+        nHeight = mi->second.nHeight + 1;
+        nTimePrev = mi->second.nTime;
+        nChainTrustPrev = mi->second.nChainTrust;
+    }
+    else
+    {
+        BlockMap::iterator bi = mapBlockIndex.find(header.hashPrevBlock);
+        if (bi == mapBlockIndex.end())
+            return error("AcceptBlockHeader() : prev header %s not found", header.hashPrevBlock.ToString().substr(0,20).c_str());
+        nHeight = bi->second->nHeight + 1;
+        nTimePrev = bi->second->GetBlockTime();
+        nChainTrustPrev = bi->second->nChainTrust;
+    }
+
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+        return header.DoS(100, error("AcceptBlockHeader() : rejected by hardened checkpoint lock-in at %d", nHeight));
+
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("AcceptBlockHeader() : block timestamp too far in the future");
+    if (header.GetBlockTime() <= GetHeaderMedianTimePast(header.hashPrevBlock) || FutureDrift(header.GetBlockTime()) < nTimePrev)
+        return header.DoS(100, error("AcceptBlockHeader() : block's timestamp is too early"));
+
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    if (bnTarget <= 0 || (bnTarget > bnProofOfWorkLimit && bnTarget > bnProofOfStakeLimit))
+        return header.DoS(100, error("AcceptBlockHeader() : nBits below minimum work"));
+
+    // A target only a proof-of-work block may have must be met
+    if (bnTarget > bnProofOfStakeLimit && !CheckProofOfWork(hash, header.nBits))
+        return header.DoS(50, error("AcceptBlockHeader() : proof of work failed"));
+
+    CHeaderEntry& entry = mapHeaders[hash];
+    entry.hashPrev = header.hashPrevBlock;
+    entry.nHeight = nHeight;
+    entry.nTime = header.GetBlockTime();
+    entry.nChainTrust = nChainTrustPrev + GetHeaderTrust(header, hash, nHeight);
+
+    // Download along the header chain with the most trust. Stake claims
+    // can only be checked once the blocks are in; a chain whose blocks
+    // never come is dropped by RequestHeaderChainBlocks.
+    if (entry.nChainTrust > GetBestHeaderTrust())
+    {
+        if (!deqHeaderChain.empty() && header.hashPrevBlock == deqHeaderChain.back())
+            deqHeaderChain.push_back(hash);
+        else
+        {
+            deqHeaderChain.clear();
+            ClearWaitingBlocks();
+            for (map<uint256, CHeaderEntry>::iterator it = mapHeaders.find(hash); it != mapHeaders.end(); it = mapHeaders.find(it->second.hashPrev))
+                deqHeaderChain.push_front(it->first);
+            nHeaderChainStart = nHeight - (int)deqHeaderChain.size() + 1;
+            nHeaderChainProgress = GetTime();
+        }
+        SetHeaderChainSource(pfrom);
+    }
+    return true;
+}
+
+// Ask for headers following the best one we have
+static void PushGetHeaders(CNode* pnode)
+{
+    CBlockLocator locator(pindexBest);
+    if (!deqHeaderChain.empty())
+        locator.Prepend(deqHeaderChain.back());
+    pnode->PushMessage("getheaders", locator, uint256(0));
+    nLastGetHeaders = GetTime();
+}
+
+// Ask pto for the next blocks along the header chain that no other peer is
+// fetching, within BLOCK_DOWNLOAD_WINDOW of the best block and keeping at
+// most MAX_BLOCKS_IN_FLIGHT outstanding with it
+void RequestHeaderChainBlocks(CNode* pto, vector<CInv>& vGetData)
+{
+    int64_t nNow = GetTime();
+
+    // Give up on what it hasn't answered so another peer can have a go
+    for (map<uint256, int64_t>::iterator it = pto->mapBlocksInFlight.begin(); it != pto->mapBlocksInFlight.end(); )
+    {
+        if (nNow - it->second > BLOCK_DOWNLOAD_TIMEOUT)
+        {
+            map<uint256, int64_t>::iterator mi = mapBlocksInFlight.find(it->first);
+            if (mi != mapBlocksInFlight.end() && mi->second == it->second)
+                mapBlocksInFlight.erase(mi);
+            pto->mapBlocksInFlight.erase(it++);
+        }
+        else
+            ++it;
+    }
+
+    TrimHeaderChain();
+    if (deqHeaderChain.empty())
+        return;
+
+    // No block along the header chain has connected for a long while, so
+    // its blocks may not exist. Refuse the chain from its first missing
+    // block on, which refuses every header built on it, and hold it against
+    // whoever announced it.
+    if (nNow - nHeaderChainProgress > HEADER_CHAIN_STALL_TIMEOUT)
+    {
+        if (pnodeHeaderChain)
+            pnodeHeaderChain->Misbehaving(100);
+        ForgetHeaderChain(deqHeaderChain.front(), true);
+        return;
+    }
+
+    // With MAX_BLOCKS_WAITING_SIZE parked, only ask for the block that lets
+    // them connect
+    int nEnd = min(nHeaderChainStart + (int)deqHeaderChain.size(), min(nBestHeight + BLOCK_DOWNLOAD_WINDOW, pto->nStartingHeight) + 1);
+    if (nBlocksWaitingSize >= MAX_BLOCKS_WAITING_SIZE)
+        nEnd = min(nEnd, nHeaderChainStart + 1);
+    for (int nHeight = nHeaderChainStart; nHeight < nEnd && pto->mapBlocksInFlight.size() < MAX_BLOCKS_IN_FLIGHT; nHeight++)
+    {
+        const uint256& hash = deqHeaderChain[nHeight - nHeaderChainStart];
+        if (mapBlockIndex.count(hash) || mapBlocksWaiting.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+        map<uint256, int64_t>::iterator mi = mapBlocksInFlight.find(hash);
+        if (mi != mapBlocksInFlight.end() && nNow - mi->second <= BLOCK_DOWNLOAD_TIMEOUT)
+            continue;
+        mapBlocksInFlight[hash] = nNow;
+        pto->mapBlocksInFlight[hash] = nNow;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+}
+
+// Whether block has the transactions its header commits to. A peer can pair
+// a good header with any body, which says nothing about the header; a body
+// that matches and still fails CheckBlock means the block is invalid.
+static bool CheckBlockBody(const CBlock& block)
+{
+    if (block.vtx.empty() || block.hashMerkleRoot != block.BuildMerkleTree())
+        return false;
+    // Duplicated transactions can leave the merkle root unchanged
+    set<uint256> setTxHash;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        if (!setTxHash.insert(tx.GetHash()).second)
+            return false;
+    return true;
+}
+
+// Hold a checked block along the header chain until its parent is in.
+// Returns false if MAX_BLOCKS_WAITING_SIZE is taken up already; it will be
+// asked for again.
+bool ParkHeaderChainBlock(const CBlock& block, CNode* pfrom)
+{
+    uint256 hash = block.GetHash();
+    map<uint256, CWaitingBlock>::iterator mi = mapBlocksWaiting.find(hash);
+    if (mi != mapBlocksWaiting.end())
+        EraseWaitingBlock(mi);
+    unsigned int nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    if (nBlocksWaitingSize + nSize > MAX_BLOCKS_WAITING_SIZE)
+        return false;
+    CWaitingBlock& waiting = mapBlocksWaiting[hash];
+    waiting.block = block;
+    waiting.pfrom = pfrom->AddRef();
+    waiting.nSize = nSize;
+    nBlocksWaitingSize += nSize;
+    return true;
+}
+
+bool HaveWaitingBlock(const uint256& hash)
+{
+    return mapBlocksWaiting.count(hash);
+}
+
+// Hand blocks that arrived ahead of their parent to ProcessBlock, in chain
+// order, as far as the header chain has them, on behalf of the peers that
+// sent them
+void ProcessWaitingBlocks()
+{
+    while (!mapBlocksWaiting.empty())
+    {
+        TrimHeaderChain();
+        if (deqHeaderChain.empty())
+        {
+            ClearWaitingBlocks();
+            break;
+        }
+        map<uint256, CWaitingBlock>::iterator mi = mapBlocksWaiting.find(deqHeaderChain.front());
+        if (mi == mapBlocksWaiting.end())
+            break;
+        CBlock block;
+        swap(block, mi->second.block);
+        CNode* pnode = mi->second.pfrom;
+        nBlocksWaitingSize -= mi->second.nSize;
+        mapBlocksWaiting.erase(mi);
+
+        uint256 hash = block.GetHash();
+        bool fAccepted = ProcessBlock(pnode, &block) && mapBlockIndex.count(hash);
+        if (block.nDoS) pnode->Misbehaving(block.nDoS);
+        pnode->Release();
+        if (!fAccepted)
+        {
+            ForgetHeaderChain(hash, block.nDoS > 0);
+            break;
+        }
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     static map<CService, CPubKey> mapReuseKey;
     RandAddSeedPerfmon();
-    if (fDebug)
-        printf("received: %s (%"PRIszu" bytes)\n", strCommand.c_str(), vRecv.size());
+    LogPrint("net", "received: %s (%"PRIszu" bytes)\n", strCommand.c_str(), vRecv.size());
     if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
     {
         printf("dropmessagestest DROPPING RECV MESSAGE\n");
@@ -2981,8 +3846,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
 
         // Ask the first connected node for block updates
+        // (with headers-first sync, SendMessages asks for headers instead)
         static int nAskedForBlocks = 0;
-        if (!pfrom->fClient && !pfrom->fOneShot &&
+        if (!fHeadersFirst && !pfrom->fClient && !pfrom->fOneShot &&
             (pfrom->nStartingHeight > (nBestHeight - 144)) &&
             (pfrom->nVersion < NOBLKS_VERSION_START ||
              pfrom->nVersion >= NOBLKS_VERSION_END) &&
@@ -3028,7 +3894,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
     }
 
 
@@ -3126,8 +3992,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(txdb, inv);
-            if (fDebug)
-                printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
+            LogPrint("net", "  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave)
                 pfrom->AskFor(inv);
@@ -3138,8 +4003,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
                 // this situation and push another getblocks to continue.
                 pfrom->PushGetBlocks(mapBlockIndex[inv.hash], uint256(0));
-                if (fDebug)
-                    printf("force request: %s\n", inv.ToString().c_str());
+                LogPrint("net", "force request: %s\n", inv.ToString().c_str());
             }
 
             // Track requests for our stuff
@@ -3171,12 +4035,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    if (!PushBlockFromDisk(pfrom, (*mi).second))
+                    {
+                        CBlock block;
+                        block.ReadFromDisk((*mi).second);
+                        pfrom->PushMessage("block", block);
+                    }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3282,7 +4149,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3296,7 +4163,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3308,6 +4175,54 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %"PRIszu"", vHeaders.size());
+        }
+        if (!fHeadersFirst)
+            return true;
+
+        // Hash them all in one batch; the 80 header bytes of a CBlock are
+        // laid out from nVersion to nNonce, as CBlock::GetHash hashes them
+        vector<uint256> vHash(vHeaders.size());
+        if (!vHeaders.empty())
+            Hash9Batch((const unsigned char*)&vHeaders[0].nVersion, 80, sizeof(CBlock), vHeaders.size(), &vHash[0]);
+
+        bool fFull = false;
+        for (unsigned int i = 0; i < vHeaders.size(); i++)
+        {
+            const CBlock& header = vHeaders[i];
+            // Keep at most MAX_HEADERS_HELD; the rest can be asked for again
+            // once blocks have come in
+            if (mapHeaders.size() >= MAX_HEADERS_HELD)
+                PruneHeaders();
+            if (mapHeaders.size() >= MAX_HEADERS_HELD)
+            {
+                fFull = true;
+                break;
+            }
+            if (!AcceptBlockHeader(header, vHash[i], pfrom))
+            {
+                if (header.nDoS) pfrom->Misbehaving(header.nDoS);
+                return error("ProcessMessage() : bad header from %s", pfrom->addr.ToString().c_str());
+            }
+        }
+        LogPrint("net", "received %"PRIszu" headers, best header now %d\n", vHeaders.size(), GetBestHeaderHeight());
+
+        // A full batch means there are more to come; otherwise another peer
+        // may have more
+        if (vHeaders.size() == MAX_HEADERS_RESULTS && !fFull)
+            PushGetHeaders(pfrom);
+        else
+            nLastGetHeaders = 0;
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3387,9 +4302,39 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_BLOCK, hashBlock);
         pfrom->AddInventoryKnown(inv);
 
+        // Asked for along the header chain: wait for the parent if need be,
+        // so blocks connect in order rather than pile up as orphans
+        pfrom->mapBlocksInFlight.erase(hashBlock);
+        bool fHeaderChain = mapBlocksInFlight.erase(hashBlock);
+        if (fHeaderChain)
+        {
+            // A body that isn't the one the header commits to is the peer's
+            // doing; the block goes back to being asked for
+            if (!CheckBlockBody(block))
+            {
+                pfrom->Misbehaving(100);
+                return error("ProcessMessage() : block %s from %s doesn't match its header", hashBlock.ToString().substr(0,20).c_str(), pfrom->addr.ToString().c_str());
+            }
+            if (!mapBlockIndex.count(block.hashPrevBlock))
+            {
+                if (!block.CheckBlock())
+                {
+                    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+                    ForgetHeaderChain(hashBlock, block.nDoS > 0);
+                    return error("ProcessMessage() : CheckBlock FAILED");
+                }
+                if (!ParkHeaderChainBlock(block, pfrom))
+                    LogPrint("net", "no room for block %s ahead of its parent\n", hashBlock.ToString().substr(0,20).c_str());
+                return true;
+            }
+        }
+
         if (ProcessBlock(pfrom, &block))
             mapAlreadyAskedFor.erase(inv);
+        else if (fHeaderChain && !mapBlockIndex.count(hashBlock))
+            ForgetHeaderChain(hashBlock, block.nDoS > 0);
         if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+        ProcessWaitingBlocks();
     }
 
 
@@ -3536,13 +4481,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-        return true;
     //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
+    //    printf("ProcessMessages(%"PRIszu" messages)\n", pfrom->vRecvMsg.size());
 
     //
     // Message format
@@ -3552,33 +4495,29 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) checksum
     //  (x) data
     //
+    // The socket thread has already split the stream into messages and
+    // checked their checksums.
+    //
 
-    while (true)
+    std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
+    while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end())
     {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->vSend.size() >= SendBufferSize())
             break;
 
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
-        {
-            if ((int)vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
+        // get next message
+        CNetMessage& msg = *it;
+
+        // end, if an incomplete message is found
+        if (!msg.complete())
             break;
-        }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %"PRIpdd" BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
+
+        // at this point, any failure means we can delete the current message
+        it++;
 
         // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
+        CMessageHeader& hdr = msg.hdr;
         if (!hdr.IsValid())
         {
             printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
@@ -3588,43 +4527,20 @@ bool ProcessMessages(CNode* pfrom)
 
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessages(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-            break;
-        }
-
-        // Checksum
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
-        {
-            printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
-            continue;
-        }
-
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
 
-        // Process message
+        // Process message. msg may be gone once ProcessMessage returns, so
+        // take what the latency stats need now
         bool fRet = false;
+        int64_t nTimeReceived = msg.nTime;
+        int64_t nStart = GetTimeMicros();
         try
         {
             {
                 LOCK(cs_main);
-                fRet = ProcessMessage(pfrom, strCommand, vMsg);
+                fRet = ProcessMessage(pfrom, strCommand, msg.vRecv);
             }
             if (fShutdown)
-                return true;
+                break;
         }
         catch (std::ios_base::failure& e)
         {
@@ -3651,9 +4567,17 @@ bool ProcessMessages(CNode* pfrom)
 
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+
+        RecordMessageLatency(strCommand, nStart - nTimeReceived, GetTimeMicros() - nStart, nMessageSize);
+
+        // One message per call; ThreadMessageHandler2 goes round the peers
+        break;
     }
 
-    vRecv.Compact();
+    // remove processed messages
+    if (!pfrom->fDisconnect)
+        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+
     return true;
 }
 
@@ -3792,6 +4716,17 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata
         //
         vector<CInv> vGetData;
+
+        // Headers-first sync: keep the headers coming, from another peer if
+        // the last one went quiet, and spread block requests along them
+        if (fHeadersFirst && !pto->fClient && !pto->fOneShot && pto->fSuccessfullyConnected)
+        {
+            if (pto->nStartingHeight > GetBestHeaderHeight() && GetTime() - nLastGetHeaders > BLOCK_DOWNLOAD_TIMEOUT &&
+                mapHeaders.size() + MAX_HEADERS_RESULTS <= MAX_HEADERS_HELD)
+                PushGetHeaders(pto);
+            RequestHeaderChainBlocks(pto, vGetData);
+        }
+
         int64_t nNow = GetTime() * 1000000;
         CTxDB txdb("r");
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
@@ -3799,8 +4734,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             const CInv& inv = (*pto->mapAskFor.begin()).second;
             if (!AlreadyHave(txdb, inv))
             {
-                if (fDebugNet)
-                    printf("sending getdata: %s\n", inv.ToString().c_str());
+                LogPrint("net", "sending getdata: %s\n", inv.ToString().c_str());
                 vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
@@ -15,6 +15,9 @@
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -26,6 +29,15 @@ class CAddress;
 class CInv;
 class CRequestTracker;
 class CNode;
+class CScriptCheck;
+
+/** Block hashes are already uniformly distributed, so the low 64 bits make a
+ * perfectly good bucket hash without rehashing the full 256 bits. */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return (size_t)hash.Get64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 
 static const int LAST_POW_BLOCK = 2820000; // POW 0 Reward Block
 
@@ -34,6 +46,22 @@ static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 static const unsigned int MAX_INV_SZ = 50000;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Most headers sent in one "headers" message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** How far past the best block headers-first sync asks for blocks */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Blocks asked of one peer at a time during headers-first sync */
+static const unsigned int MAX_BLOCKS_IN_FLIGHT = 16;
+/** Seconds before an unanswered headers or block request goes to another peer */
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Seconds the header chain may go without a block along it connecting before it is dropped */
+static const int64_t HEADER_CHAIN_STALL_TIMEOUT = 10 * BLOCK_DOWNLOAD_TIMEOUT;
+/** Most headers held ahead of the blocks during headers-first sync */
+static const unsigned int MAX_HEADERS_HELD = 50000;
+/** Most bytes of blocks held waiting for their parent during headers-first sync */
+static const unsigned int MAX_BLOCKS_WAITING_SIZE = 32 * MAX_BLOCK_SIZE;
 static const int64_t MIN_TX_FEE = 200; // 0.00000200 XDE fees
 static const int64_t MIN_RELAY_TX_FEE = MIN_TX_FEE;
 static const int64_t MAX_MONEY = 200 * COIN;
@@ -64,7 +92,7 @@ inline int64_t FutureDrift(int64_t nTime) { return nTime + 24 * 60 * 60; } // up
 extern int64_t XDESupport;
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nStakeMinAge;
@@ -85,6 +113,8 @@ extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
 extern unsigned char pchMessageStart[4];
 extern std::map<uint256, CBlock*> mapOrphanBlocks;
+extern bool fBenchmark;
+extern int nScriptCheckThreads;
 
 // Settings
 extern int64_t nTransactionFee;
@@ -94,6 +124,9 @@ extern bool fUseFastIndex;
 extern unsigned int nDerivationMethodIndex;
 
 extern bool fEnforceCanonical;
+extern unsigned int nBlockFileCacheSize;
+extern bool fBlockFileMmap;
+extern bool fHeadersFirst;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
@@ -109,9 +142,13 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+void GetBlockFileCacheStats(uint64_t& nHits, uint64_t& nMisses);
+bool PushBlockFromDisk(CNode* pnode, const CBlockIndex* pindex);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+void UpdateBlockIndexByHeight(CBlockIndex* pindexNew);
+void GetBlockIndexArenaStats(size_t& nEntries, size_t& nBytes);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn);
@@ -124,12 +161,67 @@ unsigned int ComputeMinWork(unsigned int nBase, int64_t nTime);
 unsigned int ComputeMinStake(unsigned int nBase, int64_t nTime, unsigned int nBlockTime);
 int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
+/** Phases of block acceptance timed for getperfstats */
+enum BlockPhase
+{
+    BLOCKPHASE_CHECK,       // CheckBlock
+    BLOCKPHASE_FETCHINPUTS, // reading the outputs spent
+    BLOCKPHASE_VERIFY,      // ConnectInputs and waiting for the script checks
+    BLOCKPHASE_DBWRITE,     // committing the block's changes to LevelDB
+    BLOCKPHASE_WALLET,      // SyncWithWallets
+    BLOCKPHASE_TOTAL,       // all of ProcessBlock
+    BLOCKPHASE_COUNT
+};
+void RecordBlockPhase(BlockPhase phase, int64_t nMicros);
+void GetBlockPhaseStats(std::vector<std::pair<std::string, CMessageLatency> >& vRet, bool fReset);
+void PrintPerfStats();
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void StakeMiner(CWallet *pwallet);
 void ResendWalletTransactions(bool fForce = false);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck(void* parg);
+
+class CBlockFileHandle;
+
+/** Buffered read-only stream over a block file from the shared handle cache.
+ *  Reads go through pread (or straight out of the mapping for finalised files
+ *  with -blockfilemmap), so one open handle serves any number of readers.
+ */
+class CBlockFileReader
+{
+private:
+    boost::shared_ptr<CBlockFileHandle> handle;
+    unsigned int nFilePos;  // file offset just past the buffered window
+    unsigned int nFillSize; // size of the next pread, grows for large reads
+    const char* pbegin;     // unread part of the window
+    const char* pend;
+    std::vector<char> vchBuf;
+
+    bool Fill();
+
+public:
+    int nType;
+    int nVersion;
+
+    CBlockFileReader(unsigned int nFile, unsigned int nPos, int nTypeIn, int nVersionIn);
+
+    bool operator!() const       { return !handle; }
+    int GetType()                { return nType; }
+    int GetVersion()             { return nVersion; }
+
+    CBlockFileReader& read(char* pch, size_t nSize);
+
+    template<typename T>
+    CBlockFileReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
 
 
 
@@ -594,6 +686,20 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet)
+        {
+            CBlockFileReader filein(pos.nFile, pos.nTxPos, SER_DISK, CLIENT_VERSION);
+            if (!filein)
+                return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+            try {
+                filein >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
+            return true;
+        }
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -691,11 +797,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	If non-NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -706,6 +814,35 @@ protected:
 };
 
 
+/** Closure representing one script verification.
+ *  Note that this stores a reference to the spending transaction, so it
+ *  must outlive the check (the block's vtx does while ConnectBlock runs).
+ */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nHashType(0) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nHashType(nHashTypeIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
+
 
 
 
@@ -1037,7 +1174,7 @@ public:
         SetNull();
 
         // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
+        CBlockFileReader filein(nFile, nBlockPos, SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
         if (!fReadTransactions)
@@ -1205,6 +1342,11 @@ public:
         nNonce         = block.nNonce;
     }
 
+    // Block index entries live for the life of the process, so they are
+    // carved out of contiguous slabs instead of one heap block each.
+    static void* operator new(size_t nSize);
+    static void operator delete(void* p, size_t nSize);
+
     CBlock GetBlockHeader() const
     {
         CBlock block;
@@ -1401,11 +1543,14 @@ public:
         READWRITE(blockHash);
     )
 
-    uint256 GetBlockHash() const
+    /** Whether GetBlockHash() can return the stored hash without hashing the header */
+    bool IsBlockHashCached() const
     {
-        if (fUseFastIndex && (nTime < GetAdjustedTime() - 24 * 60 * 60) && blockHash != 0)
-            return blockHash;
+        return fUseFastIndex && (nTime < GetAdjustedTime() - 24 * 60 * 60) && blockHash != 0;
+    }
 
+    CBlock GetBlockHeader() const
+    {
         CBlock block;
         block.nVersion        = nVersion;
         block.hashPrevBlock   = hashPrev;
@@ -1413,8 +1558,15 @@ public:
         block.nTime           = nTime;
         block.nBits           = nBits;
         block.nNonce          = nNonce;
+        return block;
+    }
+
+    uint256 GetBlockHash() const
+    {
+        if (IsBlockHashCached())
+            return blockHash;
 
-        const_cast<CDiskBlockIndex*>(this)->blockHash = block.GetHash();
+        const_cast<CDiskBlockIndex*>(this)->blockHash = GetBlockHeader().GetHash();
 
         return blockHash;
     }
@@ -1464,7 +1616,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1491,6 +1643,12 @@ public:
         return vHave.empty();
     }
 
+    // Put a hash we have no block for yet, such as the best header, first
+    void Prepend(const uint256& hash)
+    {
+        vHave.insert(vHave.begin(), hash);
+    }
+
     void Set(const CBlockIndex* pindex)
     {
         vHave.clear();
@@ -1515,7 +1673,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1534,7 +1692,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1550,7 +1708,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1577,16 +1735,52 @@ public:
 
 
 
+/** What block assembly needs to know about a memory pool transaction,
+ * worked out once when it is accepted so CreateNewBlock never has to go
+ * back to disk for its inputs.
+ */
+class CTxMemPoolEntry
+{
+public:
+    const CTransaction* ptx;
+    uint256 hash;
+    int64_t nFee;
+    int64_t nValueIn;
+    unsigned int nTxSize;
+    unsigned int nSigOps;       // legacy and pay-to-script-hash
+    double dFeePerKb;
+    int nHeight;                // best height when accepted
+    double dPriority;           // at nHeight, from inputs in the chain
+    int64_t nChainValueIn;      // value of those inputs
+    int nCoinBaseHeight;        // height of the youngest coinbase/coinstake spent, or -1
+    std::set<uint256> setDependsOn; // parents in the pool
+    std::set<uint256> setDependers; // children in the pool
+
+    CTxMemPoolEntry(const CTransaction& tx);
+    CTxMemPoolEntry(const CTransaction& tx, const MapPrevTx& mapInputs);
+
+    // Each block the chain inputs get one confirmation older
+    double GetPriority(int nCurrentHeight) const
+    {
+        return dPriority + (double)nChainValueIn * (nCurrentHeight - nHeight) / nTxSize;
+    }
+};
+
 class CTxMemPool
 {
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+    // Fee per kB index over mapEntry, cheapest first. Priority can't be
+    // indexed the same way since entries age at different rates.
+    std::set<std::pair<double, uint256> > setFeeRate;
 
     bool accept(CTxDB& txdb, CTransaction &tx,
                 bool fCheckInputs, bool* pfMissingInputs);
     bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
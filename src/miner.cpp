@@ -54,37 +54,12 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().substr(0,10).c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
-    }
-};
-
-
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
  
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTxMemPoolEntry*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -171,112 +146,80 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
 
     // Collect memory pool transactions into the block
     int64_t nFees = 0;
+    uint64_t nBlockSize = 1000;
+    uint64_t nBlockTx = 0;
+    vector<int64_t> vTxFees(1, 0);
+    vector<unsigned int> vTxSize(1, 0);
     {
-        LOCK2(cs_main, mempool.cs);
-        CTxDB txdb("r");
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
+        // Everything needed was worked out when the pool accepted each
+        // transaction, so this neither reads the disk nor holds cs_main
+        LOCK(mempool.cs);
+        int nHeight = pindexPrev->nHeight;
+        int nBlockSigOps = 100;
+        bool fSortedByFee = (nBlockPrioritySize <= 0);
+        set<uint256> setConsidered;
+        set<uint256> setInBlock;
 
-        // This vector will be sorted into a priority queue:
+        // High priority transactions come off this heap first. Once sorted by
+        // fee, the pool's fee rate index is walked instead and the heap only
+        // holds children freed up by a parent going into the block.
+        TxPriorityCompare comparer(fSortedByFee);
         vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        if (!fSortedByFee)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
-                continue;
+            vecPriority.reserve(mempool.mapEntry.size());
+            for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapEntry.begin(); mi != mempool.mapEntry.end(); ++mi)
+                if (mi->second.setDependsOn.empty())
+                    vecPriority.push_back(TxPriority(mi->second.GetPriority(nHeight), mi->second.dFeePerKb, &mi->second));
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        }
+        set<pair<double, uint256> >::const_reverse_iterator itFee = mempool.setFeeRate.rbegin();
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        while (true)
+        {
+            const CTxMemPoolEntry* pentry;
+            if (!fSortedByFee && vecPriority.empty())
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
+                fSortedByFee = true;
+                comparer = TxPriorityCompare(fSortedByFee);
+                continue;
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
+            if (fSortedByFee && itFee != mempool.setFeeRate.rend() &&
+                (vecPriority.empty() || itFee->first >= vecPriority.front().get<1>()))
+            {
+                pentry = &mempool.mapEntry.find(itFee->second)->second;
+                ++itFee;
+            }
+            else if (!vecPriority.empty())
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                pentry = vecPriority.front().get<2>();
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
             }
             else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
-
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+                break;
+
+            // Has to wait for its parents; the last one in frees it up
+            bool fReady = true;
+            BOOST_FOREACH(const uint256& hashParent, pentry->setDependsOn)
+                if (!setInBlock.count(hashParent))
+                    fReady = false;
+            if (!fReady || !setConsidered.insert(pentry->hash).second)
+                continue;
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+            const CTransaction& tx = *pentry->ptx;
+            double dPriority = pentry->GetPriority(nHeight);
+            double dFeePerKb = pentry->dFeePerKb;
+            if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
+                continue;
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = pentry->nTxSize;
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+            // Limits on sigOps:
+            unsigned int nTxSigOps = pentry->nSigOps;
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
@@ -284,8 +227,12 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
             if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
                 continue;
 
+            // Coinbase and coinstake outputs it spends must have matured
+            if (pentry->nCoinBaseHeight >= 0 && nHeight - pentry->nCoinBaseHeight < nCoinbaseMaturity)
+                continue;
+
             // Transaction fee
-            int64_t nMinFee = tx.GetMinFee(nBlockSize, GMF_BLOCK);
+            int64_t nMinFee = tx.GetMinFee(nBlockSize, GMF_BLOCK, nTxSize);
 
             // Skip free transactions if we're past the minimum block size:
             if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
@@ -298,61 +245,77 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
             {
                 fSortedByFee = true;
                 comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.clear();
             }
 
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-            if (nTxFees < nMinFee)
-                continue;
-
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
+            if (pentry->nFee < nMinFee)
                 continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
 
             // Added
             pblock->vtx.push_back(tx);
+            vTxFees.push_back(pentry->nFee);
+            vTxSize.push_back(nTxSize);
+            setInBlock.insert(pentry->hash);
             nBlockSize += nTxSize;
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+            nFees += pentry->nFee;
 
             if (fDebug && GetBoolArg("-printpriority"))
             {
                 printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
+                       dPriority, dFeePerKb, pentry->hash.ToString().c_str());
             }
 
             // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
+            BOOST_FOREACH(const uint256& hashChild, pentry->setDependers)
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                const CTxMemPoolEntry& child = mempool.mapEntry.find(hashChild)->second;
+                vecPriority.push_back(TxPriority(child.GetPriority(nHeight), child.dFeePerKb, &child));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            }
+        }
+    }
+
+    {
+        // The pool was checked against the chain as each transaction came
+        // in, but blocks may have connected since. Drop anything whose
+        // inputs are no longer there to spend, along with its children;
+        // the index is mostly served from memory, so cs_main is held briefly.
+        LOCK(cs_main);
+        CTxDB txdb("r");
+        set<uint256> setInBlock;
+        unsigned int nKept = 1;
+        for (unsigned int i = 1; i < pblock->vtx.size(); i++)
+        {
+            const CTransaction& tx = pblock->vtx[i];
+            bool fSpendable = true;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                if (setInBlock.count(txin.prevout.hash))
+                    continue;
+                CTxIndex txindex;
+                if (!txdb.ReadTxIndex(txin.prevout.hash, txindex) ||
+                    txin.prevout.n >= txindex.vSpent.size() || !txindex.vSpent[txin.prevout.n].IsNull())
                 {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+                    fSpendable = false;
+                    break;
                 }
             }
+            if (!fSpendable)
+            {
+                printf("CreateNewBlock() : dropping %s, inputs spent or missing\n", tx.GetHash().ToString().substr(0,10).c_str());
+                nFees -= vTxFees[i];
+                nBlockSize -= vTxSize[i];
+                --nBlockTx;
+                continue;
+            }
+            setInBlock.insert(tx.GetHash());
+            if (nKept != i)
+                pblock->vtx[nKept] = tx;
+            nKept++;
         }
+        pblock->vtx.resize(nKept);
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
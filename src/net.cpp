@@ -16,6 +16,10 @@
 #include <string.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -28,6 +32,12 @@ using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 16;
 
+#ifdef USE_EPOLL
+// epoll set used by the socket handler, -1 while select() is in use
+static int hEpoll = -1;
+static const int MAX_EPOLL_EVENTS = 256;
+#endif
+
 void ThreadMessageHandler2(void* parg);
 void ThreadSocketHandler2(void* parg);
 void ThreadOpenConnections2(void* parg);
@@ -466,6 +476,25 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+// Add a new node's socket to the epoll set. Edge-triggered, so the
+// socket handler keeps fSocketReadable/fSocketWritable itself until a
+// read or write would block.
+static void PollNodeSocket(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0)
+    {
+        printf("epoll_ctl add failed for %s, error %d\n", pnode->addrName.c_str(), errno);
+        pnode->CloseSocketDisconnect();
+    }
+#endif
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     if (pszDest == NULL) {
@@ -514,6 +543,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        PollNodeSocket(pnode);
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -530,9 +560,17 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         printf("disconnecting node %s\n", addrName.c_str());
+#ifdef USE_EPOLL
+        // Drop it from the set explicitly: a forked child may still hold the fd
+        struct epoll_event event;
+        if (hEpoll != -1)
+            epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, &event);
+#endif
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
-        vRecv.clear();
+
+        // The recv buffer is left for ~CNode: this can be called from
+        // ProcessMessage, which is still walking vRecvMsg
     }
 }
 
@@ -540,6 +578,146 @@ void CNode::Cleanup()
 {
 }
 
+// requires LOCK(cs_vRecvMsg)
+bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
+{
+    bool fComplete = false;
+    while (nBytes > 0) {
+
+        // get current incomplete message, or create a new one
+        if (vRecvMsg.empty() || vRecvMsg.back().complete())
+            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+
+        CNetMessage& msg = vRecvMsg.back();
+
+        // absorb network data
+        int handled;
+        if (!msg.in_data)
+            handled = msg.readHeader(pch, nBytes);
+        else
+            handled = msg.readData(pch, nBytes);
+
+        if (handled < 0)
+            return false;
+
+        pch += handled;
+        nBytes -= handled;
+
+        if (msg.complete() && FinishRecvMsg())
+            fComplete = true;
+    }
+
+    if (fComplete)
+        WakeMessageHandler();
+
+    return true;
+}
+
+// requires LOCK(cs_vRecvMsg)
+char* CNode::GetRecvDataBuffer(unsigned int nMax, unsigned int& nSize)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+
+    CNetMessage& msg = vRecvMsg.back();
+    nSize = std::min(msg.hdr.nMessageSize - msg.nDataPos, nMax);
+    msg.ReserveData(nSize);
+    return &msg.vRecv[msg.nDataPos];
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::RecvDataBufferFilled(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.nDataPos += nBytes;
+    if (msg.complete() && FinishRecvMsg())
+        WakeMessageHandler();
+}
+
+// Checksum once here, so the message handler only sees good messages.
+// Returns false if the message was dropped.
+// requires LOCK(cs_vRecvMsg)
+bool CNode::FinishRecvMsg()
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.nTime = GetTimeMicros();
+    uint256 hash = Hash(msg.vRecv.begin(), msg.vRecv.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    if (nChecksum != msg.hdr.nChecksum)
+    {
+        printf("ReceiveMsgBytes(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
+               msg.hdr.GetCommand().c_str(), msg.hdr.nMessageSize, nChecksum, msg.hdr.nChecksum);
+        vRecvMsg.pop_back();
+        return false;
+    }
+    return true;
+}
+
+int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
+{
+    // copy data to temporary parsing buffer
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+
+    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    nHdrPos += nCopy;
+
+    // if header incomplete, exit
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
+        return nCopy;
+
+    // deserialize header
+    try {
+        hdrbuf >> hdr;
+    }
+    catch (std::exception &e) {
+        return -1;
+    }
+
+    // a peer that lost framing can't be resynchronised cheaply
+    if (memcmp(hdr.pchMessageStart, pchMessageStart, sizeof(pchMessageStart)) != 0)
+    {
+        printf("\n\nPROCESSMESSAGE: INVALID MESSAGESTART\n\n");
+        return -1;
+    }
+
+    // reject messages larger than MAX_SIZE
+    if (hdr.nMessageSize > MAX_SIZE)
+    {
+        printf("readHeader(%s, %u bytes) : nMessageSize > MAX_SIZE\n", hdr.GetCommand().c_str(), hdr.nMessageSize);
+        return -1;
+    }
+
+    // switch state to reading message data
+    in_data = true;
+
+    return nCopy;
+}
+
+int CNetMessage::readData(const char *pch, unsigned int nBytes)
+{
+    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+
+    ReserveData(nCopy);
+    memcpy(&vRecv[nDataPos], pch, nCopy);
+    nDataPos += nCopy;
+
+    return nCopy;
+}
+
+// vRecv is sized ahead of the data, which ends at nDataPos. It grows
+// geometrically, so resize() zero fills a handful of times per message
+// rather than on every read, and never past the size the header announced,
+// so a bogus header can't pin 32 MB per peer.
+void CNetMessage::ReserveData(unsigned int nBytes)
+{
+    unsigned int nNeeded = nDataPos + nBytes;
+    if (vRecv.size() < nNeeded)
+        vRecv.resize(std::min(hdr.nMessageSize, std::max(nNeeded + 64 * 1024, 2 * (unsigned int)vRecv.size())));
+}
+
 
 void CNode::PushVersion()
 {
@@ -658,6 +836,8 @@ void ThreadSocketHandler2(void* parg)
     printf("ThreadSocketHandler started\n");
     list<CNode*> vNodesDisconnected;
     unsigned int nPrevNodeCount = 0;
+    bool fMoreWork = false;
+    bool fLockBusy = false;
 
     while (true)
     {
@@ -671,7 +851,7 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->vSend.empty()))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -702,7 +882,7 @@ void ThreadSocketHandler2(void* parg)
                         TRY_LOCK(pnode->cs_vSend, lockSend);
                         if (lockSend)
                         {
-                            TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                             if (lockRecv)
                             {
                                 TRY_LOCK(pnode->cs_mapRequests, lockReq);
@@ -733,68 +913,117 @@ void ThreadSocketHandler2(void* parg)
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+        vector<SOCKET> vListenReady;
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            // Nodes keep their readiness flags across passes, so don't
+            // block when the last pass left data unread or room to send, and
+            // come back soon for a node whose buffers were locked
+            struct epoll_event events[MAX_EPOLL_EVENTS];
+            vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+            int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, fMoreWork ? 0 : (fLockBusy ? 5 : 50));
+            vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+            if (fShutdown)
+                return;
+            if (nEvents == SOCKET_ERROR && errno != EINTR)
+            {
+                printf("socket epoll_wait error %d\n", errno);
+                MilliSleep(50);
+            }
+            for (int i = 0; i < nEvents; i++)
             {
-                if (pnode->hSocket == INVALID_SOCKET)
+                CNode* pnode = (CNode*)events[i].data.ptr;
+                if (pnode == NULL)
+                {
+                    vListenReady = vhListenSocket;
                     continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    pnode->fSocketReadable = true;
+                if (events[i].events & EPOLLOUT)
+                    pnode->fSocketWritable = true;
+            }
+        }
+        else
+#endif
+        {
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+            fd_set fdsetRecv;
+            fd_set fdsetSend;
+            fd_set fdsetError;
+            FD_ZERO(&fdsetRecv);
+            FD_ZERO(&fdsetSend);
+            FD_ZERO(&fdsetError);
+            SOCKET hSocketMax = 0;
+            bool have_fds = false;
+
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+                FD_SET(hListenSocket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket);
                 have_fds = true;
+            }
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
-                        FD_SET(pnode->hSocket, &fdsetSend);
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+                    FD_SET(pnode->hSocket, &fdsetError);
+                    hSocketMax = max(hSocketMax, pnode->hSocket);
+                    have_fds = true;
+                    {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend && !pnode->vSend.empty())
+                            FD_SET(pnode->hSocket, &fdsetSend);
+                    }
                 }
             }
-        }
 
-        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
-        if (fShutdown)
-            return;
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
+            vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+            if (fShutdown)
+                return;
+            if (nSelect == SOCKET_ERROR)
             {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                if (have_fds)
+                {
+                    int nErr = WSAGetLastError();
+                    printf("socket select error %d\n", nErr);
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec/1000);
+            }
+
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                    vListenReady.push_back(hListenSocket);
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+                    pnode->fSocketReadable = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+                    pnode->fSocketWritable = FD_ISSET(pnode->hSocket, &fdsetSend);
+                }
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
         }
 
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        BOOST_FOREACH(SOCKET hListenSocket, vListenReady)
         {
 #ifdef USE_IPV6
             struct sockaddr_storage sockaddr;
@@ -841,6 +1070,7 @@ void ThreadSocketHandler2(void* parg)
                     LOCK(cs_vNodes);
                     vNodes.push_back(pnode);
                 }
+                PollNodeSocket(pnode);
             }
         }
 
@@ -848,6 +1078,8 @@ void ThreadSocketHandler2(void* parg)
         //
         // Service each socket
         //
+        fMoreWork = false;
+        fLockBusy = false;
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
@@ -865,28 +1097,43 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            bool fRecvBusy = false, fSendBusy = false;
+            if (pnode->fSocketReadable)
             {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                fRecvBusy = !lockRecv;
                 if (lockRecv)
                 {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    if (nPos > ReceiveBufferSize()) {
+                    if (pnode->GetTotalRecvSize() > ReceiveBufferSize()) {
                         if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%"PRIszu" bytes)\n", vRecv.size());
+                            printf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
                         pnode->CloseSocketDisconnect();
                     }
                     else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        // typical socket buffer is 8K-64K. The rest of a
+                        // payload is read straight into its message; headers
+                        // and small messages go through a stack buffer, so
+                        // one read can pick up several of them.
+                        static const unsigned int nRecvChunk = 0x10000;
+                        char pchBuf[nRecvChunk];
+                        unsigned int nWant = nRecvChunk;
+                        char* pchDest = pnode->GetRecvDataBuffer(nRecvChunk, nWant);
+                        if (pchDest == NULL || nWant < 0x1000)
+                        {
+                            pchDest = pchBuf;
+                            nWant = nRecvChunk;
+                        }
+                        int nBytes = recv(pnode->hSocket, pchDest, nWant, MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
+                            if (pchDest != pchBuf)
+                                pnode->RecvDataBufferFilled(nBytes);
+                            else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                                pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
+                            // A short read drained the socket
+                            if ((unsigned int)nBytes < nWant)
+                                pnode->fSocketReadable = false;
                         }
                         else if (nBytes == 0)
                         {
@@ -899,7 +1146,9 @@ void ThreadSocketHandler2(void* parg)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSocketReadable = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     printf("socket recv error %d\n", nErr);
@@ -915,9 +1164,10 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSocketWritable)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
+                fSendBusy = !lockSend;
                 if (lockSend)
                 {
                     CDataStream& vSend = pnode->vSend;
@@ -926,14 +1176,21 @@ void ThreadSocketHandler2(void* parg)
                         int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
+                            // The message handler skips nodes whose send
+                            // buffer is full; tell it when this one drains
+                            bool fWasFull = vSend.size() >= SendBufferSize();
                             vSend.erase(vSend.begin(), vSend.begin() + nBytes);
                             pnode->nLastSend = GetTime();
+                            if (fWasFull && vSend.size() < SendBufferSize())
+                                WakeMessageHandler();
                         }
                         else if (nBytes < 0)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSocketWritable = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 printf("socket send error %d\n", nErr);
                                 pnode->CloseSocketDisconnect();
@@ -942,11 +1199,30 @@ void ThreadSocketHandler2(void* parg)
                     }
                 }
             }
+            // Whoever holds cs_vSend may be queueing a message, so a busy
+            // lock counts as something to send
+            bool fSendEmpty = false;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                    fSendEmpty = pnode->vSend.empty();
+                else
+                    fSendBusy = true;
+            }
+            if (pnode->hSocket != INVALID_SOCKET)
+            {
+                bool fWantRecv = pnode->fSocketReadable;
+                bool fWantSend = pnode->fSocketWritable && !fSendEmpty;
+                if ((fWantRecv && !fRecvBusy) || (fWantSend && !fSendBusy))
+                    fMoreWork = true;
+                else if (fWantRecv || fWantSend)
+                    fLockBusy = true;
+            }
 
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
+            if (fSendEmpty)
                 pnode->nLastSendEmpty = GetTime();
             if (GetTime() - pnode->nTimeConnected > 60)
             {
@@ -1332,6 +1608,26 @@ void static ThreadStakeMiner(void* parg)
     printf("ThreadStakeMiner exiting, %d threads remaining\n", vnThreadsRunning[THREAD_STAKE_MINER]);
 }
 
+void static ThreadKeyPoolRefill(void* parg)
+{
+    printf("ThreadKeyPoolRefill started\n");
+    CWallet* pwallet = (CWallet*)parg;
+    try
+    {
+        vnThreadsRunning[THREAD_KEYPOOL]++;
+        KeyPoolRefiller(pwallet);
+        vnThreadsRunning[THREAD_KEYPOOL]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_KEYPOOL]--;
+        PrintException(&e, "ThreadKeyPoolRefill()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_KEYPOOL]--;
+        PrintException(NULL, "ThreadKeyPoolRefill()");
+    }
+    printf("ThreadKeyPoolRefill exiting, %d threads remaining\n", vnThreadsRunning[THREAD_KEYPOOL]);
+}
+
 void ThreadOpenConnections2(void* parg)
 {
     printf("ThreadOpenConnections started\n");
@@ -1606,10 +1902,54 @@ void ThreadMessageHandler(void* parg)
     printf("ThreadMessageHandler exited\n");
 }
 
+// The socket thread signals this when it completes a message or a full
+// send buffer drains
+static boost::mutex mutexMsgHandler;
+static boost::condition_variable condMsgHandler;
+static bool fMsgHandlerWake = false;
+
+void WakeMessageHandler()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMsgHandler);
+        fMsgHandlerWake = true;
+    }
+    condMsgHandler.notify_one();
+}
+
+static CCriticalSection cs_mapMsgLatency;
+static std::map<std::string, CMessageLatency> mapMsgLatency;
+
+void RecordMessageLatency(const std::string& strCommand, int64_t nQueueMicros, int64_t nProcessMicros, unsigned int nSize)
+{
+    LOCK(cs_mapMsgLatency);
+    std::map<std::string, CMessageLatency>::iterator mi = mapMsgLatency.find(strCommand);
+    if (mi == mapMsgLatency.end())
+    {
+        // Peers pick the command names, so don't let them grow the map
+        if (mapMsgLatency.size() >= 64)
+            mi = mapMsgLatency.insert(make_pair(std::string("other"), CMessageLatency())).first;
+        else
+            mi = mapMsgLatency.insert(make_pair(strCommand, CMessageLatency())).first;
+    }
+    mi->second.Add(nQueueMicros, nProcessMicros, nSize);
+}
+
+void GetMessageLatency(std::map<std::string, CMessageLatency>& mapRet, bool fReset)
+{
+    LOCK(cs_mapMsgLatency);
+    mapRet = mapMsgLatency;
+    if (fReset)
+        mapMsgLatency.clear();
+}
+
 void ThreadMessageHandler2(void* parg)
 {
     printf("ThreadMessageHandler started\n");
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    int64_t nLastSendSweep = 0;
+    int64_t nPerfStatsInterval = GetArg("-perfstatsinterval", 0) * 1000;
+    int64_t nLastPerfStats = GetTimeMillis();
     while (!fShutdown)
     {
         vector<CNode*> vNodesCopy;
@@ -1620,22 +1960,49 @@ void ThreadMessageHandler2(void* parg)
                 pnode->AddRef();
         }
 
-        // Poll the connected nodes for messages
+        // SendMessages does its periodic work (trickling, pings, asking for
+        // inventory) on every node each 100ms. In between, only nodes that
+        // just had a message handled get a turn, so replies go out at once.
+        int64_t nNow = GetTimeMillis();
+        bool fSendSweep = (nNow - nLastSendSweep >= 100);
+        if (fSendSweep)
+            nLastSendSweep = nNow;
+
+        if (nPerfStatsInterval > 0 && nNow - nLastPerfStats >= nPerfStatsInterval)
+        {
+            PrintPerfStats();
+            nLastPerfStats = nNow;
+        }
+
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (fSendSweep && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+
+        // Handle one message per node per pass, so a busy peer can't starve
+        // the others, and go round again while any node has more
+        bool fMoreWork = false;
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             // Receive messages
+            bool fProcessed = false;
             {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
+                {
+                    size_t nQueued = pnode->vRecvMsg.size();
                     ProcessMessages(pnode);
+                    fProcessed = (pnode->vRecvMsg.size() != nQueued);
+                    if (pnode->HaveRecvMsgReady())
+                        fMoreWork = true;
+                }
+                else if (!pnode->fDisconnect && !pnode->vRecvMsg.empty())
+                    fMoreWork = true;
             }
             if (fShutdown)
                 return;
 
             // Send messages
+            if (fSendSweep || fProcessed)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
@@ -1651,11 +2018,20 @@ void ThreadMessageHandler2(void* parg)
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up.
+        // Wait for the socket thread to hand over work, or for the next
+        // send sweep.
         // Reduce vnThreadsRunning so StopNode has permission to exit while
         // we're sleeping, but we must always check fShutdown after doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        MilliSleep(100);
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgHandler);
+            if (!fMoreWork && !fMsgHandlerWake)
+            {
+                int64_t nWait = std::max(nLastSendSweep + 100 - GetTimeMillis(), (int64_t)1);
+                condMsgHandler.timed_wait(lock, boost::posix_time::milliseconds(nWait));
+            }
+            fMsgHandlerWake = false;
+        }
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -1852,6 +2228,30 @@ void StartNode(void* parg)
 
     Discover();
 
+#ifdef USE_EPOLL
+    if (hEpoll == -1 && GetBoolArg("-epoll", true))
+    {
+        // the size argument is only a hint, but must be positive
+        hEpoll = epoll_create(MAX_EPOLL_EVENTS);
+        if (hEpoll == -1)
+            printf("epoll_create failed, error %d; using select()\n", errno);
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        {
+            // Listening sockets stay level-triggered, one accept per pass
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (hEpoll != -1 && epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) != 0)
+            {
+                printf("epoll_ctl failed for listening socket, error %d; using select()\n", errno);
+                close(hEpoll);
+                hEpoll = -1;
+            }
+        }
+    }
+    printf("Socket handler using %s\n", hEpoll != -1 ? "epoll" : "select");
+#endif
+
     //
     // Start threads
     //
@@ -1896,6 +2296,10 @@ void StartNode(void* parg)
     else
         if (!NewThread(ThreadStakeMiner, pwalletMain))
             printf("Error: NewThread(ThreadStakeMiner) failed\n");
+
+    // Keep the key pool topped up in the background
+    if (!NewThread(ThreadKeyPoolRefill, pwalletMain))
+        printf("Error: NewThread(ThreadKeyPoolRefill) failed\n");
 }
 
 bool StopNode()
@@ -1930,8 +2334,13 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_STAKE_MINER] > 0) printf("ThreadStakeMiner still running\n");
+    if (vnThreadsRunning[THREAD_KEYPOOL] > 0) printf("ThreadKeyPoolRefill still running\n");
     while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
         MilliSleep(20);
+    // The wallet is flushed and closed after this, so a key pool batch has
+    // to finish first
+    while (vnThreadsRunning[THREAD_KEYPOOL] > 0)
+        MilliSleep(20);
     MilliSleep(50);
     DumpAddresses();
     return true;
@@ -106,6 +106,7 @@ enum threadId
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
     THREAD_STAKE_MINER,
+    THREAD_KEYPOOL,
 
     THREAD_MAX
 };
@@ -146,6 +147,116 @@ public:
 
 
 
+/** Per-command latency of the message handler: how long a message waited
+ * after the socket thread completed it, how long processing took, and a
+ * histogram of the sum in power-of-two microsecond buckets. Block
+ * acceptance phases are timed with it too, with no queue time. */
+class CMessageLatency
+{
+public:
+    enum { HISTOGRAM_BUCKETS = 24 }; // bucket i holds [2^(i-1), 2^i) us, the last everything above
+
+    uint64_t nCount;
+    int64_t nQueueTotal;
+    int64_t nProcessTotal;
+    int64_t nMax;
+    uint64_t nBytes;
+    uint64_t vHistogram[HISTOGRAM_BUCKETS];
+
+    CMessageLatency()
+    {
+        nCount = 0;
+        nBytes = 0;
+        nQueueTotal = 0;
+        nProcessTotal = 0;
+        nMax = 0;
+        memset(vHistogram, 0, sizeof(vHistogram));
+    }
+
+    void Add(int64_t nQueueMicros, int64_t nProcessMicros, unsigned int nSize = 0)
+    {
+        int64_t nTotal = std::max(nQueueMicros + nProcessMicros, (int64_t)0);
+        int nBucket = 0;
+        while (nBucket < HISTOGRAM_BUCKETS - 1 && (nTotal >> nBucket) != 0)
+            nBucket++;
+        vHistogram[nBucket]++;
+        nCount++;
+        nBytes += nSize;
+        nQueueTotal += nQueueMicros;
+        nProcessTotal += nProcessMicros;
+        nMax = std::max(nMax, nTotal);
+    }
+
+    // Upper bound, in microseconds, of the bucket holding the given percentile
+    int64_t Percentile(double dPercent) const
+    {
+        uint64_t nRank = (uint64_t)(nCount * dPercent / 100.0);
+        uint64_t nSeen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++)
+        {
+            nSeen += vHistogram[i];
+            if (nSeen > nRank)
+                return (int64_t)1 << i;
+        }
+        return nMax;
+    }
+};
+
+void RecordMessageLatency(const std::string& strCommand, int64_t nQueueMicros, int64_t nProcessMicros, unsigned int nSize);
+void GetMessageLatency(std::map<std::string, CMessageLatency>& mapRet, bool fReset);
+void WakeMessageHandler();
+
+
+
+
+
+/** A message being received from a peer: the header, then the payload read
+ * straight into its own buffer. The socket thread fills these in and checks
+ * the checksum once a message is complete, so the message handler only ever
+ * sees whole messages. */
+class CNetMessage
+{
+public:
+    bool in_data;                   // parsing header (false) or data (true)
+
+    CDataStream hdrbuf;             // partially received header
+    CMessageHeader hdr;             // complete header
+    unsigned int nHdrPos;
+
+    CDataStream vRecv;              // received message data
+    unsigned int nDataPos;
+
+    int64_t nTime;                  // time (in microseconds) the message was completed
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    {
+        hdrbuf.resize(CMessageHeader::HEADER_SIZE);
+        in_data = false;
+        nHdrPos = 0;
+        nDataPos = 0;
+        nTime = 0;
+    }
+
+    bool complete() const
+    {
+        if (!in_data)
+            return false;
+        return (hdr.nMessageSize == nDataPos);
+    }
+
+    void SetVersion(int nVersionIn)
+    {
+        hdrbuf.SetVersion(nVersionIn);
+        vRecv.SetVersion(nVersionIn);
+    }
+
+    int readHeader(const char *pch, unsigned int nBytes);
+    int readData(const char *pch, unsigned int nBytes);
+    void ReserveData(unsigned int nBytes);
+};
+
+
+
 
 
 /** Information about a peer */
@@ -156,9 +267,12 @@ public:
     uint64_t nServices;
     SOCKET hSocket;
     CDataStream vSend;
-    CDataStream vRecv;
     CCriticalSection cs_vSend;
-    CCriticalSection cs_vRecv;
+
+    std::deque<CNetMessage> vRecvMsg;
+    CCriticalSection cs_vRecvMsg;
+    int nRecvVersion;
+
     int64_t nLastSend;
     int64_t nLastRecv;
     int64_t nLastSendEmpty;
@@ -178,6 +292,10 @@ public:
     bool fDisconnect;
     CSemaphoreGrant grantOutbound;
     int nRefCount;
+    // Socket readiness as last reported by select()/epoll; only the socket
+    // handler thread touches these
+    bool fSocketReadable;
+    bool fSocketWritable;
 protected:
 
     // Denial-of-service detection/prevention
@@ -207,7 +325,10 @@ public:
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    // headers-first sync: blocks asked of this peer, and when
+    std::map<uint256, int64_t> mapBlocksInFlight;
+
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -217,6 +338,7 @@ public:
         nTimeConnected = GetTime();
         nHeaderStart = -1;
         nMessageStart = -1;
+        nRecvVersion = MIN_PROTO_VERSION;
         addr = addrIn;
         addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
         nVersion = 0;
@@ -228,6 +350,8 @@ public:
         fSuccessfullyConnected = false;
         fDisconnect = false;
         nRefCount = 0;
+        fSocketReadable = false;
+        fSocketWritable = false;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
@@ -276,6 +400,47 @@ public:
 
 
 
+    // requires LOCK(cs_vRecvMsg)
+    unsigned int GetTotalRecvSize()
+    {
+        unsigned int total = 0;
+        BOOST_FOREACH(const CNetMessage &msg, vRecvMsg)
+            total += msg.vRecv.size() + CMessageHeader::HEADER_SIZE;
+        return total;
+    }
+
+    // requires LOCK(cs_vRecvMsg)
+    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
+
+    // Room for up to nMax more bytes of the payload being received, for
+    // recv() to fill in place, or NULL if a header comes next. Report what
+    // was written with RecvDataBufferFilled.
+    // requires LOCK(cs_vRecvMsg)
+    char* GetRecvDataBuffer(unsigned int nMax, unsigned int& nSize);
+    void RecvDataBufferFilled(unsigned int nBytes);
+
+private:
+    bool FinishRecvMsg();
+
+public:
+
+    // True if the message handler could act on this node right now. Nodes
+    // marked for disconnect are left for the socket thread to reap.
+    bool HaveRecvMsgReady()
+    {
+        return !fDisconnect && !vRecvMsg.empty() && vRecvMsg.front().complete() && vSend.size() < SendBufferSize();
+    }
+
+    // requires LOCK(cs_vRecvMsg)
+    void SetRecvVersion(int nVersionIn)
+    {
+        nRecvVersion = nVersionIn;
+        BOOST_FOREACH(CNetMessage &msg, vRecvMsg)
+            msg.SetVersion(nVersionIn);
+    }
+
+
+
     void AddAddressKnown(const CAddress& addr)
     {
         setAddrKnown.insert(addr);
@@ -338,8 +503,7 @@ public:
         nHeaderStart = vSend.size();
         vSend << CMessageHeader(pszCommand, 0);
         nMessageStart = vSend.size();
-        if (fDebug)
-            printf("sending: %s ", pszCommand);
+        LogPrint("net", "sending: %s ", pszCommand);
     }
 
     void AbortMessage()
@@ -351,8 +515,7 @@ public:
         nMessageStart = -1;
         LEAVE_CRITICAL_SECTION(cs_vSend);
 
-        if (fDebug)
-            printf("(aborted)\n");
+        LogPrint("net", "(aborted)\n");
     }
 
     void EndMessage()
@@ -378,9 +541,7 @@ public:
         assert(nMessageStart - nHeaderStart >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
         memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::CHECKSUM_OFFSET, &nChecksum, sizeof(nChecksum));
 
-        if (fDebug) {
-            printf("(%d bytes)\n", nSize);
-        }
+        LogPrint("net", "(%d bytes)\n", nSize);
 
         nHeaderStart = -1;
         nMessageStart = -1;
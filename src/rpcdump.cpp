@@ -107,15 +107,20 @@ public:
 
 Value importprivkey(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() < 1 || params.size() > 2)
+    if (fHelp || params.size() < 1 || params.size() > 3)
         throw runtime_error(
-            "importprivkey <xdecoinprivkey> [label]\n"
-            "Adds a private key (as returned by dumpprivkey) to your wallet.");
+            "importprivkey <xdecoinprivkey> [label] [birthtime]\n"
+            "Adds a private key (as returned by dumpprivkey) to your wallet.\n"
+            "If the key's creation time is given, only blocks from then on are rescanned.");
 
     string strSecret = params[0].get_str();
     string strLabel = "";
     if (params.size() > 1)
         strLabel = params[1].get_str();
+    // 0 would be taken as no key birthday at all, 1 rescans everything
+    int64_t nTimeBirth = 1;
+    if (params.size() > 2)
+        nTimeBirth = std::max(params[2].get_int64(), (int64_t)1);
     CBitcoinSecret vchSecret;
     bool fGood = vchSecret.SetString(strSecret);
 
@@ -131,13 +136,22 @@ Value importprivkey(const Array& params, bool fHelp)
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
-        pwalletMain->MarkDirty();
         pwalletMain->SetAddressBookName(vchAddress, strLabel);
 
+        pwalletMain->mapKeyMetadata[vchAddress].nCreateTime = nTimeBirth;
         if (!pwalletMain->AddKey(key))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+        pwalletMain->MarkDirty();
+        if (!pwalletMain->nTimeFirstKey || nTimeBirth < pwalletMain->nTimeFirstKey)
+            pwalletMain->nTimeFirstKey = nTimeBirth;
+    }
+
+    // The rescan takes the wallet lock only for blocks that may involve it,
+    // so the wallet stays usable meanwhile
+    {
+        LOCK(cs_main);
 
-        pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
+        pwalletMain->ScanForWalletTransactions(FindRescanStart(pindexBest, nTimeBirth), true);
         pwalletMain->ReacceptWalletTransactions();
     }
 
@@ -213,9 +227,7 @@ Value importwallet(const Array& params, bool fHelp)
     }
     file.close();
 
-    CBlockIndex *pindex = pindexBest;
-    while (pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
-        pindex = pindex->pprev;
+    CBlockIndex *pindex = FindRescanStart(pindexBest, nTimeBegin);
 
     if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
         pwalletMain->nTimeFirstKey = nTimeBegin;
@@ -68,6 +68,120 @@ Value getpeerinfo(const Array& params, bool fHelp)
 
     return ret;
 }
+
+Value getmessagestats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getmessagestats [reset=false]\n"
+            "Returns, per message command, how long received messages waited for the\n"
+            "message handler and how long processing took, in milliseconds.\n"
+            "histogram counts messages by total latency in power-of-two microsecond\n"
+            "buckets, the first below 1us. p50/p90/p99 are bucket upper bounds.\n"
+            "With reset=true the counters start over after this call.");
+
+    bool fReset = false;
+    if (params.size() > 0)
+        fReset = params[0].get_bool();
+
+    map<string, CMessageLatency> mapLatency;
+    GetMessageLatency(mapLatency, fReset);
+
+    Object ret;
+    for (map<string, CMessageLatency>::iterator mi = mapLatency.begin(); mi != mapLatency.end(); ++mi)
+    {
+        const CMessageLatency& latency = mi->second;
+        if (latency.nCount == 0)
+            continue;
+
+        Object obj;
+        obj.push_back(Pair("count", (boost::int64_t)latency.nCount));
+        obj.push_back(Pair("avgqueue", latency.nQueueTotal * 0.001 / latency.nCount));
+        obj.push_back(Pair("avgprocess", latency.nProcessTotal * 0.001 / latency.nCount));
+        obj.push_back(Pair("p50", latency.Percentile(50) * 0.001));
+        obj.push_back(Pair("p90", latency.Percentile(90) * 0.001));
+        obj.push_back(Pair("p99", latency.Percentile(99) * 0.001));
+        obj.push_back(Pair("max", latency.nMax * 0.001));
+
+        // Leave off the empty buckets past the slowest message
+        int nLast = CMessageLatency::HISTOGRAM_BUCKETS - 1;
+        while (nLast > 0 && latency.vHistogram[nLast] == 0)
+            nLast--;
+        Array histogram;
+        for (int i = 0; i <= nLast; i++)
+            histogram.push_back((boost::int64_t)latency.vHistogram[i]);
+        obj.push_back(Pair("histogram", histogram));
+
+        ret.push_back(Pair(mi->first, obj));
+    }
+
+    return ret;
+}
+
+Value getperfstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getperfstats [reset=false]\n"
+            "Returns where the node spends its time, in milliseconds.\n"
+            "messages: per command, how many were handled and their bytes, the total\n"
+            "and average processing time, and the latency percentiles getmessagestats\n"
+            "gives.\n"
+            "blocks: per phase of accepting a block (check, fetchinputs, verify,\n"
+            "dbwrite, wallet, and total for all of it), how often it ran and how long\n"
+            "it took.\n"
+            "With reset=true the counters, shared with getmessagestats, start over\n"
+            "after this call.");
+
+    bool fReset = false;
+    if (params.size() > 0)
+        fReset = params[0].get_bool();
+
+    map<string, CMessageLatency> mapLatency;
+    GetMessageLatency(mapLatency, fReset);
+    vector<pair<string, CMessageLatency> > vPhase;
+    GetBlockPhaseStats(vPhase, fReset);
+
+    Object messages;
+    for (map<string, CMessageLatency>::iterator mi = mapLatency.begin(); mi != mapLatency.end(); ++mi)
+    {
+        const CMessageLatency& latency = mi->second;
+        if (latency.nCount == 0)
+            continue;
+
+        Object obj;
+        obj.push_back(Pair("count", (boost::int64_t)latency.nCount));
+        obj.push_back(Pair("bytes", (boost::int64_t)latency.nBytes));
+        obj.push_back(Pair("totalprocess", latency.nProcessTotal * 0.001));
+        obj.push_back(Pair("avgqueue", latency.nQueueTotal * 0.001 / latency.nCount));
+        obj.push_back(Pair("avgprocess", latency.nProcessTotal * 0.001 / latency.nCount));
+        obj.push_back(Pair("p50", latency.Percentile(50) * 0.001));
+        obj.push_back(Pair("p90", latency.Percentile(90) * 0.001));
+        obj.push_back(Pair("p99", latency.Percentile(99) * 0.001));
+        obj.push_back(Pair("max", latency.nMax * 0.001));
+        messages.push_back(Pair(mi->first, obj));
+    }
+
+    Object blocks;
+    for (unsigned int i = 0; i < vPhase.size(); i++)
+    {
+        const CMessageLatency& latency = vPhase[i].second;
+        Object obj;
+        obj.push_back(Pair("count", (boost::int64_t)latency.nCount));
+        obj.push_back(Pair("total", latency.nProcessTotal * 0.001));
+        obj.push_back(Pair("avg", latency.nCount ? latency.nProcessTotal * 0.001 / latency.nCount : 0.0));
+        obj.push_back(Pair("p50", latency.nCount ? latency.Percentile(50) * 0.001 : 0.0));
+        obj.push_back(Pair("p90", latency.nCount ? latency.Percentile(90) * 0.001 : 0.0));
+        obj.push_back(Pair("p99", latency.nCount ? latency.Percentile(99) * 0.001 : 0.0));
+        obj.push_back(Pair("max", latency.nMax * 0.001));
+        blocks.push_back(Pair(vPhase[i].first, obj));
+    }
+
+    Object ret;
+    ret.push_back(Pair("messages", messages));
+    ret.push_back(Pair("blocks", blocks));
+    return ret;
+}
  
 // XDECoin: send alert.
 // There is a known deadlock situation with ThreadMessageHandler
@@ -6,6 +6,7 @@
 
 #include "wallet.h"
 #include "walletdb.h"
+#include "txdb.h"
 #include "bitcoinrpc.h"
 #include "init.h"
 #include "base58.h"
@@ -96,6 +97,18 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("proxy",         (proxy.first.IsValid() ? proxy.first.ToStringIPPort() : string())));
     obj.push_back(Pair("ip",            addrSeenByPeer.ToStringIP()));
 
+    uint64_t nBlockFileHits, nBlockFileMisses;
+    GetBlockFileCacheStats(nBlockFileHits, nBlockFileMisses);
+    obj.push_back(Pair("blockfilecachehits",   (boost::int64_t)nBlockFileHits));
+    obj.push_back(Pair("blockfilecachemisses", (boost::int64_t)nBlockFileMisses));
+
+    uint64_t nTxCacheHits, nTxCacheMisses;
+    size_t nTxCacheUsage;
+    GetTxCacheStats(nTxCacheHits, nTxCacheMisses, nTxCacheUsage);
+    obj.push_back(Pair("txcachehits",   (boost::int64_t)nTxCacheHits));
+    obj.push_back(Pair("txcachemisses", (boost::int64_t)nTxCacheMisses));
+    obj.push_back(Pair("txcachesize",   (boost::int64_t)nTxCacheUsage));
+
     diff.push_back(Pair("proof-of-work",  GetDifficulty()));
     diff.push_back(Pair("proof-of-stake", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
     obj.push_back(Pair("difficulty",    diff));
@@ -124,9 +137,6 @@ Value getnewpubkey(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     // Generate a new key that is added to wallet
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey, false))
@@ -154,9 +164,6 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     // Generate a new key that is added to wallet
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey, false))
@@ -1309,7 +1316,7 @@ Value gettransaction(const Array& params, bool fHelp)
             else
             {
                 entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
                 if (mi != mapBlockIndex.end() && (*mi).second)
                 {
                     CBlockIndex* pindex = (*mi).second;
@@ -1369,14 +1376,6 @@ Value keypoolrefill(const Array& params, bool fHelp)
 }
 
 
-void ThreadTopUpKeyPool(void* parg)
-{
-    // Make this thread recognisable as the key-topping-up thread
-    RenameThread("XDECoin-key-top");
-
-    pwalletMain->TopUpKeyPool();
-}
-
 void ThreadCleanWalletPassphrase(void* parg)
 {
     // Make this thread recognisable as the wallet relocking thread
@@ -1452,7 +1451,7 @@ Value walletpassphrase(const Array& params, bool fHelp)
             "walletpassphrase <passphrase> <timeout>\n"
             "Stores the wallet decryption key in memory for <timeout> seconds.");
 
-    NewThread(ThreadTopUpKeyPool, NULL);
+    pwalletMain->RequestKeyPoolRefill();
     int64_t* pnSleepTime = new int64_t(params[1].get_int64());
     NewThread(ThreadCleanWalletPassphrase, pnSleepTime);
 
@@ -5,8 +5,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <openssl/sha.h>
 
 using namespace std;
 using namespace boost;
@@ -19,7 +18,7 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool CheckSig(const valtype& vchSig, const valtype& vchPubKey, const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
@@ -321,6 +320,31 @@ static bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
+//
+// Subset of script starting at the most recent codeseparator, less the
+// nSigs signatures from stacktop(-isig) down, since there's no way for a
+// signature to sign itself. Usually none of the signatures appear in the
+// script, and then the script is used as it is rather than copied.
+//
+static const CScript& GetScriptCode(const CScript& script, CScript::const_iterator pbegincodehash,
+                                    const vector<valtype>& stack, int isig, int nSigs, CScript& scriptCodeCopy)
+{
+    bool fCopy = (pbegincodehash != script.begin());
+    for (int k = 0; k < nSigs && !fCopy; k++)
+    {
+        // An empty signature is pushed as OP_0, which may well be there
+        const valtype& vchSig = stacktop(-isig-k);
+        fCopy = vchSig.empty() || search(script.begin(), script.end(), vchSig.begin(), vchSig.end()) != script.end();
+    }
+    if (!fCopy)
+        return script;
+
+    scriptCodeCopy = CScript(pbegincodehash, script.end());
+    for (int k = 0; k < nSigs; k++)
+        scriptCodeCopy.FindAndDelete(CScript(stacktop(-isig-k)));
+    return scriptCodeCopy;
+}
+
 bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     CAutoBN_CTX pctx;
@@ -1006,11 +1030,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
                     //PrintHex(vchPubKey.begin(), vchPubKey.end(), "pubkey: %s\n");
 
-                    // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
-
-                    // Drop the signature, since there's no way for a signature to sign itself
-                    scriptCode.FindAndDelete(CScript(vchSig));
+                    CScript scriptCodeCopy;
+                    const CScript& scriptCode = GetScriptCode(script, pbegincodehash, stack, 2, 1, scriptCodeCopy);
 
                     bool fSuccess = IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
                         CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
@@ -1056,15 +1077,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
-
-                    // Drop the signatures, since there's no way for a signature to sign itself
-                    for (int k = 0; k < nSigsCount; k++)
-                    {
-                        valtype& vchSig = stacktop(-isig-k);
-                        scriptCode.FindAndDelete(CScript(vchSig));
-                    }
+                    CScript scriptCodeCopy;
+                    const CScript& scriptCode = GetScriptCode(script, pbegincodehash, stack, isig, nSigsCount, scriptCodeCopy);
 
                     bool fSuccess = true;
                     while (fSuccess && nSigsCount > 0)
@@ -1133,66 +1147,127 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+//
+// Serialises txTo the way the signature hash sees it, straight into the
+// hasher: other inputs' scripts blanked, scriptCode (less any
+// OP_CODESEPARATORs) in place of input nIn's, and the outputs and
+// sequence numbers the hash type leaves out blanked or dropped. This
+// used to be done on a copy of the transaction for every input checked.
+//
+class CTransactionSignatureSerializer
 {
-    if (nIn >= txTo.vin.size())
+private:
+    const CTransaction& txTo;
+    const CScript& scriptCode;
+    unsigned int nIn;
+    bool fAnyoneCanPay;
+    bool fHashSingle;
+    bool fHashNone;
+
+public:
+    CTransactionSignatureSerializer(const CTransaction& txToIn, const CScript& scriptCodeIn, unsigned int nInIn, int nHashTypeIn) :
+        txTo(txToIn), scriptCode(scriptCodeIn), nIn(nInIn),
+        fAnyoneCanPay(!!(nHashTypeIn & SIGHASH_ANYONECANPAY)),
+        fHashSingle((nHashTypeIn & 0x1f) == SIGHASH_SINGLE),
+        fHashNone((nHashTypeIn & 0x1f) == SIGHASH_NONE) {}
+
+    // Same result as CScript::FindAndDelete(CScript(OP_CODESEPARATOR)),
+    // which stops deleting at the first op it can't parse
+    template<typename S>
+    void SerializeScriptCode(S &s) const
     {
-        printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
-        return 1;
+        CScript::const_iterator pc = scriptCode.begin();
+        opcodetype opcode;
+        unsigned int nCodeSeparators = 0;
+        while (scriptCode.GetOp(pc, opcode))
+            if (opcode == OP_CODESEPARATOR)
+                nCodeSeparators++;
+        WriteCompactSize(s, scriptCode.size() - nCodeSeparators);
+
+        CScript::const_iterator pbegin = scriptCode.begin();
+        pc = pbegin;
+        while (scriptCode.GetOp(pc, opcode))
+        {
+            if (opcode == OP_CODESEPARATOR)
+            {
+                if (pc - 1 > pbegin)
+                    s.write((const char*)&pbegin[0], pc - 1 - pbegin);
+                pbegin = pc;
+            }
+        }
+        if (pbegin != scriptCode.end())
+            s.write((const char*)&pbegin[0], scriptCode.end() - pbegin);
     }
-    CTransaction txTmp(txTo);
 
-    // In case concatenating two scripts ends up with two codeseparators,
-    // or an extra one at the end, this prevents all those possible incompatibilities.
-    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+    template<typename S>
+    void SerializeInput(S &s, unsigned int nInput, int nType, int nVersion) const
+    {
+        // With ANYONECANPAY only the input being signed is there
+        if (fAnyoneCanPay)
+            nInput = nIn;
+        const CTxIn& txin = txTo.vin[nInput];
+        ::Serialize(s, txin.prevout, nType, nVersion);
+        if (nInput != nIn)
+            WriteCompactSize(s, 0);
+        else
+            SerializeScriptCode(s);
+        // Let the others update at will
+        if (nInput != nIn && (fHashSingle || fHashNone))
+            ::Serialize(s, (unsigned int)0, nType, nVersion);
+        else
+            ::Serialize(s, txin.nSequence, nType, nVersion);
+    }
 
-    // Blank out other inputs' signatures
-    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
+    template<typename S>
+    void SerializeOutput(S &s, unsigned int nOutput, int nType, int nVersion) const
+    {
+        // SIGHASH_SINGLE only locks in the output at the input's index
+        if (fHashSingle && nOutput != nIn)
+            ::Serialize(s, CTxOut(), nType, nVersion);
+        else
+            ::Serialize(s, txTo.vout[nOutput], nType, nVersion);
+    }
 
-    // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    template<typename S>
+    void Serialize(S &s, int nType, int nVersion) const
     {
-        // Wildcard payee
-        txTmp.vout.clear();
+        ::Serialize(s, txTo.nVersion, nType, nVersion);
+        ::Serialize(s, txTo.nTime, nType, nVersion);
+        unsigned int nInputs = fAnyoneCanPay ? 1 : txTo.vin.size();
+        WriteCompactSize(s, nInputs);
+        for (unsigned int nInput = 0; nInput < nInputs; nInput++)
+            SerializeInput(s, nInput, nType, nVersion);
+        unsigned int nOutputs = fHashNone ? 0 : (fHashSingle ? nIn+1 : txTo.vout.size());
+        WriteCompactSize(s, nOutputs);
+        for (unsigned int nOutput = 0; nOutput < nOutputs; nOutput++)
+            SerializeOutput(s, nOutput, nType, nVersion);
+        ::Serialize(s, txTo.nLockTime, nType, nVersion);
+    }
+};
 
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    if (nIn >= txTo.vin.size())
+    {
+        printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
+        return 1;
     }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+
+    // Check for invalid use of SIGHASH_SINGLE
+    if ((nHashType & 0x1f) == SIGHASH_SINGLE)
     {
-        // Only lock-in the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
+        if (nIn >= txTo.vout.size())
         {
-            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
+            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
             return 1;
         }
-        txTmp.vout.resize(nOut+1);
-        for (unsigned int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
-
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
-    }
-
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
-    {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
     }
 
     // Serialize and hash
-    CDataStream ss(SER_GETHASH, 0);
-    ss.reserve(10000);
+    CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
+    CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
-    return Hash(ss.begin(), ss.end());
+    return ss.GetHash();
 }
 
 
@@ -1200,62 +1275,101 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
 
-class CSignatureCache
+//
+// Entries are salted SHA256 digests of (signature hash, signature, public
+// key) in a fixed table of 8-way buckets, sized by -sigcachesize in
+// megabytes. Lookups take no lock: each bucket carries a sequence number
+// that a writer holds odd while it changes the bucket, and a reader that
+// sees it odd or moved treats the lookup as a miss. Inserts are rare (only
+// after a successful verify) and serialised by cs_sigcache.
+CSignatureCache::CSignatureCache(int64_t nBytes)
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
-
-public:
-    bool
-    Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    // The salt keeps attackers from aiming signatures at one bucket
+    salt = GetRandHash();
+    nInserts = 0;
+    vBuckets.resize(std::max((int64_t)0, nBytes) / sizeof(CBucket));
+    BOOST_FOREACH(CBucket& bucket, vBuckets)
     {
-        LOCK(cs_sigcache);
+        bucket.nSequence = 0;
+        for (int i = 0; i < WAYS; i++)
+            bucket.vEntry[i] = 0;
+    }
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+uint256 CSignatureCache::GetEntry(const uint256& hash, const unsigned char* pchSig, unsigned int nSigSize, const unsigned char* pchPubKey, unsigned int nPubKeySize) const
+{
+    // The signature length goes in too, so that moving bytes between
+    // signature and public key can't produce a cached entry
+    uint256 entry;
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, (const unsigned char*)&salt, sizeof(salt));
+    SHA256_Update(&ctx, (const unsigned char*)&hash, sizeof(hash));
+    SHA256_Update(&ctx, (const unsigned char*)&nSigSize, sizeof(nSigSize));
+    SHA256_Update(&ctx, pchSig, nSigSize);
+    SHA256_Update(&ctx, pchPubKey, nPubKeySize);
+    SHA256_Final((unsigned char*)&entry, &ctx);
+    return entry;
+}
+
+bool CSignatureCache::Get(const uint256& entry) const
+{
+    if (vBuckets.empty())
         return false;
-    }
+    const CBucket& bucket = vBuckets[entry.Get64(0) % vBuckets.size()];
 
-    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+    unsigned int nSequence = bucket.nSequence;
+    if (nSequence & 1)
+        return false;
+    __sync_synchronize();
+    bool fFound = false;
+    for (int i = 0; i < WAYS && !fFound; i++)
+        fFound = (bucket.vEntry[i] == entry);
+    __sync_synchronize();
+    return fFound && bucket.nSequence == nSequence;
+}
 
-        LOCK(cs_sigcache);
+void CSignatureCache::Set(const uint256& entry)
+{
+    if (vBuckets.empty())
+        return;
+    CBucket& bucket = vBuckets[entry.Get64(0) % vBuckets.size()];
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
+    LOCK(cs_sigcache);
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    // Take a free way, else evict one. The choice depends on the salted
+    // digest, which foils would-be DoS attackers who might try to
+    // pre-generate and re-use signatures that push each other out.
+    int nWay = -1;
+    for (int i = 0; i < WAYS; i++)
+    {
+        if (bucket.vEntry[i] == entry)
+            return;
+        if (nWay < 0 && bucket.vEntry[i] == 0)
+            nWay = i;
     }
-};
+    if (nWay < 0)
+        nWay = (entry.Get64(1) + nInserts++) % WAYS;
+
+    bucket.nSequence++;
+    __sync_synchronize();
+    bucket.vEntry[nWay] = entry;
+    __sync_synchronize();
+    bucket.nSequence++;
+}
+
+static CSignatureCache* psignatureCache = new CSignatureCache(DEFAULT_SIGCACHE_SIZE * 1048576);
+
+void InitSignatureCache(int64_t nMegabytes)
+{
+    delete psignatureCache;
+    psignatureCache = new CSignatureCache(nMegabytes * 1048576);
+}
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
+bool CheckSig(const valtype& vchSig, const valtype& vchPubKey, const CScript& scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = *psignatureCache;
 
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
@@ -1264,21 +1378,20 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         nHashType = vchSig.back();
     else if (nHashType != vchSig.back())
         return false;
-    vchSig.pop_back();
+    const unsigned char* pchSig = &vchSig[0];
+    size_t nSigSize = vchSig.size() - 1;
+    const unsigned char* pchPubKey = vchPubKey.empty() ? NULL : &vchPubKey[0];
 
     uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
 
-    if (signatureCache.Get(sighash, vchSig, vchPubKey))
+    uint256 entry = signatureCache.GetEntry(sighash, pchSig, nSigSize, pchPubKey, vchPubKey.size());
+    if (signatureCache.Get(entry))
         return true;
 
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
-
-    if (!key.Verify(sighash, vchSig))
+    if (!CKey::VerifyPubKey(pchPubKey, vchPubKey.size(), sighash, pchSig, nSigSize))
         return false;
 
-    signatureCache.Set(sighash, vchSig, vchPubKey);
+    signatureCache.Set(entry);
     return true;
 }
 
@@ -1687,7 +1800,9 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
     if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
         return false;
 
-    stackCopy = stack;
+    // Only spend-to-script-hash needs the scriptSig results again
+    if (scriptPubKey.IsPayToScriptHash())
+        stackCopy = stack;
 
     if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
         return false;
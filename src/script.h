@@ -605,6 +605,41 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
                   int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType);
 
+/** Default for -sigcachesize, in megabytes */
+static const int64_t DEFAULT_SIGCACHE_SIZE = 4;
+
+/** Set-associative cache of verified signatures, see script.cpp */
+class CSignatureCache
+{
+public:
+    enum { WAYS = 8 };
+
+private:
+    struct CBucket
+    {
+        volatile unsigned int nSequence;
+        uint256 vEntry[WAYS];
+    };
+
+    uint256 salt;
+    std::vector<CBucket> vBuckets;
+    unsigned int nInserts;
+    CCriticalSection cs_sigcache;
+
+public:
+    CSignatureCache(int64_t nBytes);
+
+    uint256 GetEntry(const uint256& hash, const unsigned char* pchSig, unsigned int nSigSize, const unsigned char* pchPubKey, unsigned int nPubKeySize) const;
+    bool Get(const uint256& entry) const;
+    void Set(const uint256& entry);
+
+    static unsigned int BucketSize() { return sizeof(CBucket); }
+};
+
+/** Replace the cache CheckSig uses with one of nMegabytes (0 disables it).
+ *  Not safe while signatures are being checked. */
+void InitSignatureCache(int64_t nMegabytes);
+
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
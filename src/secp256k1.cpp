@@ -0,0 +1,1164 @@
+// Copyright (c) 2014 The XDECoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "secp256k1.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+
+//
+// Field elements (mod p) and scalars (mod the group order n) are four 64
+// bit limbs, least significant first, always fully reduced. Both moduli are
+// 2^256 - c for a small c, which is what the reductions lean on.
+//
+// Points are affine or Jacobian (x = X/Z^2, y = Y/Z^3). Verification is
+// variable time: u1*G + u2*P in one pass of doublings (Shamir's trick),
+// with u2*P split through the curve's endomorphism into two half-length
+// multiples of P and lambda*P, and u1*G split into halves against
+// precomputed odd-multiple tables of G and 2^128*G.
+//
+// Signing computes k*G as the sum of one entry per 4 bit digit of k from a
+// precomputed comb table. Every entry of each row is read and every step
+// does the same arithmetic whatever the digits are.
+//
+
+namespace
+{
+
+typedef uint64_t limb_t;
+
+struct CFe
+{
+    limb_t n[4];
+};
+
+struct CSc
+{
+    limb_t n[4];
+};
+
+struct CGe
+{
+    CFe x, y;
+    bool fInfinity;
+};
+
+struct CGej
+{
+    CFe x, y, z;
+    bool fInfinity;
+};
+
+const limb_t P[4]      = {0xFFFFFFFEFFFFFC2FULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL};
+const limb_t PC[1]     = {0x00000001000003D1ULL};
+const limb_t PMINUS2[4] = {0xFFFFFFFEFFFFFC2DULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL};
+const limb_t PSQRT[4]  = {0xFFFFFFFFBFFFFF0CULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0x3FFFFFFFFFFFFFFFULL};
+const limb_t N[4]      = {0xBFD25E8CD0364141ULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL};
+const limb_t NC[3]     = {0x402DA1732FC9BEBFULL, 0x4551231950B75FC4ULL, 0x0000000000000001ULL};
+const limb_t NMINUS2[4] = {0xBFD25E8CD036413FULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL};
+const limb_t HALFN[4]  = {0xDFE92F46681B20A0ULL, 0x5D576E7357A4501DULL, 0xFFFFFFFFFFFFFFFFULL, 0x7FFFFFFFFFFFFFFFULL};
+
+// Cube roots of unity: lambda*(x, y) = (beta*x, y)
+const CFe BETA      = {{0xC1396C28719501EEULL, 0x9CF0497512F58995ULL, 0x6E64479EAC3434E9ULL, 0x7AE96A2B657C0710ULL}};
+const CSc LAMBDA    = {{0xDF02967C1B23BD72ULL, 0x122E22EA20816678ULL, 0xA5261C028812645AULL, 0x5363AD4CC05C30E0ULL}};
+
+// Reduced basis of the lattice of (a, b) with a + b*lambda = 0 mod n, as
+// -b1, -b2, and round(2^384 * b2 / n), round(2^384 * -b1 / n)
+const CSc MINUS_B1  = {{0x6F547FA90ABFE4C3ULL, 0xE4437ED6010E8828ULL, 0x0000000000000000ULL, 0x0000000000000000ULL}};
+const CSc MINUS_B2  = {{0xD765CDA83DB1562CULL, 0x8A280AC50774346DULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL}};
+const limb_t G1[4]  = {0xE893209A45DBB031ULL, 0x3DAA8A1471E8CA7FULL, 0xE86C90E49284EB15ULL, 0x3086D221A7D46BCDULL};
+const limb_t G2[4]  = {0x1571B4AE8AC47F71ULL, 0x221208AC9DF506C6ULL, 0x6F547FA90ABFE4C4ULL, 0xE4437ED6010E8828ULL};
+
+const CFe GX        = {{0x59F2815B16F81798ULL, 0x029BFCDB2DCE28D9ULL, 0x55A06295CE870B07ULL, 0x79BE667EF9DCBBACULL}};
+const CFe GY        = {{0x9C47D08FFB10D4B8ULL, 0xFD17B448A6855419ULL, 0x5DA4FBFC0E1108A8ULL, 0x483ADA7726A3C465ULL}};
+
+// Odd multiples up to (2^(w-1) - 1) of P per wNAF digit window
+const int WINDOW_A = 5;
+const int WINDOW_G = 12;
+const int TABLE_A = 1 << (WINDOW_A - 2);
+const int TABLE_G = 1 << (WINDOW_G - 2);
+
+// Digits of a wNAF of a number below 2^129
+const int WNAF_BITS = 130;
+
+
+//
+// Multi-precision helpers
+//
+
+inline limb_t Mul64(limb_t a, limb_t b, limb_t& hi)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 r = (unsigned __int128)a * b;
+    hi = (limb_t)(r >> 64);
+    return (limb_t)r;
+#else
+    limb_t a0 = (uint32_t)a, a1 = a >> 32, b0 = (uint32_t)b, b1 = b >> 32;
+    limb_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    limb_t mid = (p00 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+    hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+    return (mid << 32) | (uint32_t)p00;
+#endif
+}
+
+// r[0..nr) += a[0..na) * b[0..nb), which the caller makes sure fits
+void MulAdd(limb_t* r, int nr, const limb_t* a, int na, const limb_t* b, int nb)
+{
+    for (int i = 0; i < na; i++)
+    {
+        limb_t carry = 0;
+        for (int j = 0; j < nb; j++)
+        {
+            limb_t hi;
+            limb_t lo = Mul64(a[i], b[j], hi);
+            lo += r[i+j];
+            hi += (lo < r[i+j]);
+            lo += carry;
+            hi += (lo < carry);
+            r[i+j] = lo;
+            carry = hi;
+        }
+        for (int k = i + nb; k < nr; k++)
+        {
+            r[k] += carry;
+            carry = (r[k] < carry);
+        }
+    }
+}
+
+// Column-wise product accumulation into the three limbs (c0, c1, c2)
+#define MULACC(x, y) \
+    { \
+        limb_t hi, lo = Mul64(x, y, hi); \
+        c0 += lo; hi += (c0 < lo); \
+        c1 += hi; c2 += (c1 < hi); \
+    }
+#define MULACC2(x, y) \
+    { \
+        limb_t hi, lo = Mul64(x, y, hi); \
+        limb_t top = hi >> 63; \
+        hi = (hi << 1) | (lo >> 63); \
+        lo <<= 1; \
+        c0 += lo; \
+        limb_t carry = (c0 < lo); \
+        c1 += hi; c2 += (c1 < hi) + top; \
+        c1 += carry; c2 += (c1 < carry); \
+    }
+#define EXTRACT(out) \
+    { \
+        out = c0; c0 = c1; c1 = c2; c2 = 0; \
+    }
+
+// l[0..8) = x * y
+void Mul4x4(limb_t* l, const limb_t* x, const limb_t* y)
+{
+    limb_t c0 = 0, c1 = 0, c2 = 0;
+    MULACC(x[0], y[0]); EXTRACT(l[0]);
+    MULACC(x[0], y[1]); MULACC(x[1], y[0]); EXTRACT(l[1]);
+    MULACC(x[0], y[2]); MULACC(x[1], y[1]); MULACC(x[2], y[0]); EXTRACT(l[2]);
+    MULACC(x[0], y[3]); MULACC(x[1], y[2]); MULACC(x[2], y[1]); MULACC(x[3], y[0]); EXTRACT(l[3]);
+    MULACC(x[1], y[3]); MULACC(x[2], y[2]); MULACC(x[3], y[1]); EXTRACT(l[4]);
+    MULACC(x[2], y[3]); MULACC(x[3], y[2]); EXTRACT(l[5]);
+    MULACC(x[3], y[3]); EXTRACT(l[6]);
+    l[7] = c0;
+}
+
+// l[0..8) = x * x
+void Sqr4x4(limb_t* l, const limb_t* x)
+{
+    limb_t c0 = 0, c1 = 0, c2 = 0;
+    MULACC(x[0], x[0]); EXTRACT(l[0]);
+    MULACC2(x[0], x[1]); EXTRACT(l[1]);
+    MULACC2(x[0], x[2]); MULACC(x[1], x[1]); EXTRACT(l[2]);
+    MULACC2(x[0], x[3]); MULACC2(x[1], x[2]); EXTRACT(l[3]);
+    MULACC2(x[1], x[3]); MULACC(x[2], x[2]); EXTRACT(l[4]);
+    MULACC2(x[2], x[3]); EXTRACT(l[5]);
+    MULACC(x[3], x[3]); EXTRACT(l[6]);
+    l[7] = c0;
+}
+
+inline limb_t Add4(limb_t* r, const limb_t* a, const limb_t* b)
+{
+    limb_t carry = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        limb_t s = a[i] + b[i];
+        limb_t c = (s < b[i]);
+        s += carry;
+        c |= (s < carry);
+        r[i] = s;
+        carry = c;
+    }
+    return carry;
+}
+
+inline limb_t Sub4(limb_t* r, const limb_t* a, const limb_t* b)
+{
+    limb_t borrow = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        limb_t d = a[i] - b[i];
+        limb_t c = (a[i] < b[i]);
+        c |= (d < borrow);
+        r[i] = d - borrow;
+        borrow = c;
+    }
+    return borrow;
+}
+
+// Bring carry*2^256 + r, known to be below 2m, under m = 2^256 - c
+inline void FinalReduce(limb_t* r, limb_t carry, const limb_t* c, int nc)
+{
+    limb_t cc[4] = {0, 0, 0, 0};
+    for (int i = 0; i < nc; i++)
+        cc[i] = c[i];
+    limb_t t[4];
+    limb_t mask = 0 - (carry | Add4(t, r, cc));
+    for (int i = 0; i < 4; i++)
+        r[i] = (t[i] & mask) | (r[i] & ~mask);
+}
+
+inline bool IsZero4(const limb_t* a)
+{
+    return (a[0] | a[1] | a[2] | a[3]) == 0;
+}
+
+int Compare4(const limb_t* a, const limb_t* b)
+{
+    for (int i = 3; i >= 0; i--)
+    {
+        if (a[i] < b[i])
+            return -1;
+        if (a[i] > b[i])
+            return 1;
+    }
+    return 0;
+}
+
+void SetB32(limb_t* r, const unsigned char* p)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        limb_t v = 0;
+        for (int j = 0; j < 8; j++)
+            v = (v << 8) | p[(3 - i) * 8 + j];
+        r[i] = v;
+    }
+}
+
+void GetB32(unsigned char* p, const limb_t* a)
+{
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 8; j++)
+            p[(3 - i) * 8 + j] = (unsigned char)(a[i] >> (56 - 8 * j));
+}
+
+void Cleanse(void* p, size_t n)
+{
+    volatile unsigned char* pv = (volatile unsigned char*)p;
+    while (n--)
+        *pv++ = 0;
+}
+
+
+//
+// Field arithmetic mod p
+//
+
+inline void FeSetInt(CFe& r, limb_t v)
+{
+    r.n[0] = v;
+    r.n[1] = r.n[2] = r.n[3] = 0;
+}
+
+inline bool FeIsZero(const CFe& a)
+{
+    return IsZero4(a.n);
+}
+
+inline bool FeEqual(const CFe& a, const CFe& b)
+{
+    return ((a.n[0] ^ b.n[0]) | (a.n[1] ^ b.n[1]) | (a.n[2] ^ b.n[2]) | (a.n[3] ^ b.n[3])) == 0;
+}
+
+// Subtract p once if r is at least p
+inline void FeNormalize(limb_t* r)
+{
+    limb_t t0 = r[0] + PC[0];
+    limb_t c = (t0 < PC[0]);
+    limb_t t1 = r[1] + c;
+    c = (t1 < c);
+    limb_t t2 = r[2] + c;
+    c = (t2 < c);
+    limb_t t3 = r[3] + c;
+    c = (t3 < c);
+    limb_t mask = 0 - c;
+    r[0] = (t0 & mask) | (r[0] & ~mask);
+    r[1] = (t1 & mask) | (r[1] & ~mask);
+    r[2] = (t2 & mask) | (r[2] & ~mask);
+    r[3] = (t3 & mask) | (r[3] & ~mask);
+}
+
+inline void FeAdd(CFe& r, const CFe& a, const CFe& b)
+{
+    // Over 2^256, subtracting p is adding 2^256 - p, which can't carry again
+    limb_t carry = Add4(r.n, a.n, b.n);
+    limb_t fold[4] = {PC[0] & (0 - carry), 0, 0, 0};
+    Add4(r.n, r.n, fold);
+    FeNormalize(r.n);
+}
+
+inline void FeSub(CFe& r, const CFe& a, const CFe& b)
+{
+    // On a borrow, adding p is subtracting 2^256 - p
+    limb_t mask = 0 - Sub4(r.n, a.n, b.n);
+    limb_t c[4] = {PC[0] & mask, 0, 0, 0};
+    Sub4(r.n, r.n, c);
+}
+
+void FeNeg(CFe& r, const CFe& a)
+{
+    CFe zero;
+    FeSetInt(zero, 0);
+    FeSub(r, zero, a);
+}
+
+// 2^256 = 2^256 - p (mod p), folded in until the value fits
+void FeReduce512(CFe& r, const limb_t* l)
+{
+    limb_t t[5];
+    limb_t c0 = 0, c1 = 0, c2 = 0;
+    c0 = l[0]; MULACC(l[4], PC[0]); EXTRACT(t[0]);
+    c0 += l[1]; c1 += (c0 < l[1]); MULACC(l[5], PC[0]); EXTRACT(t[1]);
+    c0 += l[2]; c1 += (c0 < l[2]); MULACC(l[6], PC[0]); EXTRACT(t[2]);
+    c0 += l[3]; c1 += (c0 < l[3]); MULACC(l[7], PC[0]); EXTRACT(t[3]);
+    t[4] = c0;
+
+    // t[4] < 2^34, so this leaves at most one more 2^256 to fold, and
+    // after that the value is tiny
+    limb_t hi, lo = Mul64(t[4], PC[0], hi);
+    r.n[0] = t[0] + lo;
+    limb_t c = (r.n[0] < lo);
+    r.n[1] = t[1] + c;
+    c = (r.n[1] < c);
+    r.n[1] += hi;
+    c += (r.n[1] < hi);
+    r.n[2] = t[2] + c;
+    c = (r.n[2] < c);
+    r.n[3] = t[3] + c;
+    c = (r.n[3] < c);
+    r.n[0] += PC[0] & (0 - c);
+    r.n[1] += (r.n[0] < (PC[0] & (0 - c)));
+    FeNormalize(r.n);
+}
+
+void FeMul(CFe& r, const CFe& a, const CFe& b)
+{
+    limb_t l[8];
+    Mul4x4(l, a.n, b.n);
+    FeReduce512(r, l);
+}
+
+void FeSqr(CFe& r, const CFe& a)
+{
+    limb_t l[8];
+    Sqr4x4(l, a.n);
+    FeReduce512(r, l);
+}
+
+// a^e for a public exponent e, four bits at a time
+void FePow(CFe& r, const CFe& a, const limb_t* e)
+{
+    CFe table[16];
+    FeSetInt(table[0], 1);
+    for (int i = 1; i < 16; i++)
+        FeMul(table[i], table[i-1], a);
+    CFe x;
+    FeSetInt(x, 1);
+    for (int i = 63; i >= 0; i--)
+    {
+        for (int j = 0; j < 4; j++)
+            FeSqr(x, x);
+        FeMul(x, x, table[(e[i / 16] >> (4 * (i % 16))) & 15]);
+    }
+    r = x;
+}
+
+void FeInv(CFe& r, const CFe& a)
+{
+    FePow(r, a, PMINUS2);
+}
+
+// Square root if there is one; p = 3 mod 4
+bool FeSqrt(CFe& r, const CFe& a)
+{
+    CFe x, x2;
+    FePow(x, a, PSQRT);
+    FeSqr(x2, x);
+    if (!FeEqual(x2, a))
+        return false;
+    r = x;
+    return true;
+}
+
+inline void FeCMov(CFe& r, const CFe& a, limb_t mask)
+{
+    for (int i = 0; i < 4; i++)
+        r.n[i] = (a.n[i] & mask) | (r.n[i] & ~mask);
+}
+
+
+//
+// Scalar arithmetic mod n
+//
+
+// Returns false if the value isn't below n
+bool ScSetB32(CSc& r, const unsigned char* p)
+{
+    SetB32(r.n, p);
+    limb_t t[4];
+    limb_t cc[4] = {NC[0], NC[1], NC[2], 0};
+    return !Add4(t, r.n, cc);
+}
+
+bool ScIsZero(const CSc& a)
+{
+    return IsZero4(a.n);
+}
+
+void ScAdd(CSc& r, const CSc& a, const CSc& b)
+{
+    limb_t carry = Add4(r.n, a.n, b.n);
+    FinalReduce(r.n, carry, NC, 3);
+}
+
+void ScNeg(CSc& r, const CSc& a)
+{
+    limb_t mask = 0 - (limb_t)!IsZero4(a.n);
+    Sub4(r.n, N, a.n);
+    for (int i = 0; i < 4; i++)
+        r.n[i] &= mask;
+}
+
+// The same fixed number of folds whatever the value, for signing
+void ScReduce512(CSc& r, const limb_t* l)
+{
+    limb_t m[7] = {l[0], l[1], l[2], l[3], 0, 0, 0};
+    MulAdd(m, 7, l + 4, 4, NC, 3);
+    limb_t q[5] = {m[0], m[1], m[2], m[3], 0};
+    MulAdd(q, 5, m + 4, 3, NC, 3);
+    limb_t s[5] = {q[0], q[1], q[2], q[3], 0};
+    MulAdd(s, 5, q + 4, 1, NC, 3);
+    limb_t t[5] = {s[0], s[1], s[2], s[3], 0};
+    MulAdd(t, 5, s + 4, 1, NC, 3);
+    FinalReduce(t, 0, NC, 3);
+    memcpy(r.n, t, sizeof(r.n));
+}
+
+void ScMul(CSc& r, const CSc& a, const CSc& b)
+{
+    limb_t l[8];
+    Mul4x4(l, a.n, b.n);
+    ScReduce512(r, l);
+}
+
+void ScSqr(CSc& r, const CSc& a)
+{
+    limb_t l[8];
+    Sqr4x4(l, a.n);
+    ScReduce512(r, l);
+}
+
+void ScInv(CSc& r, const CSc& a)
+{
+    CSc table[16];
+    memset(&table[0], 0, sizeof(table[0]));
+    table[0].n[0] = 1;
+    for (int i = 1; i < 16; i++)
+        ScMul(table[i], table[i-1], a);
+    CSc x = table[0];
+    for (int i = 63; i >= 0; i--)
+    {
+        for (int j = 0; j < 4; j++)
+            ScSqr(x, x);
+        ScMul(x, x, table[(NMINUS2[i / 16] >> (4 * (i % 16))) & 15]);
+    }
+    r = x;
+    Cleanse(table, sizeof(table));
+}
+
+bool ScIsHigh(const CSc& a)
+{
+    return Compare4(a.n, HALFN) > 0;
+}
+
+// round(k * g / 2^384)
+void ScMulShift384(CSc& r, const CSc& k, const limb_t* g)
+{
+    limb_t l[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    MulAdd(l, 8, k.n, 4, g, 4);
+    limb_t round[4] = {l[5] >> 63, 0, 0, 0};
+    limb_t hi[4] = {l[6], l[7], 0, 0};
+    Add4(r.n, hi, round);
+}
+
+// k = r1 + r2*lambda (mod n) with r1, r2 under 2^128 in absolute value
+void ScSplitLambda(CSc& r1, CSc& r2, const CSc& k)
+{
+    CSc c1, c2;
+    ScMulShift384(c1, k, G1);
+    ScMulShift384(c2, k, G2);
+    ScMul(c1, c1, MINUS_B1);
+    ScMul(c2, c2, MINUS_B2);
+    ScAdd(r2, c1, c2);
+    ScMul(r1, r2, LAMBDA);
+    ScNeg(r1, r1);
+    ScAdd(r1, r1, k);
+}
+
+
+//
+// Group arithmetic
+//
+
+void GejSetGe(CGej& r, const CGe& a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    FeSetInt(r.z, 1);
+    r.fInfinity = a.fInfinity;
+}
+
+void GeSetGej(CGe& r, const CGej& a)
+{
+    if (a.fInfinity)
+    {
+        r.fInfinity = true;
+        return;
+    }
+    CFe zi, zi2, zi3;
+    FeInv(zi, a.z);
+    FeSqr(zi2, zi);
+    FeMul(zi3, zi2, zi);
+    FeMul(r.x, a.x, zi2);
+    FeMul(r.y, a.y, zi3);
+    r.fInfinity = false;
+}
+
+bool GeIsValid(const CGe& a)
+{
+    // y^2 = x^3 + 7
+    CFe y2, x3, seven;
+    FeSqr(y2, a.y);
+    FeSqr(x3, a.x);
+    FeMul(x3, x3, a.x);
+    FeSetInt(seven, 7);
+    FeAdd(x3, x3, seven);
+    return FeEqual(y2, x3);
+}
+
+void GejNeg(CGej& r, const CGej& a)
+{
+    r = a;
+    FeNeg(r.y, a.y);
+}
+
+void GeNeg(CGe& r, const CGe& a)
+{
+    r = a;
+    FeNeg(r.y, a.y);
+}
+
+// dbl-2009-l; secp256k1 has no points of order two
+void GejDouble(CGej& r, const CGej& a)
+{
+    if (a.fInfinity)
+    {
+        r.fInfinity = true;
+        return;
+    }
+    CFe A, B, C, D, E, F, t, z3;
+    FeSqr(A, a.x);
+    FeSqr(B, a.y);
+    FeSqr(C, B);
+    FeAdd(t, a.x, B);
+    FeSqr(t, t);
+    FeSub(t, t, A);
+    FeSub(t, t, C);
+    FeAdd(D, t, t);
+    FeAdd(E, A, A);
+    FeAdd(E, E, A);
+    FeSqr(F, E);
+    FeMul(z3, a.y, a.z);
+    FeAdd(r.z, z3, z3);
+    FeSub(r.x, F, D);
+    FeSub(r.x, r.x, D);
+    FeSub(t, D, r.x);
+    FeMul(t, E, t);
+    FeAdd(C, C, C);
+    FeAdd(C, C, C);
+    FeAdd(C, C, C);
+    FeSub(r.y, t, C);
+    r.fInfinity = false;
+}
+
+// Shared tail of the additions: H = U2 - U1, R = S2 - S1
+void GejAddTail(CGej& r, const CFe& U1, const CFe& S1, const CFe& H, const CFe& R, const CFe& z)
+{
+    CFe HH, HHH, V, t;
+    FeSqr(HH, H);
+    FeMul(HHH, H, HH);
+    FeMul(V, U1, HH);
+    FeMul(r.z, z, H);
+    FeSqr(t, R);
+    FeSub(t, t, HHH);
+    FeSub(t, t, V);
+    FeSub(r.x, t, V);
+    FeSub(t, V, r.x);
+    FeMul(t, R, t);
+    FeMul(V, S1, HHH);
+    FeSub(r.y, t, V);
+}
+
+void GejAdd(CGej& r, const CGej& a, const CGej& b)
+{
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    CFe z1z1, z2z2, U1, U2, S1, S2, H, R, z;
+    FeSqr(z1z1, a.z);
+    FeSqr(z2z2, b.z);
+    FeMul(U1, a.x, z2z2);
+    FeMul(U2, b.x, z1z1);
+    FeMul(S1, a.y, z2z2);
+    FeMul(S1, S1, b.z);
+    FeMul(S2, b.y, z1z1);
+    FeMul(S2, S2, a.z);
+    FeSub(H, U2, U1);
+    FeSub(R, S2, S1);
+    if (FeIsZero(H))
+    {
+        if (FeIsZero(R))
+            GejDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    FeMul(z, a.z, b.z);
+    GejAddTail(r, U1, S1, H, R, z);
+    r.fInfinity = false;
+}
+
+void GejAddGe(CGej& r, const CGej& a, const CGe& b)
+{
+    if (a.fInfinity)
+    {
+        GejSetGe(r, b);
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    CFe z1z1, U2, S2, H, R;
+    FeSqr(z1z1, a.z);
+    FeMul(U2, b.x, z1z1);
+    FeMul(S2, b.y, z1z1);
+    FeMul(S2, S2, a.z);
+    FeSub(H, U2, a.x);
+    FeSub(R, S2, a.y);
+    if (FeIsZero(H))
+    {
+        if (FeIsZero(R))
+            GejDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    CFe z = a.z;
+    CFe U1 = a.x, S1 = a.y;
+    GejAddTail(r, U1, S1, H, R, z);
+    r.fInfinity = false;
+}
+
+// The same formula with no special cases, for signing, where the caller
+// knows a and b are distinct points and neither is the point at infinity
+void GejAddGeConst(CGej& r, const CGej& a, const CGe& b)
+{
+    CFe z1z1, U2, S2, H, R;
+    FeSqr(z1z1, a.z);
+    FeMul(U2, b.x, z1z1);
+    FeMul(S2, b.y, z1z1);
+    FeMul(S2, S2, a.z);
+    FeSub(H, U2, a.x);
+    FeSub(R, S2, a.y);
+    CFe z = a.z;
+    CFe U1 = a.x, S1 = a.y;
+    GejAddTail(r, U1, S1, H, R, z);
+}
+
+// Affine forms of a set of Jacobian points with one inversion
+void GeSetAllGej(CGe* r, const CGej* a, int n)
+{
+    CFe* pprod = new CFe[n];
+    CFe acc;
+    FeSetInt(acc, 1);
+    for (int i = 0; i < n; i++)
+    {
+        pprod[i] = acc;
+        FeMul(acc, acc, a[i].z);
+    }
+    CFe inv;
+    FeInv(inv, acc);
+    for (int i = n - 1; i >= 0; i--)
+    {
+        CFe zi, zi2, zi3;
+        FeMul(zi, inv, pprod[i]);
+        FeMul(inv, inv, a[i].z);
+        FeSqr(zi2, zi);
+        FeMul(zi3, zi2, zi);
+        FeMul(r[i].x, a[i].x, zi2);
+        FeMul(r[i].y, a[i].y, zi3);
+        r[i].fInfinity = false;
+    }
+    delete[] pprod;
+}
+
+
+//
+// Precomputed tables, built on first use
+//
+
+class CContext
+{
+public:
+    // Odd multiples of G and 2^128*G for verification
+    CGe vG[TABLE_G];
+    CGe vG128[TABLE_G];
+    // vComb[i][d] = d * 16^i * G; entry 0 of each row is a placeholder
+    CGe vComb[64][16];
+
+    CContext()
+    {
+        CGe g;
+        g.x = GX;
+        g.y = GY;
+        g.fInfinity = false;
+        CGej gj;
+        GejSetGe(gj, g);
+
+        CGej* pj = new CGej[64 * 16];
+        CGej base = gj;
+        for (int i = 0; i < 64; i++)
+        {
+            pj[i * 16] = base;
+            pj[i * 16 + 1] = base;
+            for (int d = 2; d < 16; d++)
+                GejAdd(pj[i * 16 + d], pj[i * 16 + d - 1], base);
+            for (int j = 0; j < 4; j++)
+                GejDouble(base, base);
+        }
+        GeSetAllGej(&vComb[0][0], pj, 64 * 16);
+        delete[] pj;
+
+        CGej g128 = gj;
+        for (int i = 0; i < 128; i++)
+            GejDouble(g128, g128);
+        BuildOddMultiples(vG, gj);
+        BuildOddMultiples(vG128, g128);
+    }
+
+private:
+    static void BuildOddMultiples(CGe* r, const CGej& a)
+    {
+        CGej* pj = new CGej[TABLE_G];
+        CGej twice;
+        GejDouble(twice, a);
+        pj[0] = a;
+        for (int i = 1; i < TABLE_G; i++)
+            GejAdd(pj[i], pj[i-1], twice);
+        GeSetAllGej(r, pj, TABLE_G);
+        delete[] pj;
+    }
+};
+
+const CContext& GetContext()
+{
+    static CContext context;
+    return context;
+}
+
+
+//
+// Multiplication
+//
+
+// Width w non-adjacent form of a number below 2^129, least significant
+// digit first; returns the number of digits used
+int WNAF(int* pnaf, const limb_t* s, int w)
+{
+    limb_t k[3] = {s[0], s[1], s[2]};
+    int nUsed = 0;
+    for (int i = 0; i < WNAF_BITS; i++)
+    {
+        pnaf[i] = 0;
+        if (k[0] & 1)
+        {
+            int d = (int)(k[0] & ((1 << w) - 1));
+            if (d >= (1 << (w - 1)))
+                d -= (1 << w);
+            // k -= d, which leaves k even
+            limb_t nAbs = (limb_t)(d < 0 ? -d : d);
+            limb_t carry;
+            if (d > 0)
+            {
+                carry = (k[0] < nAbs);
+                k[0] -= nAbs;
+                for (int j = 1; j < 3; j++)
+                {
+                    limb_t borrow = (k[j] < carry);
+                    k[j] -= carry;
+                    carry = borrow;
+                }
+            }
+            else
+            {
+                k[0] += nAbs;
+                carry = (k[0] < nAbs);
+                for (int j = 1; j < 3; j++)
+                {
+                    k[j] += carry;
+                    carry = (k[j] < carry);
+                }
+            }
+            pnaf[i] = d;
+            nUsed = i + 1;
+        }
+        k[0] = (k[0] >> 1) | (k[1] << 63);
+        k[1] = (k[1] >> 1) | (k[2] << 63);
+        k[2] >>= 1;
+    }
+    return nUsed;
+}
+
+// Split a scalar into two signed halves of the endomorphism split
+void SplitSigned(CSc& r, bool& fNeg, const CSc& a)
+{
+    fNeg = ScIsHigh(a);
+    if (fNeg)
+        ScNeg(r, a);
+    else
+        r = a;
+}
+
+// u1*G + u2*P
+void MulDouble(CGej& r, const CGe& p, const CSc& u1, const CSc& u2)
+{
+    const CContext& context = GetContext();
+
+    // Odd multiples of P and of lambda*P
+    CGej vP[TABLE_A], vLamP[TABLE_A];
+    CGej pj, twice;
+    GejSetGe(pj, p);
+    GejDouble(twice, pj);
+    vP[0] = pj;
+    for (int i = 1; i < TABLE_A; i++)
+        GejAdd(vP[i], vP[i-1], twice);
+    for (int i = 0; i < TABLE_A; i++)
+    {
+        vLamP[i] = vP[i];
+        FeMul(vLamP[i].x, vP[i].x, BETA);
+    }
+
+    CSc a1, a2;
+    bool fNeg1, fNeg2;
+    ScSplitLambda(a1, a2, u2);
+    SplitSigned(a1, fNeg1, a1);
+    SplitSigned(a2, fNeg2, a2);
+
+    limb_t lo[4] = {u1.n[0], u1.n[1], 0, 0};
+    limb_t hi[4] = {u1.n[2], u1.n[3], 0, 0};
+
+    int naf1[WNAF_BITS], naf2[WNAF_BITS], nafLo[WNAF_BITS], nafHi[WNAF_BITS];
+    int nBits = 0;
+    nBits = std::max(nBits, WNAF(naf1, a1.n, WINDOW_A));
+    nBits = std::max(nBits, WNAF(naf2, a2.n, WINDOW_A));
+    nBits = std::max(nBits, WNAF(nafLo, lo, WINDOW_G));
+    nBits = std::max(nBits, WNAF(nafHi, hi, WINDOW_G));
+
+    r.fInfinity = true;
+    for (int i = nBits - 1; i >= 0; i--)
+    {
+        GejDouble(r, r);
+        int d;
+        if ((d = naf1[i]) != 0)
+        {
+            CGej t = vP[(d < 0 ? -d : d) / 2];
+            if ((d < 0) != fNeg1)
+                GejNeg(t, t);
+            GejAdd(r, r, t);
+        }
+        if ((d = naf2[i]) != 0)
+        {
+            CGej t = vLamP[(d < 0 ? -d : d) / 2];
+            if ((d < 0) != fNeg2)
+                GejNeg(t, t);
+            GejAdd(r, r, t);
+        }
+        if ((d = nafLo[i]) != 0)
+        {
+            CGe t = context.vG[(d < 0 ? -d : d) / 2];
+            if (d < 0)
+                GeNeg(t, t);
+            GejAddGe(r, r, t);
+        }
+        if ((d = nafHi[i]) != 0)
+        {
+            CGe t = context.vG128[(d < 0 ? -d : d) / 2];
+            if (d < 0)
+                GeNeg(t, t);
+            GejAddGe(r, r, t);
+        }
+    }
+}
+
+// k*G for a secret k in [1, n), in constant time
+void MulGen(CGej& r, const CSc& k)
+{
+    const CContext& context = GetContext();
+    limb_t maskInfinity = ~(limb_t)0;
+    memset(&r, 0, sizeof(r));
+    for (int i = 0; i < 64; i++)
+    {
+        limb_t nDigit = (k.n[i / 16] >> (4 * (i % 16))) & 15;
+
+        // Read the whole row so the digit can't be told from the cache
+        CGe t;
+        memset(&t, 0, sizeof(t));
+        for (limb_t d = 0; d < 16; d++)
+        {
+            limb_t mask = 0 - (limb_t)(d == nDigit);
+            FeCMov(t.x, context.vComb[i][d].x, mask);
+            FeCMov(t.y, context.vComb[i][d].y, mask);
+        }
+
+        // The partial sum is below 16^i and t is at least 16^i times G,
+        // with their total at most k < n, so only a zero digit or an empty
+        // sum so far need special handling, done by masking
+        CGej sum, tj;
+        GejAddGeConst(sum, r, t);
+        GejSetGe(tj, t);
+        FeCMov(sum.x, tj.x, maskInfinity);
+        FeCMov(sum.y, tj.y, maskInfinity);
+        FeCMov(sum.z, tj.z, maskInfinity);
+        limb_t maskKeep = 0 - (limb_t)(nDigit == 0);
+        FeCMov(r.x, sum.x, ~maskKeep);
+        FeCMov(r.y, sum.y, ~maskKeep);
+        FeCMov(r.z, sum.z, ~maskKeep);
+        maskInfinity &= maskKeep;
+    }
+    r.fInfinity = false;
+}
+
+
+//
+// Encodings
+//
+
+bool ParsePubKey(CGe& r, const unsigned char* pch, size_t nSize)
+{
+    if (nSize == 33 && (pch[0] == 0x02 || pch[0] == 0x03))
+    {
+        SetB32(r.x.n, pch + 1);
+        if (Compare4(r.x.n, P) >= 0)
+            return false;
+        CFe x3, seven;
+        FeSqr(x3, r.x);
+        FeMul(x3, x3, r.x);
+        FeSetInt(seven, 7);
+        FeAdd(x3, x3, seven);
+        if (!FeSqrt(r.y, x3))
+            return false;
+        if ((r.y.n[0] & 1) != (pch[0] & 1))
+            FeNeg(r.y, r.y);
+        r.fInfinity = false;
+        return true;
+    }
+    if (nSize == 65 && pch[0] == 0x04)
+    {
+        SetB32(r.x.n, pch + 1);
+        SetB32(r.y.n, pch + 33);
+        if (Compare4(r.x.n, P) >= 0 || Compare4(r.y.n, P) >= 0)
+            return false;
+        r.fInfinity = false;
+        return GeIsValid(r);
+    }
+    return false;
+}
+
+// A minimal, positive DER integer in [1, n)
+bool ParseInteger(CSc& r, const unsigned char* pch, size_t nSize)
+{
+    if (pch[0] & 0x80)
+        return false;
+    if (nSize > 1 && pch[0] == 0 && !(pch[1] & 0x80))
+        return false;
+    if (pch[0] == 0)
+    {
+        pch++;
+        nSize--;
+    }
+    if (nSize > 32)
+        return false;
+    unsigned char b32[32];
+    memset(b32, 0, sizeof(b32));
+    memcpy(b32 + 32 - nSize, pch, nSize);
+    return ScSetB32(r, b32) && !ScIsZero(r);
+}
+
+bool ParseSignature(CSc& r, CSc& s, const unsigned char* pch, size_t nSize)
+{
+    if (nSize < 8 || nSize > 72)
+        return false;
+    if (pch[0] != 0x30 || pch[1] != nSize - 2 || pch[2] != 0x02)
+        return false;
+    size_t nLenR = pch[3];
+    if (nLenR == 0 || 5 + nLenR >= nSize || pch[4 + nLenR] != 0x02)
+        return false;
+    size_t nLenS = pch[5 + nLenR];
+    if (nLenS == 0 || nLenR + nLenS + 6 != nSize)
+        return false;
+    return ParseInteger(r, pch + 4, nLenR) && ParseInteger(s, pch + 6 + nLenR, nLenS);
+}
+
+void SerializeInteger(std::vector<unsigned char>& vch, const CSc& a)
+{
+    unsigned char b32[32];
+    GetB32(b32, a.n);
+    int nStart = 0;
+    while (nStart < 31 && b32[nStart] == 0)
+        nStart++;
+    bool fPad = (b32[nStart] & 0x80) != 0;
+    vch.push_back(0x02);
+    vch.push_back((unsigned char)(32 - nStart + fPad));
+    if (fPad)
+        vch.push_back(0x00);
+    vch.insert(vch.end(), b32 + nStart, b32 + 32);
+}
+
+}
+
+namespace Secp256k1
+{
+
+int Verify(const unsigned char* pchHash, const unsigned char* pchSig, size_t nSigSize,
+           const unsigned char* pchPubKey, size_t nPubKeySize)
+{
+    CGe pubkey;
+    CSc r, s;
+    if (!ParsePubKey(pubkey, pchPubKey, nPubKeySize))
+        return -1;
+    if (!ParseSignature(r, s, pchSig, nSigSize))
+        return -1;
+
+    CSc z, w, u1, u2;
+    SetB32(z.n, pchHash);
+    FinalReduce(z.n, 0, NC, 3);
+    ScInv(w, s);
+    ScMul(u1, z, w);
+    ScMul(u2, r, w);
+
+    CGej R;
+    MulDouble(R, pubkey, u1, u2);
+    if (R.fInfinity)
+        return 0;
+
+    // R.x mod n == r, checked as r*Z^2 == X without leaving Jacobian
+    // coordinates; r + n may also be a valid x below p
+    CFe zz, xr;
+    FeSqr(zz, R.z);
+    memcpy(xr.n, r.n, sizeof(xr.n));
+    FeMul(xr, xr, zz);
+    if (FeEqual(xr, R.x))
+        return 1;
+    limb_t rn[4];
+    if (Add4(rn, r.n, N) || Compare4(rn, P) >= 0)
+        return 0;
+    memcpy(xr.n, rn, sizeof(xr.n));
+    FeMul(xr, xr, zz);
+    return FeEqual(xr, R.x) ? 1 : 0;
+}
+
+bool Sign(const unsigned char* pchHash, const unsigned char* pchSecret, const unsigned char* pchNonce,
+          std::vector<unsigned char>& vchSig)
+{
+    CSc d, k, z, r, s;
+    bool fOk = ScSetB32(d, pchSecret) && !ScIsZero(d) && ScSetB32(k, pchNonce) && !ScIsZero(k);
+    if (fOk)
+    {
+        CGej R;
+        CGe Ra;
+        MulGen(R, k);
+        GeSetGej(Ra, R);
+        memcpy(r.n, Ra.x.n, sizeof(r.n));
+        FinalReduce(r.n, 0, NC, 3);
+
+        // s = (z + r*d) / k
+        SetB32(z.n, pchHash);
+        FinalReduce(z.n, 0, NC, 3);
+        ScMul(s, r, d);
+        ScAdd(s, s, z);
+        ScInv(k, k);
+        ScMul(s, s, k);
+        if (ScIsHigh(s))
+            ScNeg(s, s);
+        fOk = !ScIsZero(r) && !ScIsZero(s);
+        Cleanse(&R, sizeof(R));
+        Cleanse(&Ra, sizeof(Ra));
+    }
+    if (fOk)
+    {
+        std::vector<unsigned char> vchR, vchS;
+        SerializeInteger(vchR, r);
+        SerializeInteger(vchS, s);
+        vchSig.clear();
+        vchSig.push_back(0x30);
+        vchSig.push_back((unsigned char)(vchR.size() + vchS.size()));
+        vchSig.insert(vchSig.end(), vchR.begin(), vchR.end());
+        vchSig.insert(vchSig.end(), vchS.begin(), vchS.end());
+    }
+    Cleanse(&d, sizeof(d));
+    Cleanse(&k, sizeof(k));
+    return fOk;
+}
+
+bool GetPubKey(const unsigned char* pchSecret, bool fCompressed, std::vector<unsigned char>& vchPubKey)
+{
+    CSc d;
+    if (!ScSetB32(d, pchSecret) || ScIsZero(d))
+        return false;
+    CGej P;
+    CGe Pa;
+    MulGen(P, d);
+    Cleanse(&d, sizeof(d));
+    GeSetGej(Pa, P);
+
+    vchPubKey.resize(fCompressed ? 33 : 65);
+    vchPubKey[0] = fCompressed ? (0x02 | (Pa.y.n[0] & 1)) : 0x04;
+    GetB32(&vchPubKey[1], Pa.x.n);
+    if (!fCompressed)
+        GetB32(&vchPubKey[33], Pa.y.n);
+    return true;
+}
+
+}
@@ -0,0 +1,33 @@
+// Copyright (c) 2014 The XDECoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SECP256K1_H
+#define BITCOIN_SECP256K1_H
+
+#include <stddef.h>
+#include <vector>
+
+//
+// Self-contained ECDSA over secp256k1, used by CKey instead of OpenSSL's
+// generic EC code when built with USE_SECP256K1. Hashes, secrets and nonces
+// are 32 bytes, big endian, as OpenSSL's ECDSA takes them. Signatures are
+// DER, public keys the usual 33 or 65 byte encodings.
+//
+namespace Secp256k1
+{
+    // Returns 1 for a good signature and 0 for a bad one. Encodings other
+    // than strict DER and plain compressed or uncompressed keys return -1,
+    // and the caller should leave those to OpenSSL.
+    int Verify(const unsigned char* pchHash, const unsigned char* pchSig, size_t nSigSize,
+               const unsigned char* pchPubKey, size_t nPubKeySize);
+
+    // Sign in constant time, with a low S value. Fails if the secret or
+    // nonce isn't in [1, order) or the nonce gives r or s of zero; sign
+    // again with a fresh nonce then.
+    bool Sign(const unsigned char* pchHash, const unsigned char* pchSecret, const unsigned char* pchNonce,
+              std::vector<unsigned char>& vchSig);
+
+    bool GetPubKey(const unsigned char* pchSecret, bool fCompressed, std::vector<unsigned char>& vchPubKey);
+}
+
+#endif
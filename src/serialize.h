@@ -1139,4 +1139,45 @@ public:
     }
 };
 
+/** Read-only stream over memory owned by someone else (e.g. a leveldb::Slice).
+ *
+ * Unlike CDataStream nothing is copied, so the buffer must outlive the reader.
+ */
+class CByteReader
+{
+protected:
+    const char* pbegin;
+    const char* pend;
+public:
+    int nType;
+    int nVersion;
+
+    CByteReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn)
+        : pbegin(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) { }
+
+    bool empty() const           { return pbegin == pend; }
+    size_t size() const          { return pend - pbegin; }
+    const char* begin() const    { return pbegin; }
+
+    int GetType()                { return nType; }
+    int GetVersion()             { return nVersion; }
+
+    CByteReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CByteReader::read() : end of data");
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CByteReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
\ No newline at end of file
@@ -298,17 +298,83 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     BOOST_CHECK(!VerifySignature(orphans[1], tx, 1, true, SIGHASH_ALL));
     std::swap(tx.vin[0].scriptSig, tx.vin[1].scriptSig);
 
-    // Exercise -maxsigcachesize code:
-    mapArgs["-maxsigcachesize"] = "10";
-    // Generate a new, different signature for vin[0] to trigger cache clear:
-    CScript oldSig = tx.vin[0].scriptSig;
-    BOOST_CHECK(SignSignature(keystore, orphans[0], tx, 0));
-    BOOST_CHECK(tx.vin[0].scriptSig != oldSig);
+    // With the cache disabled signatures are still checked, every time:
+    InitSignatureCache(0);
     for (unsigned int j = 0; j < tx.vin.size(); j++)
         BOOST_CHECK(VerifySignature(orphans[j], tx, j, true, SIGHASH_ALL));
-    mapArgs.erase("-maxsigcachesize");
+    std::swap(tx.vin[0].scriptSig, tx.vin[1].scriptSig);
+    BOOST_CHECK(!VerifySignature(orphans[0], tx, 0, true, SIGHASH_ALL));
+    std::swap(tx.vin[0].scriptSig, tx.vin[1].scriptSig);
+    InitSignatureCache(DEFAULT_SIGCACHE_SIZE);
 
     LimitOrphanTxSize(0);
 }
 
+static uint256 SigCacheEntry(const CSignatureCache& cache, unsigned int n)
+{
+    std::vector<unsigned char> vchSig(72, n & 0xff);
+    std::vector<unsigned char> vchPubKey(33, n >> 8);
+    return cache.GetEntry(uint256(n), &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size());
+}
+
+BOOST_AUTO_TEST_CASE(DoS_sigcache)
+{
+    CSignatureCache cache(1048576);
+    uint256 entry = SigCacheEntry(cache, 1);
+    BOOST_CHECK(!cache.Get(entry));
+    cache.Set(entry);
+    BOOST_CHECK(cache.Get(entry));
+    BOOST_CHECK(!cache.Get(SigCacheEntry(cache, 2)));
+
+    // Signature bytes moved into the public key make a different entry
+    std::vector<unsigned char> vch(105, 1);
+    BOOST_CHECK(cache.GetEntry(0, &vch[0], 72, &vch[72], 33) != cache.GetEntry(0, &vch[0], 71, &vch[71], 34));
+
+    // Two caches salt differently
+    CSignatureCache cacheOther(1048576);
+    BOOST_CHECK(SigCacheEntry(cacheOther, 1) != entry);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_sigcache_eviction)
+{
+    // A single bucket: all entries compete for its ways
+    CSignatureCache cache(CSignatureCache::BucketSize());
+    std::vector<uint256> vEntry;
+    for (unsigned int i = 0; i < CSignatureCache::WAYS; i++)
+    {
+        vEntry.push_back(SigCacheEntry(cache, i));
+        cache.Set(vEntry.back());
+    }
+    BOOST_FOREACH(const uint256& entry, vEntry)
+        BOOST_CHECK(cache.Get(entry));
+
+    // Setting what is there already evicts nothing
+    cache.Set(vEntry[0]);
+    BOOST_FOREACH(const uint256& entry, vEntry)
+        BOOST_CHECK(cache.Get(entry));
+
+    // One more pushes exactly one out
+    uint256 entryNew = SigCacheEntry(cache, CSignatureCache::WAYS);
+    cache.Set(entryNew);
+    BOOST_CHECK(cache.Get(entryNew));
+    unsigned int nHits = 0;
+    BOOST_FOREACH(const uint256& entry, vEntry)
+        if (cache.Get(entry))
+            nHits++;
+    BOOST_CHECK_EQUAL(nHits, (unsigned int)CSignatureCache::WAYS - 1);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_sigcache_disabled)
+{
+    CSignatureCache cache(0);
+    uint256 entry = SigCacheEntry(cache, 1);
+    cache.Set(entry);
+    BOOST_CHECK(!cache.Get(entry));
+
+    // Less than a bucket is no cache either
+    CSignatureCache cacheSmall(CSignatureCache::BucketSize() - 1);
+    cacheSmall.Set(entry);
+    BOOST_CHECK(!cacheSmall.Get(entry));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,95 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(blockfile_tests)
+
+BOOST_AUTO_TEST_CASE(reader_matches_autofile)
+{
+    BOOST_REQUIRE(pindexGenesisBlock != NULL);
+    unsigned int nFile = pindexGenesisBlock->nFile;
+    unsigned int nBlockPos = pindexGenesisBlock->nBlockPos;
+
+    CBlock blockCached;
+    BOOST_CHECK(blockCached.ReadFromDisk(nFile, nBlockPos));
+
+    CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!!filein);
+    CBlock blockFile;
+    filein >> blockFile;
+    BOOST_CHECK(blockCached.GetHash() == blockFile.GetHash());
+    BOOST_CHECK(blockCached.BuildMerkleTree() == blockFile.BuildMerkleTree());
+
+    // First transaction sits right after the header and the vtx length
+    unsigned int nTxPos = nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(blockFile.vtx.size());
+    CTransaction tx;
+    BOOST_CHECK(tx.ReadFromDisk(CDiskTxPos(nFile, nBlockPos, nTxPos)));
+    BOOST_CHECK(tx.GetHash() == blockFile.vtx[0].GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(reader_bounds)
+{
+    CBlock block;
+    BOOST_CHECK(!block.ReadFromDisk((unsigned int)0, (unsigned int)0));
+    BOOST_CHECK(!block.ReadFromDisk(pindexGenesisBlock->nFile, 0x7F000000));
+}
+
+BOOST_AUTO_TEST_CASE(cache_hits)
+{
+    uint64_t nHits, nMisses, nHitsAfter, nMissesAfter;
+    CBlock block;
+    BOOST_CHECK(block.ReadFromDisk(pindexGenesisBlock));
+    GetBlockFileCacheStats(nHits, nMisses);
+    BOOST_CHECK(block.ReadFromDisk(pindexGenesisBlock));
+    GetBlockFileCacheStats(nHitsAfter, nMissesAfter);
+    BOOST_CHECK_EQUAL(nHitsAfter, nHits + 1);
+    BOOST_CHECK_EQUAL(nMissesAfter, nMisses);
+}
+
+BOOST_AUTO_TEST_CASE(raw_block_message)
+{
+    // The raw path must put the same bytes on the wire as PushMessage
+    CNode nodeRaw(INVALID_SOCKET, CAddress(), "", true);
+    BOOST_CHECK(PushBlockFromDisk(&nodeRaw, pindexGenesisBlock));
+
+    CNode nodeSerialized(INVALID_SOCKET, CAddress(), "", true);
+    CBlock block;
+    BOOST_CHECK(block.ReadFromDisk(pindexGenesisBlock));
+    nodeSerialized.PushMessage("block", block);
+
+    BOOST_CHECK(nodeRaw.vSend.size() > 0);
+    BOOST_CHECK(nodeRaw.vSend.str() == nodeSerialized.vSend.str());
+}
+
+BOOST_AUTO_TEST_CASE(repeated_reads)
+{
+    // Reads through the cached handle, interleaved with fopen reads and raw
+    // serving, keep returning the same block and the same wire bytes
+    unsigned int nFile = pindexGenesisBlock->nFile;
+    unsigned int nBlockPos = pindexGenesisBlock->nBlockPos;
+
+    CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!!filein);
+    CBlock blockFile;
+    filein >> blockFile;
+
+    CNode nodeSerialized(INVALID_SOCKET, CAddress(), "", true);
+    nodeSerialized.PushMessage("block", blockFile);
+    std::string strExpected = nodeSerialized.vSend.str();
+
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    for (int i = 0; i < 100; i++)
+    {
+        CBlock block;
+        BOOST_CHECK(block.ReadFromDisk(nFile, nBlockPos));
+        BOOST_CHECK(block.GetHash() == blockFile.GetHash());
+
+        BOOST_CHECK(PushBlockFromDisk(&node, pindexGenesisBlock));
+        BOOST_CHECK(node.vSend.str() == strExpected);
+        node.vSend.clear();
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
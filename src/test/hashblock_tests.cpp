@@ -0,0 +1,62 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include <vector>
+
+#include "hashblock.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(hashblock_tests)
+
+static std::vector<unsigned char> RandomHeaders(size_t nCount)
+{
+    std::vector<unsigned char> v(nCount * 80);
+    for (size_t i = 0; i < v.size(); i++)
+        v[i] = GetRandInt(256);
+    return v;
+}
+
+BOOST_AUTO_TEST_CASE(hash9batch_matches_hash9)
+{
+    // Cover an empty batch, a partial pass and several full passes
+    size_t vCounts[] = { 0, 1, 63, 64, 65, 200 };
+    BOOST_FOREACH(size_t nCount, vCounts)
+    {
+        std::vector<unsigned char> vHeaders = RandomHeaders(nCount);
+        std::vector<uint256> vHash(nCount + 1);
+        Hash9Batch(nCount ? &vHeaders[0] : NULL, 80, 80, nCount, &vHash[0]);
+        for (size_t i = 0; i < nCount; i++)
+            BOOST_CHECK(vHash[i] == Hash9(&vHeaders[i * 80], &vHeaders[(i + 1) * 80]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hash9batch_stride)
+{
+    // Headers embedded in larger records
+    std::vector<unsigned char> vRecords = RandomHeaders(10 * 2);
+    std::vector<uint256> vHash(10);
+    Hash9Batch(&vRecords[0], 80, 160, 10, &vHash[0]);
+    for (size_t i = 0; i < 10; i++)
+        BOOST_CHECK(vHash[i] == Hash9(&vRecords[i * 160], &vRecords[i * 160 + 80]));
+}
+
+BOOST_AUTO_TEST_CASE(hash9batch_with_stats)
+{
+    // Collecting per-stage timings doesn't change the hashes
+    std::vector<unsigned char> vHeaders = RandomHeaders(2000);
+    std::vector<uint256> vHash(2000);
+    CHash9BatchStats stats;
+    Hash9Batch(&vHeaders[0], 80, 80, 2000, &vHash[0], &stats);
+    BOOST_CHECK_EQUAL(stats.nHashes, 2000U);
+    for (size_t i = 0; i < 2000; i++)
+        BOOST_CHECK(vHash[i] == Hash9(&vHeaders[i * 80], &vHeaders[(i + 1) * 80]));
+
+    // Stats add up over batches and name every stage
+    Hash9Batch(&vHeaders[0], 80, 80, 1000, &vHash[0], &stats);
+    BOOST_CHECK_EQUAL(stats.nHashes, 3000U);
+    std::string strStats = stats.ToString();
+    for (int nStage = 0; nStage < HASH9_STAGES; nStage++)
+        BOOST_CHECK(strStats.find(Hash9StageName(nStage)) != std::string::npos);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,178 @@
+//
+// Unit tests for headers-first block download
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "bignum.h"
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+// Tests these internal-to-main.cpp methods:
+extern int GetBestHeaderHeight();
+extern bool AcceptBlockHeader(const CBlock& header, const uint256& hash, CNode* pfrom);
+extern void ForgetHeaderChain(const uint256& hashFailed, bool fInvalid);
+extern void RequestHeaderChainBlocks(CNode* pto, std::vector<CInv>& vGetData);
+extern bool ParkHeaderChainBlock(const CBlock& block, CNode* pfrom);
+extern bool HaveWaitingBlock(const uint256& hash);
+extern CBigNum bnProofOfStakeLimit;
+
+static CAddress PeerAddress(uint32_t i)
+{
+    struct in_addr s;
+    s.s_addr = i;
+    return CAddress(CService(CNetAddr(s), GetDefaultPort()));
+}
+
+// nCount headers on top of genesis, told apart from other chains by nSeed
+static std::vector<CBlock> HeaderChain(int nCount, unsigned int nSeed)
+{
+    std::vector<CBlock> vHeaders;
+    uint256 hashPrev = pindexGenesisBlock->GetBlockHash();
+    for (int i = 0; i < nCount; i++)
+    {
+        CBlock header;
+        header.nVersion = CBlock::CURRENT_VERSION;
+        header.hashPrevBlock = hashPrev;
+        header.hashMerkleRoot = uint256(nSeed);
+        header.nTime = pindexGenesisBlock->nTime + 60 * (i + 1);
+        header.nBits = bnProofOfStakeLimit.GetCompact();
+        header.nNonce = nSeed;
+        hashPrev = header.GetHash();
+        vHeaders.push_back(header);
+    }
+    return vHeaders;
+}
+
+static bool AcceptHeaders(const std::vector<CBlock>& vHeaders, CNode* pfrom)
+{
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+        if (!AcceptBlockHeader(header, header.GetHash(), pfrom))
+            return false;
+    return true;
+}
+
+BOOST_AUTO_TEST_SUITE(headerssync_tests)
+
+BOOST_AUTO_TEST_CASE(headerssync_select)
+{
+    CNode dummyNode(INVALID_SOCKET, PeerAddress(0xa0b0d001), "", true);
+    std::vector<CBlock> vShort = HeaderChain(3, 1);
+    std::vector<CBlock> vLong = HeaderChain(5, 2);
+
+    BOOST_CHECK(AcceptHeaders(vShort, &dummyNode));
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), nBestHeight + 3);
+    BOOST_CHECK(AcceptHeaders(vLong, &dummyNode));
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), nBestHeight + 5);
+    // A shorter fork doesn't take over
+    BOOST_CHECK(AcceptHeaders(HeaderChain(4, 3), &dummyNode));
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), nBestHeight + 5);
+
+    // Blocks are asked for along the selected chain, in order
+    dummyNode.nStartingHeight = 1000;
+    std::vector<CInv> vGetData;
+    RequestHeaderChainBlocks(&dummyNode, vGetData);
+    BOOST_CHECK_EQUAL(vGetData.size(), vLong.size());
+    for (unsigned int i = 0; i < vGetData.size() && i < vLong.size(); i++)
+        BOOST_CHECK(vGetData[i].hash == vLong[i].GetHash());
+
+    // Not asked for twice while in flight
+    vGetData.clear();
+    RequestHeaderChainBlocks(&dummyNode, vGetData);
+    BOOST_CHECK(vGetData.empty());
+
+    // Forgetting without blame lets the chain be announced again
+    ForgetHeaderChain(vLong[0].GetHash(), false);
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), nBestHeight);
+    BOOST_CHECK(AcceptHeaders(vLong, &dummyNode));
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), nBestHeight + 5);
+
+    ForgetHeaderChain(vLong[0].GetHash(), false);
+    BOOST_CHECK_EQUAL(dummyNode.GetRefCount(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_stall)
+{
+    CNode::ClearBanned();
+    CAddress addr(PeerAddress(0xa0b0d002));
+    CNode dummyNode(INVALID_SOCKET, addr, "", true);
+    dummyNode.nStartingHeight = 1000;
+    std::vector<CBlock> vHeaders = HeaderChain(4, 4);
+    BOOST_CHECK(AcceptHeaders(vHeaders, &dummyNode));
+
+    // None of its blocks come in time: the chain is dropped as invalid and
+    // its announcer banned
+    SetMockTime(GetTime() + HEADER_CHAIN_STALL_TIMEOUT + 1);
+    std::vector<CInv> vGetData;
+    RequestHeaderChainBlocks(&dummyNode, vGetData);
+    BOOST_CHECK(vGetData.empty());
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), nBestHeight);
+    BOOST_CHECK(CNode::IsBanned(addr));
+    BOOST_CHECK_EQUAL(dummyNode.GetRefCount(), 0);
+
+    // Neither the chain nor anything built on it is taken again
+    CNode otherNode(INVALID_SOCKET, PeerAddress(0xa0b0d003), "", true);
+    BOOST_CHECK(!AcceptBlockHeader(vHeaders[0], vHeaders[0].GetHash(), &otherNode));
+    BOOST_CHECK(!AcceptBlockHeader(vHeaders[1], vHeaders[1].GetHash(), &otherNode));
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), nBestHeight);
+
+    SetMockTime(0);
+    CNode::ClearBanned();
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_waiting)
+{
+    CNode dummyNode(INVALID_SOCKET, PeerAddress(0xa0b0d004), "", true);
+    std::vector<CBlock> vHeaders = HeaderChain(3, 5);
+    BOOST_CHECK(AcceptHeaders(vHeaders, &dummyNode));
+
+    // Parked blocks hold on to their peer until the chain is flushed
+    BOOST_CHECK(ParkHeaderChainBlock(vHeaders[2], &dummyNode));
+    BOOST_CHECK(HaveWaitingBlock(vHeaders[2].GetHash()));
+    BOOST_CHECK_EQUAL(dummyNode.GetRefCount(), 2);
+    ForgetHeaderChain(vHeaders[0].GetHash(), false);
+    BOOST_CHECK(!HaveWaitingBlock(vHeaders[2].GetHash()));
+    BOOST_CHECK_EQUAL(dummyNode.GetRefCount(), 0);
+
+    // No more than MAX_BLOCKS_WAITING_SIZE is held
+    CBlock block = vHeaders[0];
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(MAX_BLOCK_SIZE / 2, 0);
+    tx.vout.resize(1);
+    block.vtx.push_back(tx);
+    unsigned int nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    unsigned int nFit = MAX_BLOCKS_WAITING_SIZE / nSize;
+    for (unsigned int i = 0; i < nFit; i++)
+    {
+        block.nNonce = i;
+        BOOST_CHECK(ParkHeaderChainBlock(block, &dummyNode));
+    }
+    block.nNonce = nFit;
+    BOOST_CHECK(!ParkHeaderChainBlock(block, &dummyNode));
+    BOOST_CHECK(!HaveWaitingBlock(block.GetHash()));
+    BOOST_CHECK_EQUAL(dummyNode.GetRefCount(), (int)nFit);
+
+    ForgetHeaderChain(vHeaders[0].GetHash(), false);
+    BOOST_CHECK_EQUAL(dummyNode.GetRefCount(), 0);
+
+    // Room again once flushed
+    BOOST_CHECK(ParkHeaderChainBlock(block, &dummyNode));
+    ForgetHeaderChain(vHeaders[0].GetHash(), false);
+    BOOST_CHECK_EQUAL(dummyNode.GetRefCount(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_batch_hash)
+{
+    // The headers message hashes the header fields straight out of a
+    // vector of CBlock
+    std::vector<CBlock> vHeaders = HeaderChain(100, 6);
+    vHeaders[50].vtx.resize(3);
+    std::vector<uint256> vHash(vHeaders.size());
+    Hash9Batch((const unsigned char*)&vHeaders[0].nVersion, 80, sizeof(CBlock), vHeaders.size(), &vHash[0]);
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+        BOOST_CHECK(vHash[i] == vHeaders[i].GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
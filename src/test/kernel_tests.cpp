@@ -0,0 +1,169 @@
+#include <boost/test/unit_test.hpp>
+
+#include "kernel.h"
+#include "main.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+static CStakeCandidate TestCandidate()
+{
+    CStakeCandidate candidate;
+    candidate.prevout = COutPoint(GetRandHash(), 1);
+    candidate.nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+    candidate.nTimeBlockFrom = 1400000000;
+    candidate.nTxPrevOffset = 81;
+    candidate.nTimeTxPrev = 1400000000;
+    candidate.nValue = 1000 * COIN;
+    candidate.fStakeModifier = true;
+    return candidate;
+}
+
+BOOST_AUTO_TEST_CASE(search_matches_check)
+{
+    // 0x1e00ffff with a 30 day old 1000 coin output passes about one timestamp in 500
+    unsigned int nBits = 0x1e00ffff;
+    CStakeCandidate candidate = TestCandidate();
+    unsigned int nTimeStart = candidate.nTimeBlockFrom + 30 * 24 * 60 * 60;
+    int nHits = 0;
+
+    for (unsigned int nTimeTxFrom = nTimeStart; nTimeTxFrom < nTimeStart + 60 * 200; nTimeTxFrom += 60)
+    {
+        unsigned int nTimeExpected = 0;
+        uint256 hashExpected = 0, targetExpected = 0;
+        for (unsigned int n = 0; n < 60; n++)
+        {
+            if (CheckStakeKernelHash(nBits, candidate, nTimeTxFrom - n, hashExpected, targetExpected))
+            {
+                nTimeExpected = nTimeTxFrom - n;
+                break;
+            }
+        }
+
+        unsigned int nTimeTx = 0;
+        uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+        bool fFound = SearchStakeKernelHash(nBits, candidate, nTimeTxFrom, 60, nTimeTx, hashProofOfStake, targetProofOfStake);
+        BOOST_CHECK_EQUAL(fFound, nTimeExpected != 0);
+        if (fFound && nTimeExpected)
+        {
+            BOOST_CHECK_EQUAL(nTimeTx, nTimeExpected);
+            BOOST_CHECK(hashProofOfStake == hashExpected);
+            BOOST_CHECK(targetProofOfStake == targetExpected);
+            nHits++;
+        }
+    }
+    BOOST_CHECK(nHits > 0);
+}
+
+BOOST_AUTO_TEST_CASE(search_respects_min_age)
+{
+    CStakeCandidate candidate = TestCandidate();
+    unsigned int nTimeTx = 0;
+    uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+    // Even the easiest target can't be met before the coin reaches nStakeMinAge
+    BOOST_CHECK(!SearchStakeKernelHash(0x207fffff, candidate, candidate.nTimeBlockFrom + nStakeMinAge - 1, 60, nTimeTx, hashProofOfStake, targetProofOfStake));
+    // ... and once it's old enough the target overflows 256 bits, so the latest timestamp wins
+    unsigned int nTimeTxFrom = candidate.nTimeBlockFrom + 30 * 24 * 60 * 60;
+    BOOST_CHECK(SearchStakeKernelHash(0x207fffff, candidate, nTimeTxFrom, 60, nTimeTx, hashProofOfStake, targetProofOfStake));
+    BOOST_CHECK_EQUAL(nTimeTx, nTimeTxFrom);
+}
+
+// Index a block following pindexPrev that generated a modifier
+static CBlockIndex* AddTestBlock(CBlockIndex* pindexPrev, unsigned int nTime, uint64_t nModifier)
+{
+    CBlockIndex* pindex = new CBlockIndex();
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+    pindex->nTime = nTime;
+    pindex->SetStakeModifier(nModifier, true);
+    pindex->phashBlock = &(mapBlockIndex.insert(std::make_pair(GetRandHash(), pindex)).first->first);
+    return pindex;
+}
+
+BOOST_AUTO_TEST_CASE(modifier_reorg)
+{
+    CBlockIndex* pindexBestSave = pindexBest;
+
+    // Coin confirmed in pindexFrom, modifier read from the next block, which
+    // is past the selection interval
+    unsigned int nTimeFrom = 1400000000;
+    unsigned int nTimeNext = nTimeFrom + 64 * nModifierInterval + 1;
+    CBlockIndex* pindexFrom = AddTestBlock(NULL, nTimeFrom, 1);
+    CBlockIndex* pindexA = AddTestBlock(pindexFrom, nTimeNext, 2);
+    CBlockIndex* pindexB = AddTestBlock(pindexFrom, nTimeNext, 3);
+    pindexFrom->pnext = pindexA;
+    pindexBest = pindexA;
+
+    CStakeCandidate candidate = TestCandidate();
+    candidate.hashBlockFrom = pindexFrom->GetBlockHash();
+    candidate.fStakeModifier = false;
+    BOOST_CHECK(!candidate.IsModifierCurrent());
+
+    int nStakeModifierHeight = 0;
+    int64_t nStakeModifierTime = 0;
+    candidate.fStakeModifier = GetKernelStakeModifier(candidate.hashBlockFrom, candidate.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, candidate.hashModifierBlock, false);
+    BOOST_CHECK(candidate.fStakeModifier);
+    BOOST_CHECK_EQUAL(candidate.nStakeModifier, (uint64_t)2);
+    BOOST_CHECK(candidate.hashModifierBlock == pindexA->GetBlockHash());
+    BOOST_CHECK(candidate.IsModifierCurrent());
+
+    // Reorg to a sibling of the modifier block; the coin's block stays in
+    // the main chain but the cached modifier no longer holds
+    pindexFrom->pnext = pindexB;
+    pindexBest = pindexB;
+    BOOST_CHECK(!candidate.IsModifierCurrent());
+
+    candidate.fStakeModifier = GetKernelStakeModifier(candidate.hashBlockFrom, candidate.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, candidate.hashModifierBlock, false);
+    BOOST_CHECK(candidate.fStakeModifier);
+    BOOST_CHECK_EQUAL(candidate.nStakeModifier, (uint64_t)3);
+    BOOST_CHECK(candidate.hashModifierBlock == pindexB->GetBlockHash());
+    BOOST_CHECK(candidate.IsModifierCurrent());
+
+    pindexBest = pindexBestSave;
+    CBlockIndex* vpindex[] = { pindexFrom, pindexA, pindexB };
+    BOOST_FOREACH(CBlockIndex* pindex, vpindex)
+    {
+        mapBlockIndex.erase(pindex->GetBlockHash());
+        delete pindex;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(search_matches_check_random)
+{
+    // Random candidates, targets and search lengths, including lengths that
+    // don't fill the last pass
+    unsigned int vBits[] = { 0x03000001, 0x1d00ffff, 0x1e00ffff, 0x1f00ffff };
+    for (int i = 0; i < 200; i++)
+    {
+        unsigned int nBits = vBits[GetRandInt(4)];
+        CStakeCandidate candidate = TestCandidate();
+        candidate.nTxPrevOffset = 81 + GetRandInt(100000);
+        candidate.nValue = (1 + GetRandInt(10000)) * COIN;
+        unsigned int nTimeTxFrom = candidate.nTimeBlockFrom + 30 * 24 * 60 * 60 + GetRandInt(1000000);
+        unsigned int nSearch = 1 + GetRandInt(130);
+
+        unsigned int nTimeExpected = 0;
+        uint256 hashExpected = 0, targetExpected = 0;
+        for (unsigned int n = 0; n < nSearch; n++)
+        {
+            if (CheckStakeKernelHash(nBits, candidate, nTimeTxFrom - n, hashExpected, targetExpected))
+            {
+                nTimeExpected = nTimeTxFrom - n;
+                break;
+            }
+        }
+
+        unsigned int nTimeTx = 0;
+        uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+        bool fFound = SearchStakeKernelHash(nBits, candidate, nTimeTxFrom, nSearch, nTimeTx, hashProofOfStake, targetProofOfStake);
+        BOOST_CHECK_EQUAL(fFound, nTimeExpected != 0);
+        if (fFound && nTimeExpected)
+        {
+            BOOST_CHECK_EQUAL(nTimeTx, nTimeExpected);
+            BOOST_CHECK(hashProofOfStake == hashExpected);
+            BOOST_CHECK(targetProofOfStake == targetExpected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
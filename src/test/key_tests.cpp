@@ -3,7 +3,11 @@
 #include <string>
 #include <vector>
 
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+
 #include "key.h"
+#include "secp256k1.h"
 #include "base58.h"
 #include "uint256.h"
 #include "util.h"
@@ -144,4 +148,170 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+// A fresh OpenSSL key with its serialized public key and secret
+static EC_KEY* NewOpenSSLKey(bool fCompressed, vector<unsigned char>& vchPubKey, vector<unsigned char>& vchSecret)
+{
+    EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    EC_KEY_generate_key(pkey);
+    EC_KEY_set_conv_form(pkey, fCompressed ? POINT_CONVERSION_COMPRESSED : POINT_CONVERSION_UNCOMPRESSED);
+    vchPubKey.resize(i2o_ECPublicKey(pkey, NULL));
+    unsigned char* pch = &vchPubKey[0];
+    i2o_ECPublicKey(pkey, &pch);
+    const BIGNUM* bn = EC_KEY_get0_private_key(pkey);
+    vchSecret.assign(32, 0);
+    BN_bn2bin(bn, &vchSecret[32 - BN_num_bytes(bn)]);
+    return pkey;
+}
+
+static vector<unsigned char> OpenSSLSign(EC_KEY* pkey, const uint256& hash)
+{
+    vector<unsigned char> vchSig(ECDSA_size(pkey));
+    unsigned int nSize = 0;
+    ECDSA_sign(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], &nSize, pkey);
+    vchSig.resize(nSize);
+    return vchSig;
+}
+
+static int OpenSSLVerify(EC_KEY* pkey, const uint256& hash, const vector<unsigned char>& vchSig)
+{
+    return ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) == 1;
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_matches_openssl)
+{
+    for (int i = 0; i < 500; i++)
+    {
+        bool fCompressed = (i & 1);
+        vector<unsigned char> vchPubKey, vchSecret;
+        EC_KEY* pkey = NewOpenSSLKey(fCompressed, vchPubKey, vchSecret);
+        uint256 hash = GetRandHash();
+        uint256 hashOther = hash;
+        *hashOther.begin() ^= 1;
+
+        vector<unsigned char> vchPubKeyOurs;
+        BOOST_CHECK(Secp256k1::GetPubKey(&vchSecret[0], fCompressed, vchPubKeyOurs));
+        BOOST_CHECK(vchPubKeyOurs == vchPubKey);
+
+        // Each accepts the other's signatures and neither takes them for
+        // another message
+        vector<unsigned char> vchSig = OpenSSLSign(pkey, hash);
+        BOOST_CHECK_EQUAL(Secp256k1::Verify((unsigned char*)&hash, &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size()), 1);
+        BOOST_CHECK_EQUAL(Secp256k1::Verify((unsigned char*)&hashOther, &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size()), 0);
+
+        vector<unsigned char> vchSigOurs;
+        uint256 nonce = GetRandHash();
+        BOOST_CHECK(Secp256k1::Sign((unsigned char*)&hash, &vchSecret[0], (unsigned char*)&nonce, vchSigOurs));
+        BOOST_CHECK(OpenSSLVerify(pkey, hash, vchSigOurs));
+        BOOST_CHECK(!OpenSSLVerify(pkey, hashOther, vchSigOurs));
+
+        // Damaged signatures and keys get the same answer wherever they
+        // still parse
+        vchSig[GetRandInt(vchSig.size())] ^= 1 << GetRandInt(8);
+        int nResult = Secp256k1::Verify((unsigned char*)&hash, &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size());
+        if (nResult >= 0)
+            BOOST_CHECK_EQUAL(nResult, OpenSSLVerify(pkey, hash, vchSig));
+        vchPubKey[1 + GetRandInt(vchPubKey.size() - 1)] ^= 1 << GetRandInt(8);
+        BOOST_CHECK(Secp256k1::Verify((unsigned char*)&hash, &vchSigOurs[0], vchSigOurs.size(), &vchPubKey[0], vchPubKey.size()) != 1);
+
+        EC_KEY_free(pkey);
+    }
+
+    // Secrets and nonces outside [1, order) are refused
+    vector<unsigned char> vchZero(32, 0), vchOrder = ParseHex("FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141");
+    vector<unsigned char> vchOne(32, 0), vchSig, vchPubKey;
+    vchOne[31] = 1;
+    uint256 hash = GetRandHash();
+    BOOST_CHECK(!Secp256k1::Sign((unsigned char*)&hash, &vchZero[0], &vchOne[0], vchSig));
+    BOOST_CHECK(!Secp256k1::Sign((unsigned char*)&hash, &vchOne[0], &vchOrder[0], vchSig));
+    BOOST_CHECK(!Secp256k1::GetPubKey(&vchOrder[0], true, vchPubKey));
+}
+
+// The same DER signature with s replaced by order - s, which verifies just
+// the same
+static vector<unsigned char> NegateS(const vector<unsigned char>& vchSig)
+{
+    unsigned int nLenR = vchSig[3];
+    unsigned int nLenS = vchSig[5 + nLenR];
+    vector<unsigned char> vchR(vchSig.begin() + 4, vchSig.begin() + 4 + nLenR);
+
+    EC_GROUP* group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    BN_CTX* ctx = BN_CTX_new();
+    BIGNUM* order = BN_new();
+    EC_GROUP_get_order(group, order, ctx);
+    BIGNUM* bnS = BN_bin2bn(&vchSig[6 + nLenR], nLenS, NULL);
+    BN_sub(bnS, order, bnS);
+    vector<unsigned char> vchS(1 + BN_num_bytes(bnS), 0);
+    BN_bn2bin(bnS, &vchS[1]);
+    if (!(vchS[1] & 0x80))
+        vchS.erase(vchS.begin());
+    BN_free(bnS);
+    BN_free(order);
+    BN_CTX_free(ctx);
+    EC_GROUP_free(group);
+
+    vector<unsigned char> vchRet;
+    vchRet.push_back(0x30);
+    vchRet.push_back(4 + vchR.size() + vchS.size());
+    vchRet.push_back(0x02);
+    vchRet.push_back(vchR.size());
+    vchRet.insert(vchRet.end(), vchR.begin(), vchR.end());
+    vchRet.push_back(0x02);
+    vchRet.push_back(vchS.size());
+    vchRet.insert(vchRet.end(), vchS.begin(), vchS.end());
+    return vchRet;
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_mutated_signatures)
+{
+    // Over many kinds of damage, whatever secp256k1.cpp decides must be
+    // what CheckSig's OpenSSL path (decode the key, then verify) decides
+    int nDecided = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        bool fCompressed = (i & 1);
+        vector<unsigned char> vchPubKey, vchSecret;
+        EC_KEY* pkey = NewOpenSSLKey(fCompressed, vchPubKey, vchSecret);
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSigGood = OpenSSLSign(pkey, hash);
+        EC_KEY_free(pkey);
+
+        EC_KEY* pkeyCheck = EC_KEY_new_by_curve_name(NID_secp256k1);
+        const unsigned char* pch = &vchPubKey[0];
+        BOOST_REQUIRE(o2i_ECPublicKey(&pkeyCheck, &pch, vchPubKey.size()));
+
+        for (int nMutation = 0; nMutation < 20; nMutation++)
+        {
+            vector<unsigned char> vchSig = vchSigGood;
+            switch (nMutation % 5)
+            {
+            case 0: // one bit anywhere
+                vchSig[GetRandInt(vchSig.size())] ^= 1 << GetRandInt(8);
+                break;
+            case 1: // one byte anywhere
+                vchSig[GetRandInt(vchSig.size())] = GetRandInt(256);
+                break;
+            case 2: // truncated
+                vchSig.resize(vchSig.size() - 1 - GetRandInt(3));
+                break;
+            case 3: // trailing garbage
+                vchSig.push_back(GetRandInt(256));
+                break;
+            case 4: // the other valid s, then maybe a bit of it
+                vchSig = NegateS(vchSig);
+                if (nMutation >= 10)
+                    vchSig[vchSig.size() - 1 - GetRandInt(32)] ^= 1 << GetRandInt(8);
+                break;
+            }
+            int nResult = Secp256k1::Verify((unsigned char*)&hash, &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size());
+            if (nResult >= 0)
+            {
+                BOOST_CHECK_EQUAL(nResult, OpenSSLVerify(pkeyCheck, hash, vchSig));
+                nDecided++;
+            }
+        }
+        EC_KEY_free(pkeyCheck);
+    }
+    BOOST_CHECK(nDecided > 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,39 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "wallet.h"
+
+extern CWallet* pwalletMain;
+
+BOOST_AUTO_TEST_SUITE(keypool_tests)
+
+BOOST_AUTO_TEST_CASE(batched_top_up)
+{
+    // More keys than fit in one batch
+    static const unsigned int nSize = 600;
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nSize));
+    unsigned int nFull = pwalletMain->GetKeyPoolSize();
+    BOOST_CHECK(nFull >= nSize + 1);
+
+    // A full pool is left alone
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nSize));
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nFull);
+
+    // Pool entries read back and their keys are in the keystore
+    int64_t nIndex;
+    CKeyPool keypool;
+    pwalletMain->ReserveKeyFromKeyPool(nIndex, keypool);
+    BOOST_CHECK(nIndex != -1);
+    BOOST_CHECK(pwalletMain->HaveKey(keypool.vchPubKey.GetID()));
+    pwalletMain->ReturnKey(nIndex);
+
+    // Each key handed out once
+    CPubKey pubkey1, pubkey2;
+    unsigned int nBefore = pwalletMain->GetKeyPoolSize();
+    BOOST_CHECK(pwalletMain->GetKeyFromPool(pubkey1, false));
+    BOOST_CHECK(pwalletMain->GetKeyFromPool(pubkey2, false));
+    BOOST_CHECK(pubkey1 != pubkey2);
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nBefore - 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,73 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+static CTransaction SpendTx(const uint256& hashPrev, int64_t nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+static void AddWithFee(CTransaction& tx, int64_t nFee)
+{
+    CTxMemPoolEntry entry(tx);
+    entry.nFee = nFee;
+    entry.dFeePerKb = double(nFee) / (double(entry.nTxSize)/1000.0);
+    mempool.addUnchecked(tx.GetHash(), tx, entry);
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(entry_links)
+{
+    mempool.clear();
+    CTransaction txParent = SpendTx(GetRandHash(), 5 * COIN);
+    CTransaction txChild = SpendTx(txParent.GetHash(), 4 * COIN);
+    uint256 hashParent = txParent.GetHash(), hashChild = txChild.GetHash();
+
+    // Child first, as after a reorganisation puts its parent back
+    AddWithFee(txChild, CENT);
+    BOOST_CHECK(mempool.mapEntry.find(hashChild)->second.setDependsOn.empty());
+    AddWithFee(txParent, 2 * CENT);
+    BOOST_CHECK(mempool.mapEntry.find(hashChild)->second.setDependsOn.count(hashParent));
+    BOOST_CHECK(mempool.mapEntry.find(hashParent)->second.setDependers.count(hashChild));
+    BOOST_CHECK(mempool.mapEntry.find(hashChild)->second.ptx == &mempool.mapTx[hashChild]);
+
+    // Highest fee rate last in the index
+    BOOST_CHECK_EQUAL(mempool.setFeeRate.size(), 2U);
+    BOOST_CHECK(mempool.setFeeRate.rbegin()->second == hashParent);
+
+    // Parent confirmed: the child no longer waits on anything
+    mempool.remove(txParent);
+    BOOST_CHECK(!mempool.mapEntry.count(hashParent));
+    BOOST_CHECK(mempool.mapEntry.find(hashChild)->second.setDependsOn.empty());
+    BOOST_CHECK_EQUAL(mempool.setFeeRate.size(), 1U);
+
+    // Recursive removal takes the index entries with it
+    AddWithFee(txParent, 2 * CENT);
+    mempool.remove(txParent, true);
+    BOOST_CHECK(mempool.mapEntry.empty());
+    BOOST_CHECK(mempool.setFeeRate.empty());
+    BOOST_CHECK(mempool.mapNextTx.empty());
+}
+
+BOOST_AUTO_TEST_CASE(entry_priority)
+{
+    CTransaction tx = SpendTx(GetRandHash(), COIN);
+    CTxMemPoolEntry entry(tx);
+    entry.dPriority = 1000.0;
+    entry.nChainValueIn = entry.nTxSize * 10;
+
+    // Ten more per block for each block the inputs age
+    BOOST_CHECK_EQUAL(entry.GetPriority(entry.nHeight), 1000.0);
+    BOOST_CHECK_EQUAL(entry.GetPriority(entry.nHeight + 3), 1030.0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,148 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+// Frame a payload the way CNode::EndMessage does
+static CDataStream Frame(const char* pszCommand, const std::vector<char>& vPayload, bool fBadChecksum = false)
+{
+    CMessageHeader hdr(pszCommand, vPayload.size());
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    if (fBadChecksum)
+        hdr.nChecksum ^= 1;
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    ss.write(vPayload.empty() ? NULL : &vPayload[0], vPayload.size());
+    return ss;
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(recv_framing)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    std::vector<char> vBig(1000000);
+    for (unsigned int i = 0; i < vBig.size(); i++)
+        vBig[i] = (char)(i * 7);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss += Frame("verack", std::vector<char>());
+    ss += Frame("block", vBig);
+    ss += Frame("ping", std::vector<char>(8, 1), true);
+    ss += Frame("ping", std::vector<char>(8, 2));
+
+    // Feed it in socket sized pieces, the last one splitting a header
+    std::string str = ss.str();
+    for (unsigned int nPos = 0; nPos < str.size(); nPos += 0x10000)
+        BOOST_CHECK(node.ReceiveMsgBytes(&str[nPos], std::min((size_t)0x10000, str.size() - nPos)));
+
+    // The message with the bad checksum is dropped
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 3U);
+    BOOST_CHECK(node.vRecvMsg[0].complete() && node.vRecvMsg[0].hdr.GetCommand() == "verack");
+    BOOST_CHECK(node.vRecvMsg[1].complete() && node.vRecvMsg[1].hdr.GetCommand() == "block");
+    BOOST_CHECK(node.vRecvMsg[1].vRecv.size() == vBig.size());
+    BOOST_CHECK(std::equal(vBig.begin(), vBig.end(), node.vRecvMsg[1].vRecv.begin()));
+    BOOST_CHECK(node.vRecvMsg[2].complete() && node.vRecvMsg[2].vRecv[0] == 2);
+}
+
+BOOST_AUTO_TEST_CASE(recv_in_place)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    std::vector<char> vBig(300000);
+    for (unsigned int i = 0; i < vBig.size(); i++)
+        vBig[i] = (char)(i * 13);
+    std::string str = Frame("block", vBig).str();
+    unsigned int nSize;
+
+    // Nothing to fill until the header is in
+    BOOST_CHECK(node.GetRecvDataBuffer(0x10000, nSize) == NULL);
+    BOOST_CHECK(node.ReceiveMsgBytes(&str[0], CMessageHeader::HEADER_SIZE + 100));
+
+    // Then the payload is written where the message keeps it
+    unsigned int nPos = CMessageHeader::HEADER_SIZE + 100;
+    while (char* pch = node.GetRecvDataBuffer(0x10000, nSize))
+    {
+        BOOST_REQUIRE(nSize > 0 && nSize <= 0x10000 && nPos + nSize <= str.size());
+        memcpy(pch, &str[nPos], nSize);
+        node.RecvDataBufferFilled(nSize);
+        nPos += nSize;
+    }
+    BOOST_CHECK_EQUAL(nPos, str.size());
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_CHECK(node.vRecvMsg[0].complete());
+    BOOST_CHECK(node.vRecvMsg[0].vRecv.size() == vBig.size());
+    BOOST_CHECK(std::equal(vBig.begin(), vBig.end(), node.vRecvMsg[0].vRecv.begin()));
+}
+
+BOOST_AUTO_TEST_CASE(recv_bad_header)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    // Wrong message start
+    CDataStream ss = Frame("ping", std::vector<char>(8));
+    ss[0] ^= 0xff;
+    std::string str = ss.str();
+    BOOST_CHECK(!node.ReceiveMsgBytes(&str[0], str.size()));
+}
+
+BOOST_AUTO_TEST_CASE(recv_ready)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    std::string str = Frame("ping", std::vector<char>(8)).str();
+    BOOST_CHECK(node.ReceiveMsgBytes(&str[0], str.size() - 1));
+    BOOST_CHECK(!node.HaveRecvMsgReady());
+    BOOST_CHECK(node.ReceiveMsgBytes(&str[str.size() - 1], 1));
+    BOOST_CHECK(node.HaveRecvMsgReady());
+
+    // Queued messages of a node being dropped are no work for the handler
+    node.fDisconnect = true;
+    BOOST_CHECK(!node.HaveRecvMsgReady());
+}
+
+BOOST_AUTO_TEST_CASE(recv_oversized)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    CMessageHeader hdr("block", MAX_SIZE + 1);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    std::string str = ss.str();
+    BOOST_CHECK(!node.ReceiveMsgBytes(&str[0], str.size()));
+}
+
+BOOST_AUTO_TEST_CASE(perf_stats)
+{
+    std::map<std::string, CMessageLatency> mapLatency;
+    GetMessageLatency(mapLatency, true);
+    RecordMessageLatency("ping", 10, 100, 8);
+    RecordMessageLatency("ping", 20, 300, 8);
+    GetMessageLatency(mapLatency, true);
+    BOOST_CHECK_EQUAL(mapLatency["ping"].nCount, 2U);
+    BOOST_CHECK_EQUAL(mapLatency["ping"].nBytes, 16U);
+    BOOST_CHECK_EQUAL(mapLatency["ping"].nProcessTotal, 400);
+
+    std::vector<std::pair<std::string, CMessageLatency> > vPhase;
+    GetBlockPhaseStats(vPhase, true);
+    RecordBlockPhase(BLOCKPHASE_VERIFY, 1500);
+    GetBlockPhaseStats(vPhase, true);
+    BOOST_CHECK_EQUAL(vPhase.size(), (size_t)BLOCKPHASE_COUNT);
+    BOOST_CHECK_EQUAL(vPhase[BLOCKPHASE_VERIFY].first, "verify");
+    BOOST_CHECK_EQUAL(vPhase[BLOCKPHASE_VERIFY].second.nCount, 1U);
+    BOOST_CHECK_EQUAL(vPhase[BLOCKPHASE_VERIFY].second.nMax, 1500);
+
+    // Reset leaves nothing behind
+    GetBlockPhaseStats(vPhase, false);
+    BOOST_CHECK_EQUAL(vPhase[BLOCKPHASE_VERIFY].second.nCount, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,128 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "util.h"
+
+extern uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
+// The signature hash as it was computed on a modified copy of the transaction
+static uint256 SignatureHashOld(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    if (nIn >= txTo.vin.size())
+        return 1;
+    CTransaction txTmp(txTo);
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+        txTmp.vin[i].scriptSig = CScript();
+    txTmp.vin[nIn].scriptSig = scriptCode;
+
+    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    {
+        txTmp.vout.clear();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    {
+        unsigned int nOut = nIn;
+        if (nOut >= txTmp.vout.size())
+            return 1;
+        txTmp.vout.resize(nOut+1);
+        for (unsigned int i = 0; i < nOut; i++)
+            txTmp.vout[i].SetNull();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+
+    if (nHashType & SIGHASH_ANYONECANPAY)
+    {
+        txTmp.vin[0] = txTmp.vin[nIn];
+        txTmp.vin.resize(1);
+    }
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss.reserve(10000);
+    ss << txTmp << nHashType;
+    return Hash(ss.begin(), ss.end());
+}
+
+static void RandomScript(CScript& script)
+{
+    static const opcodetype oplist[] = {OP_FALSE, OP_1, OP_2, OP_3, OP_CHECKSIG, OP_IF, OP_VERIF, OP_RETURN, OP_CODESEPARATOR};
+    script = CScript();
+    int nOps = GetRandInt(10);
+    for (int i = 0; i < nOps; i++)
+        script << oplist[GetRandInt(sizeof(oplist)/sizeof(oplist[0]))];
+}
+
+static void RandomTransaction(CTransaction& tx, int nInputs, int nOutputs)
+{
+    tx.nVersion = GetRandInt(3);
+    tx.nTime = GetRandInt(0x7fffffff);
+    tx.nLockTime = GetRandInt(2) ? GetRandInt(0x7fffffff) : 0;
+    tx.vin.resize(nInputs);
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nInputs; i++)
+    {
+        CTxIn& txin = tx.vin[i];
+        txin.prevout.hash = GetRandHash();
+        txin.prevout.n = GetRandInt(4);
+        RandomScript(txin.scriptSig);
+        txin.nSequence = GetRandInt(2) ? GetRandInt(0x7fffffff) : (unsigned int)-1;
+    }
+    for (int i = 0; i < nOutputs; i++)
+    {
+        CTxOut& txout = tx.vout[i];
+        txout.nValue = GetRand(100000000);
+        RandomScript(txout.scriptPubKey);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sighash_tests)
+
+BOOST_AUTO_TEST_CASE(sighash_matches_copy)
+{
+    for (int i = 0; i < 20000; i++)
+    {
+        int nHashType = GetRandInt(0x100);
+        CTransaction tx;
+        RandomTransaction(tx, 1 + GetRandInt(4), GetRandInt(4));
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        // A truncated push at the end stops OP_CODESEPARATOR removal
+        if (GetRandInt(8) == 0)
+            scriptCode << OP_CODESEPARATOR << OP_PUSHDATA1;
+        unsigned int nIn = GetRandInt(tx.vin.size());
+
+        BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, nHashType) == SignatureHashOld(scriptCode, tx, nIn, nHashType));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sighash_large_tx)
+{
+    // Every input of a 500 input transaction, as block validation does,
+    // with real sized signatures in the other inputs' scriptSigs
+    static const int nInputs = 500;
+    CTransaction tx;
+    RandomTransaction(tx, nInputs, 2);
+    for (int i = 0; i < nInputs; i++)
+    {
+        tx.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+        tx.vin[i].nSequence = (unsigned int)-1;
+    }
+    CScript scriptCode;
+    scriptCode << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    static const int vHashType[] = { SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE,
+                                     SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_NONE | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY };
+    BOOST_FOREACH(int nHashType, vHashType)
+        for (int i = 0; i < nInputs; i++)
+            BOOST_CHECK(SignatureHash(scriptCode, tx, i, nHashType) == SignatureHashOld(scriptCode, tx, i, nHashType));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
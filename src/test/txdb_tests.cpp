@@ -0,0 +1,118 @@
+#include <boost/test/unit_test.hpp>
+
+#include "txdb.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+BOOST_AUTO_TEST_CASE(batch_find_append)
+{
+    CTxDBBatch batch, later;
+    std::string strValue;
+    bool fDeleted;
+
+    batch.Put("a", "1");
+    batch.Put("b", "2");
+    batch.Delete("b");
+    BOOST_CHECK(batch.Find("a", &strValue, &fDeleted) && !fDeleted && strValue == "1");
+    BOOST_CHECK(batch.Find("b", &strValue, &fDeleted) && fDeleted);
+    BOOST_CHECK(!batch.Find("c", &strValue, &fDeleted));
+
+    later.Put("b", "3");
+    later.Delete("a");
+    later.nTipUpdates = 1;
+    batch.Append(later);
+    BOOST_CHECK(batch.Find("a", &strValue, &fDeleted) && fDeleted);
+    BOOST_CHECK(batch.Find("b", &strValue, &fDeleted) && !fDeleted && strValue == "3");
+    BOOST_CHECK_EQUAL(batch.nTipUpdates, 1U);
+
+    batch.Clear();
+    BOOST_CHECK(batch.mapWrites.empty());
+    BOOST_CHECK_EQUAL(batch.nTipUpdates, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(grouped_commit)
+{
+    CBigNum bnSaved;
+    CTxDB txdb;
+    bool fHaveSaved = txdb.ReadBestInvalidTrust(bnSaved);
+    unsigned int nSavedBatchBlocks = nDBBatchBlocks;
+    nDBBatchBlocks = 4;
+
+    // Reads inside a transaction see its writes, an abort drops them
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.WriteBestInvalidTrust(CBigNum(42)));
+    CBigNum bn;
+    BOOST_CHECK(txdb.ReadBestInvalidTrust(bn) && bn == CBigNum(42));
+    BOOST_CHECK(txdb.TxnAbort());
+    BOOST_CHECK(!txdb.ReadBestInvalidTrust(bn) || bn != CBigNum(42));
+
+    // A held back commit is visible to other CTxDB instances before and
+    // after it reaches LevelDB
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.WriteBestInvalidTrust(CBigNum(7)));
+    BOOST_CHECK(txdb.TxnCommit(true));
+    BOOST_CHECK(CTxDB("r").ReadBestInvalidTrust(bn) && bn == CBigNum(7));
+    BOOST_CHECK(txdb.FlushBatch());
+    BOOST_CHECK(CTxDB("r").ReadBestInvalidTrust(bn) && bn == CBigNum(7));
+
+    // A plain commit writes out whatever was held back with it
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.WriteBestInvalidTrust(CBigNum(8)));
+    BOOST_CHECK(txdb.TxnCommit(true));
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(CTxDB("r").ReadBestInvalidTrust(bn) && bn == CBigNum(8));
+
+    nDBBatchBlocks = nSavedBatchBlocks;
+    txdb.WriteBestInvalidTrust(fHaveSaved ? bnSaved : CBigNum(0));
+}
+
+BOOST_AUTO_TEST_CASE(txindex_cache)
+{
+    CTxDB txdb;
+    uint256 hash = GetRandHash();
+    CTxIndex txindex(CDiskTxPos(1, 2, 3), 2), txindexRead;
+    uint64_t nHits, nMisses, nHitsAfter, nMissesAfter;
+    size_t nUsage;
+
+    // An aborted write never reaches the cache
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.UpdateTxIndex(hash, txindex));
+    BOOST_CHECK(txdb.ReadTxIndex(hash, txindexRead) && txindexRead.pos == txindex.pos);
+    BOOST_CHECK(txdb.TxnAbort());
+    BOOST_CHECK(!txdb.ReadTxIndex(hash, txindexRead));
+
+    // A committed one is served from it
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.UpdateTxIndex(hash, txindex));
+    BOOST_CHECK(txdb.TxnCommit());
+    GetTxCacheStats(nHits, nMisses, nUsage);
+    BOOST_CHECK(CTxDB("r").ReadTxIndex(hash, txindexRead));
+    BOOST_CHECK(txindexRead.pos == txindex.pos && txindexRead.vSpent.size() == 2);
+    GetTxCacheStats(nHitsAfter, nMissesAfter, nUsage);
+    BOOST_CHECK_EQUAL(nHitsAfter, nHits + 1);
+    BOOST_CHECK(nUsage > 0);
+
+    // Spending an output updates the cached entry
+    txindex.vSpent[1] = CDiskTxPos(1, 2, 4);
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.UpdateTxIndex(hash, txindex));
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(CTxDB("r").ReadTxIndex(hash, txindexRead) && txindexRead.vSpent[1] == txindex.vSpent[1]);
+
+    // Erasing drops it
+    CTransaction tx;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = GetRand(1000000);
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.AddTxIndex(tx, CDiskTxPos(1, 5, 6), 0));
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(CTxDB("r").ContainsTx(tx.GetHash()));
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.EraseTxIndex(tx));
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(!CTxDB("r").ReadTxIndex(tx.GetHash(), txindexRead));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
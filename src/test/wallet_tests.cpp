@@ -2,6 +2,8 @@
 
 #include "main.h"
 #include "wallet.h"
+#include "kernel.h"
+#include "bignum.h"
 
 // how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
 #define RUN_TESTS 100
@@ -14,10 +16,16 @@ using namespace std;
 
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
+extern bool SelectCoinsBnB(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTargetValue,
+                           int64_t nCostOfChange, int64_t nInputCost, vector<char>& vfBest, int64_t& nBest);
+extern int64_t nStakeCombineThreshold;
+extern unsigned int nStakeMaxAge;
+
 BOOST_AUTO_TEST_SUITE(wallet_tests)
 
 static CWallet wallet;
 static vector<COutput> vCoins;
+static const unsigned int nSpendTime = std::numeric_limits<unsigned int>::max();
 
 static void add_coin(int64 nValue, int nAge = 6*24, bool fIsFromMe = false, int nInput=0)
 {
@@ -56,7 +64,7 @@ static bool equal_sets(CoinSet a, CoinSet b)
 BOOST_AUTO_TEST_CASE(coin_selection_tests)
 {
     static CoinSet setCoinsRet, setCoinsRet2;
-    static int64 nValueRet;
+    static int64_t nValueRet;
 
     // test multiple times to allow for differences in the shuffle order
     for (int i = 0; i < RUN_TESTS; i++)
@@ -64,24 +72,24 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         empty_wallet();
 
         // with an empty wallet we can't even pay one cent
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet));
 
         add_coin(1*CENT, 4);        // add a new 1 cent coin
 
         // with a new 1 cent coin, we still can't find a mature 1 cent
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet));
 
         // but we can find a new 1 cent
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
 
         add_coin(2*CENT);           // add a mature 2 cent coin
 
         // we can't make 3 cents of mature coins
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 3 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf(3 * CENT, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet));
 
         // we can make 3 cents of new  coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 3 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(3 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 3 * CENT);
 
         add_coin(5*CENT);           // add a mature 5 cent coin,
@@ -91,33 +99,33 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         // now we have new: 1+10=11 (of which 10 was self-sent), and mature: 2+5+20=27.  total = 38
 
         // we can't make 38 cents only if we disallow new coins:
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet));
         // we can't even make 37 cents if we don't allow new coins even if they're from us
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 6, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, nSpendTime, 6, 6, vCoins, setCoinsRet, nValueRet));
         // but we can make 37 cents if we accept new coins from ourself
-        BOOST_CHECK( wallet.SelectCoinsMinConf(37 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(37 * CENT, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 37 * CENT);
         // and we can make 38 cents if we accept all new coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf(38 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(38 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 38 * CENT);
 
         // try making 34 cents from 1,2,5,10,20 - we can't do it exactly
-        BOOST_CHECK( wallet.SelectCoinsMinConf(34 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(34 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_GT(nValueRet, 34 * CENT);         // but should get more than 34 cents
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);     // the best should be 20+10+5.  it's incredibly unlikely the 1 or 2 got included (but possible)
 
         // when we try making 7 cents, the smaller coins (1,2,5) are enough.  We should see just 2+5
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 7 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(7 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 7 * CENT);
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
 
         // when we try making 8 cents, the smaller coins (1,2,5) are exactly enough.
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 8 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(8 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK(nValueRet == 8 * CENT);
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
 
         // when we try making 9 cents, no subset of smaller coins is enough, and we get the next bigger coin (10)
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 9 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(9 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
@@ -131,30 +139,30 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(30*CENT); // now we have 6+7+8+20+30 = 71 cents total
 
         // check that we have 71 and not 72
-        BOOST_CHECK( wallet.SelectCoinsMinConf(71 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(72 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(71 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf(72 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
 
         // now try making 16 cents.  the best smaller coins can do is 6+7+8 = 21; not as good at the next biggest coin, 20
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 20 * CENT); // we should get 20 in one coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
         add_coin( 5*CENT); // now we have 5+6+7+8+20+30 = 75 cents total
 
         // now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, better than the next biggest coin, 20
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 18 * CENT); // we should get 18 in 3 coins
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
 
         add_coin( 18*CENT); // now we have 5+6+7+8+18+20+30
 
         // and now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, the same as the next biggest coin, 18
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 18 * CENT);  // we should get 18 in 1 coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1); // because in the event of a tie, the biggest coin wins
 
         // now try making 11 cents.  we should get 5+6
-        BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 11 * CENT);
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
 
@@ -163,11 +171,11 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin( 2*COIN);
         add_coin( 3*COIN);
         add_coin( 4*COIN); // now we have 5+6+7+8+18+20+30+100+200+300+400 = 1094 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(95 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(95 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * COIN);  // we should get 1 BTC in 1 coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
-        BOOST_CHECK( wallet.SelectCoinsMinConf(195 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(195 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 2 * COIN);  // we should get 2 BTC in 1 coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
@@ -181,14 +189,14 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
 
         // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 = 1.5 cents
         // we'll get sub-cent change whatever happens, so can expect 1.0 exactly
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
 
         // but if we add a bigger coin, making it possible to avoid sub-cent change, things change:
         add_coin(1111*CENT);
 
         // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 + 1111 = 1112.5 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
 
         // if we add more sub-cent coins:
@@ -196,7 +204,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(0.7*CENT);
 
         // and try again to make 1.0 cents, we can still make 1.0 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
 
         // run the 'mtgox' test (see http://blockexplorer.com/tx/29a3efd3ef04f9153d47a990bd7b048a4b2d213daaa5fb8ed670fb85f13bdbcf)
@@ -205,7 +213,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         for (int i = 0; i < 20; i++)
             add_coin(50000 * COIN);
 
-        BOOST_CHECK( wallet.SelectCoinsMinConf(500000 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(500000 * COIN, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 500000 * COIN); // we should get the exact amount
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 10); // in ten coins
 
@@ -218,7 +226,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(0.6 * CENT);
         add_coin(0.7 * CENT);
         add_coin(1111 * CENT);
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1111 * CENT); // we get the bigger coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
@@ -228,7 +236,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(0.6 * CENT);
         add_coin(0.8 * CENT);
         add_coin(1111 * CENT);
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);   // we should get the exact amount
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2); // in two coins 0.4+0.6
 
@@ -239,12 +247,12 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(1 * COIN);
 
         // trying to make 1.0001 from these three coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1.0001 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1.0001 * COIN, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1.0105 * COIN);   // we should get all coins
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
 
         // but if we try to make 0.999, we should take the bigger of the two small coins to avoid sub-cent change
-        BOOST_CHECK( wallet.SelectCoinsMinConf(0.999 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(0.999 * COIN, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1.01 * COIN);   // we should get 1 + 0.01
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
 
@@ -254,10 +262,10 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
             for (int i2 = 0; i2 < 100; i2++)
                 add_coin(COIN);
 
-            // picking 50 from 100 coins doesn't depend on the shuffle,
-            // but does depend on randomness in the stochastic approximation code
-            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
-            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
+            // picking 50 from 100 identical coins is an exact match for the
+            // branch and bound search, which takes them in shuffled order
+            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, nSpendTime, 1, 6, vCoins, setCoinsRet , nValueRet));
+            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, nSpendTime, 1, 6, vCoins, setCoinsRet2, nValueRet));
             BOOST_CHECK(!equal_sets(setCoinsRet, setCoinsRet2));
 
             int fails = 0;
@@ -265,8 +273,8 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
             {
                 // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
                 // run the test RANDOM_REPEATS times and only complain if all of them fail
-                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
-                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
+                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, nSpendTime, 1, 6, vCoins, setCoinsRet , nValueRet));
+                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, nSpendTime, 1, 6, vCoins, setCoinsRet2, nValueRet));
                 if (equal_sets(setCoinsRet, setCoinsRet2))
                     fails++;
             }
@@ -282,8 +290,8 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
             {
                 // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
                 // run the test RANDOM_REPEATS times and only complain if all of them fail
-                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet , nValueRet));
-                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet2, nValueRet));
+                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, nSpendTime, 1, 6, vCoins, setCoinsRet , nValueRet));
+                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, nSpendTime, 1, 6, vCoins, setCoinsRet2, nValueRet));
                 if (equal_sets(setCoinsRet, setCoinsRet2))
                     fails++;
             }
@@ -292,4 +300,179 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_bnb)
+{
+    vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vValue;
+    vector<char> vfBest;
+    int64_t nBest;
+    for (int i = 5; i >= 2; i--)
+        vValue.push_back(make_pair(i * CENT, make_pair((const CWalletTx*)NULL, (unsigned int)i)));
+
+    // 7 from 5,4,3,2: two inputs beat three
+    BOOST_CHECK(SelectCoinsBnB(vValue, 7 * CENT, 0, 100, vfBest, nBest));
+    BOOST_CHECK_EQUAL(nBest, 7 * CENT);
+    BOOST_CHECK_EQUAL(count(vfBest.begin(), vfBest.end(), true), 2);
+
+    // More than all of them can't be paid, all of them can
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 15 * CENT, CENT, 100, vfBest, nBest));
+    BOOST_CHECK(SelectCoinsBnB(vValue, 13 * CENT + 1, CENT, 100, vfBest, nBest));
+    BOOST_CHECK_EQUAL(nBest, 14 * CENT);
+
+    // An excess up to the cost of change is fine, more needs change
+    BOOST_CHECK(SelectCoinsBnB(vValue, 6 * CENT - 50, 100, 10, vfBest, nBest));
+    BOOST_CHECK_EQUAL(nBest, 6 * CENT);
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 6 * CENT - 101, 100, 10, vfBest, nBest));
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_bnb_exhaustive)
+{
+    // Against trying every subset of a few coins: the search finds a
+    // changeless subset whenever there is one, and the one wasting least
+    for (int nRound = 0; nRound < 300; nRound++)
+    {
+        int nCoins = 1 + GetRandInt(12);
+        vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vValue;
+        for (int i = 0; i < nCoins; i++)
+            vValue.push_back(make_pair((1 + GetRandInt(20)) * CENT / 4, make_pair((const CWalletTx*)NULL, (unsigned int)i)));
+        sort(vValue.rbegin(), vValue.rend());
+        int64_t nTarget = 1 + GetRand(nCoins * 5 * CENT);
+        int64_t nCostOfChange = GetRand(CENT / 2);
+        int64_t nInputCost = GetRand(CENT / 20);
+
+        int64_t nWasteExpected = -1;
+        for (unsigned int nMask = 1; nMask < (1U << nCoins); nMask++)
+        {
+            int64_t nTotal = 0, nInputs = 0;
+            for (int i = 0; i < nCoins; i++)
+                if (nMask & (1U << i))
+                {
+                    nTotal += vValue[i].first;
+                    nInputs++;
+                }
+            if (nTotal < nTarget || nTotal > nTarget + nCostOfChange)
+                continue;
+            int64_t nWaste = nTotal - nTarget + nInputs * nInputCost;
+            if (nWasteExpected < 0 || nWaste < nWasteExpected)
+                nWasteExpected = nWaste;
+        }
+
+        vector<char> vfBest;
+        int64_t nBest;
+        bool fFound = SelectCoinsBnB(vValue, nTarget, nCostOfChange, nInputCost, vfBest, nBest);
+        BOOST_CHECK_EQUAL(fFound, nWasteExpected >= 0);
+        if (fFound)
+        {
+            int64_t nTotal = 0, nInputs = 0;
+            for (int i = 0; i < nCoins; i++)
+                if (vfBest[i])
+                {
+                    nTotal += vValue[i].first;
+                    nInputs++;
+                }
+            BOOST_CHECK_EQUAL(nTotal, nBest);
+            BOOST_CHECK_EQUAL(nTotal - nTarget + nInputs * nInputCost, nWasteExpected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_distributions)
+{
+    // Large wallets of dust-heavy, staking-heavy and uniform values: every
+    // payment is covered and reports what it selected
+    static CoinSet setCoinsRet;
+    static int64_t nValueRet;
+    static const int nCoins = 2000, nTargets = 20;
+
+    for (int nDist = 0; nDist < 3; nDist++)
+    {
+        empty_wallet();
+        int64_t nTotal = 0;
+        for (int i = 0; i < nCoins; i++)
+        {
+            int64_t nValue;
+            if (nDist == 0)
+                nValue = (i % 10) ? CENT / 10 + GetRand(CENT) : CENT + GetRand(100 * COIN);
+            else if (nDist == 1)
+                nValue = (i % 10) ? nStakeCombineThreshold / 2 + GetRand(nStakeCombineThreshold / 2) : COIN + GetRand(10 * COIN);
+            else
+                nValue = 1 + GetRand(100 * COIN);
+            add_coin(nValue);
+            nTotal += nValue;
+        }
+
+        for (int i = 0; i < nTargets; i++)
+        {
+            int64_t nTarget = 1 + GetRand(nTotal / 4);
+            BOOST_CHECK(wallet.SelectCoinsMinConf(nTarget, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet));
+            BOOST_CHECK(nValueRet >= nTarget);
+            int64_t nSelected = 0;
+            BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& coin, setCoinsRet)
+                nSelected += coin.first->vout[coin.second].nValue;
+            BOOST_CHECK_EQUAL(nSelected, nValueRet);
+        }
+    }
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(uint128_arithmetic)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t a = GetRand(std::numeric_limits<uint64_t>::max());
+        uint64_t b = GetRand(std::numeric_limits<uint64_t>::max() >> GetRandInt(64));
+        uint64_t c = GetRand(std::numeric_limits<uint64_t>::max() >> 1) + 1;
+        CUint128 n = CUint128::Mul(a, b);
+        CBigNum bn = (CBigNum(a) * CBigNum(b));
+        BOOST_CHECK((CBigNum(n.nHigh) << 64) + CBigNum(n.nLow) == bn);
+        CBigNum bnQuot = bn / CBigNum(c);
+        if (bnQuot <= CBigNum(std::numeric_limits<uint64_t>::max()))
+            BOOST_CHECK_EQUAL(n.Div(c), bnQuot.getuint64());
+        n -= CUint128::Mul(a, b);
+        BOOST_CHECK(n.nHigh == 0 && n.nLow == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_weight)
+{
+    unsigned int nSavedMaxAge = nStakeMaxAge;
+    nStakeMaxAge = 30 * 24 * 60 * 60;
+    int64_t nNow = GetTime();
+
+    // Whole coins and whole days, so summing before dividing loses nothing
+    vector<pair<int64_t, int64_t> > vCoin;
+    for (int i = 0; i < 100; i++)
+        vCoin.push_back(make_pair(nNow - nStakeMinAge - GetRandInt(40) * 24 * 60 * 60, (1 + GetRandInt(1000)) * COIN));
+    vCoin.push_back(make_pair(nNow, 500 * COIN));
+
+    CStakeWeight stakeWeight;
+    for (unsigned int i = 0; i < vCoin.size(); i++)
+        stakeWeight.Add(vCoin[i].first, vCoin[i].second);
+
+    // Across a day, so coins cross the max age between the reads
+    for (int64_t nTime = nNow; nTime <= nNow + 24 * 60 * 60; nTime += 6 * 60 * 60)
+    {
+        uint64_t nMinExpected = 0, nMaxExpected = 0;
+        for (unsigned int i = 0; i < vCoin.size(); i++)
+        {
+            int64_t nTimeWeight = GetWeight(vCoin[i].first, nTime);
+            CBigNum bnCoinDays = CBigNum(vCoin[i].second) * nTimeWeight / COIN / (24 * 60 * 60);
+            uint64_t nCoinDays = bnCoinDays.getuint64();
+            if (nTimeWeight > 0 && nTimeWeight < nStakeMaxAge)
+                nMinExpected += nCoinDays;
+            else if (nTimeWeight == nStakeMaxAge)
+                nMaxExpected += nCoinDays;
+        }
+        uint64_t nMinWeight = 0, nMaxWeight = 0, nWeight = 0;
+        stakeWeight.Get(nTime, nMinWeight, nMaxWeight, nWeight);
+        if (nTime % (24 * 60 * 60) == nNow % (24 * 60 * 60))
+            BOOST_CHECK_EQUAL(nMinWeight, nMinExpected);
+        else
+            BOOST_CHECK(nMinWeight >= nMinExpected && nMinWeight <= nMinExpected + vCoin.size());
+        BOOST_CHECK_EQUAL(nMaxWeight, nMaxExpected);
+        BOOST_CHECK_EQUAL(nWeight, nMinWeight + nMaxWeight);
+    }
+
+    nStakeMaxAge = nSavedMaxAge;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
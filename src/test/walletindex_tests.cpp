@@ -0,0 +1,67 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "wallet.h"
+
+extern CWallet* pwalletMain;
+
+static bool HaveCoin(const uint256& hash, unsigned int n)
+{
+    std::vector<COutput> vCoins;
+    pwalletMain->AvailableCoins(vCoins, false);
+    BOOST_FOREACH(const COutput& out, vCoins)
+        if (out.tx->GetHash() == hash && out.i == (int)n)
+            return true;
+    return false;
+}
+
+BOOST_AUTO_TEST_SUITE(walletindex_tests)
+
+BOOST_AUTO_TEST_CASE(unspent_index)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->AddKey(key));
+    CScript scriptMine;
+    scriptMine.SetDestination(key.GetPubKey().GetID());
+    int64_t nUnconfirmed = pwalletMain->GetUnconfirmedBalance();
+    int64_t nBalance = pwalletMain->GetBalance();
+
+    // Only the output paying us is indexed
+    CTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFund.vout.resize(2);
+    txFund.vout[0].nValue = 3 * COIN;
+    txFund.vout[0].scriptPubKey = scriptMine;
+    txFund.vout[1].nValue = 5 * COIN;
+    txFund.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    uint256 hashFund = txFund.GetHash();
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txFund)));
+    BOOST_CHECK(HaveCoin(hashFund, 0));
+    BOOST_CHECK(!HaveCoin(hashFund, 1));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 3 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance);
+
+    // Spending it takes it out again
+    CTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(hashFund, 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = COIN;
+    txSpend.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    BOOST_CHECK(pwalletMain->AddToWalletIfInvolvingMe(txSpend, NULL));
+    BOOST_CHECK(!HaveCoin(hashFund, 0));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+
+    // A full rebuild agrees with the incremental updates
+    pwalletMain->MarkDirty();
+    BOOST_CHECK(!HaveCoin(hashFund, 0));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+
+    BOOST_CHECK(pwalletMain->EraseFromWallet(txSpend.GetHash()));
+    BOOST_CHECK(pwalletMain->EraseFromWallet(hashFund));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,225 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "main.h"
+#include "wallet.h"
+
+// Tests this internal-to-wallet.cpp method:
+extern bool MayPayWallet(const CScript& script, const std::set<uint160>& setID);
+extern CBigNum bnProofOfStakeLimit;
+
+static std::set<uint160> GetIDs(const CBasicKeyStore& keystore)
+{
+    std::set<uint160> setID;
+    std::set<CKeyID> setKeyID;
+    keystore.GetKeys(setKeyID);
+    BOOST_FOREACH(const CKeyID& keyID, setKeyID)
+        setID.insert(keyID);
+    std::set<CScriptID> setScriptID;
+    keystore.GetCScripts(setScriptID);
+    BOOST_FOREACH(const CScriptID& scriptID, setScriptID)
+        setID.insert(scriptID);
+    return setID;
+}
+
+static CScript PayTo(const CKey& key)
+{
+    CScript script;
+    script.SetDestination(key.GetPubKey().GetID());
+    return script;
+}
+
+static CTransaction Spend(const COutPoint& prevout, const CScript& scriptPubKey, unsigned int nTime)
+{
+    CTransaction tx;
+    tx.nTime = nTime;
+    tx.vin.push_back(CTxIn(prevout));
+    tx.vout.push_back(CTxOut(COIN, scriptPubKey));
+    return tx;
+}
+
+// Proof-of-stake blocks, so they read back without proof of work, written
+// to the block file and indexed off the main chain from vIndex[0] on
+class CRescanTestChain
+{
+public:
+    std::vector<CBlockIndex*> vIndex;
+    std::vector<uint256*> vHash;
+
+    ~CRescanTestChain()
+    {
+        for (unsigned int i = 0; i < vIndex.size(); i++)
+        {
+            delete vIndex[i];
+            delete vHash[i];
+        }
+    }
+
+    void Add(unsigned int nTime, const std::vector<CTransaction>& vtx)
+    {
+        CBlock block;
+        block.hashPrevBlock = vIndex.empty() ? pindexGenesisBlock->GetBlockHash() : *vHash.back();
+        block.nTime = nTime;
+        block.nBits = bnProofOfStakeLimit.GetCompact();
+
+        CTransaction txCoinBase;
+        txCoinBase.nTime = nTime;
+        txCoinBase.vin.resize(1);
+        txCoinBase.vin[0].prevout.SetNull();
+        txCoinBase.vin[0].scriptSig = CScript() << (int)vIndex.size();
+        txCoinBase.vout.resize(1);
+        txCoinBase.vout[0].SetEmpty();
+        block.vtx.push_back(txCoinBase);
+
+        CTransaction txCoinStake;
+        txCoinStake.nTime = nTime;
+        txCoinStake.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+        txCoinStake.vout.resize(2);
+        txCoinStake.vout[0].SetEmpty();
+        txCoinStake.vout[1] = CTxOut(COIN, CScript() << OP_TRUE);
+        block.vtx.push_back(txCoinStake);
+
+        block.vtx.insert(block.vtx.end(), vtx.begin(), vtx.end());
+        block.hashMerkleRoot = block.BuildMerkleTree();
+
+        unsigned int nFile, nBlockPos;
+        BOOST_REQUIRE(block.WriteToDisk(nFile, nBlockPos));
+        CBlockIndex* pindex = new CBlockIndex(nFile, nBlockPos, block);
+        vHash.push_back(new uint256(block.GetHash()));
+        pindex->phashBlock = vHash.back();
+        pindex->pprev = vIndex.empty() ? pindexGenesisBlock : vIndex.back();
+        pindex->nHeight = pindex->pprev->nHeight + 1;
+        if (!vIndex.empty())
+            vIndex.back()->pnext = pindex;
+        vIndex.push_back(pindex);
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(walletrescan_tests)
+
+BOOST_AUTO_TEST_CASE(rescan_prefilter)
+{
+    // Every form of script IsMine takes must get past the prefilter
+    CBasicKeyStore keystore;
+    CKey keyCompressed, keyUncompressed, keyOther, keyScript;
+    keyCompressed.MakeNewKey(true);
+    keyUncompressed.MakeNewKey(false);
+    keyOther.MakeNewKey(true);
+    keyScript.MakeNewKey(true);
+    keystore.AddKey(keyCompressed);
+    keystore.AddKey(keyUncompressed);
+
+    CScript scriptRedeem = CScript() << keyScript.GetPubKey() << OP_CHECKSIG;
+    keystore.AddKey(keyScript);
+    keystore.AddCScript(scriptRedeem);
+
+    std::vector<CKey> vMultisig;
+    vMultisig.push_back(keyOther);
+    vMultisig.push_back(keyCompressed);
+    CScript scriptMultisig;
+    scriptMultisig.SetMultisig(1, vMultisig);
+    // IsMine wants every key of a bare multisig
+    CBasicKeyStore keystoreMultisig;
+    keystoreMultisig.AddKey(keyOther);
+    keystoreMultisig.AddKey(keyCompressed);
+
+    CScript scriptP2SH;
+    scriptP2SH.SetDestination(scriptRedeem.GetID());
+
+    std::vector<CScript> vScript;
+    vScript.push_back(CScript() << keyCompressed.GetPubKey() << OP_CHECKSIG);
+    vScript.push_back(CScript() << keyUncompressed.GetPubKey() << OP_CHECKSIG);
+    vScript.push_back(PayTo(keyCompressed));
+    vScript.push_back(PayTo(keyUncompressed));
+    vScript.push_back(scriptP2SH);
+    std::set<uint160> setID = GetIDs(keystore);
+    BOOST_FOREACH(const CScript& script, vScript)
+    {
+        BOOST_CHECK(IsMine(keystore, script));
+        BOOST_CHECK(MayPayWallet(script, setID));
+    }
+    BOOST_CHECK(IsMine(keystoreMultisig, scriptMultisig));
+    BOOST_CHECK(MayPayWallet(scriptMultisig, GetIDs(keystoreMultisig)));
+
+    // Scripts without our keys are passed over
+    BOOST_CHECK(!MayPayWallet(PayTo(keyOther), setID));
+    BOOST_CHECK(!MayPayWallet(CScript() << keyOther.GetPubKey() << OP_CHECKSIG, setID));
+    BOOST_CHECK(!MayPayWallet(CScript() << OP_TRUE, setID));
+    BOOST_CHECK(!MayPayWallet(CScript(), setID));
+}
+
+BOOST_AUTO_TEST_CASE(rescan_spend_chain)
+{
+    CWallet wallet;
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    BOOST_CHECK(wallet.AddKey(key));
+    wallet.nTimeFirstKey = 0;
+    unsigned int nTime = pindexGenesisBlock->nTime + 60;
+
+    // A pays us twice. B spends one output in the same block and C the
+    // other some chunks of blocks later; neither pays us.
+    CTransaction txA = Spend(COutPoint(GetRandHash(), 0), PayTo(key), nTime);
+    txA.vout.push_back(CTxOut(COIN, PayTo(key)));
+    CTransaction txB = Spend(COutPoint(txA.GetHash(), 0), PayTo(keyOther), nTime);
+    CTransaction txC = Spend(COutPoint(txA.GetHash(), 1), PayTo(keyOther), nTime);
+    CTransaction txUnrelated = Spend(COutPoint(GetRandHash(), 0), PayTo(keyOther), nTime);
+
+    CRescanTestChain chain;
+    std::vector<CTransaction> vtx;
+    vtx.push_back(txA);
+    vtx.push_back(txB);
+    chain.Add(nTime, vtx);
+    for (int i = 0; i < 150; i++)
+        chain.Add(nTime + 60 * (i + 1), std::vector<CTransaction>());
+    vtx.clear();
+    vtx.push_back(txUnrelated);
+    vtx.push_back(txC);
+    chain.Add(nTime + 60 * 200, vtx);
+
+    BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chain.vIndex[0]), 3);
+    BOOST_CHECK(wallet.mapWallet.count(txA.GetHash()));
+    BOOST_CHECK(wallet.mapWallet.count(txB.GetHash()));
+    BOOST_CHECK(wallet.mapWallet.count(txC.GetHash()));
+    BOOST_CHECK(!wallet.mapWallet.count(txUnrelated.GetHash()));
+
+    // Nothing new the second time round
+    BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chain.vIndex[0]), 0);
+}
+
+BOOST_AUTO_TEST_CASE(rescan_birth_time)
+{
+    CWallet wallet;
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(wallet.AddKey(key));
+    unsigned int nTime = pindexGenesisBlock->nTime + 60;
+
+    // Blocks an hour apart, each paying us
+    CRescanTestChain chain;
+    std::vector<uint256> vHashTx;
+    for (int i = 0; i < 6; i++)
+    {
+        std::vector<CTransaction> vtx;
+        vtx.push_back(Spend(COutPoint(GetRandHash(), 0), PayTo(key), nTime + 3600 * i));
+        vHashTx.push_back(vtx[0].GetHash());
+        chain.Add(nTime + 3600 * i, vtx);
+    }
+
+    // Keys born with block 4 start importprivkey's rescan two hours
+    // earlier, at block 2
+    int64_t nTimeBirth = chain.vIndex[4]->nTime;
+    CBlockIndex* pindexStart = FindRescanStart(chain.vIndex.back(), nTimeBirth);
+    BOOST_CHECK(pindexStart == chain.vIndex[2]);
+    BOOST_CHECK(FindRescanStart(chain.vIndex.back(), nTimeBirth + 3600) == chain.vIndex[3]);
+    BOOST_CHECK(FindRescanStart(chain.vIndex.back(), 1) == pindexGenesisBlock);
+
+    // and the scan itself passes over blocks older than that
+    wallet.nTimeFirstKey = nTimeBirth;
+    BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chain.vIndex[0]), 4);
+    for (int i = 0; i < 6; i++)
+        BOOST_CHECK_EQUAL(wallet.mapWallet.count(vHashTx[i]), (unsigned int)(i >= 2));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
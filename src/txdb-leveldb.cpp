@@ -4,6 +4,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file license.txt or http://www.opensource.org/licenses/mit-license.php.
 
+#include <deque>
 #include <map>
 
 #include <boost/version.hpp>
@@ -17,6 +18,7 @@
 
 #include "kernel.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "txdb.h"
 #include "util.h"
 #include "main.h"
@@ -98,8 +100,7 @@ CTxDB::CTxDB(const char* pszMode)
             // Leveldb instance destruction
             delete txdb;
             txdb = pdb = NULL;
-            delete activeBatch;
-            activeBatch = NULL;
+            TxnAbort();
 
             init_blockindex(options, true); // Remove directory and create new database
             pdb = txdb;
@@ -123,90 +124,415 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    FlushBatch();
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
     options.filter_policy = NULL;
     delete options.block_cache;
     options.block_cache = NULL;
-    delete activeBatch;
-    activeBatch = NULL;
+    TxnAbort();
+}
+
+unsigned int nDBBatchBlocks = 32;
+bool fDBSyncAll = false;
+
+// Guards the batch pool, the held back commits and the commits being
+// written, which outlive the CTxDB instances that produced them
+static CCriticalSection cs_batch;
+static std::vector<CTxDBBatch*> vBatchPool;
+static CTxDBBatch *pbatchGroup = NULL;
+static std::deque<CTxDBBatch*> vBatchWriting;
+
+// Held while writing to LevelDB, so commits reach it in order without
+// readers waiting on cs_batch for a sync
+static CCriticalSection cs_batchWrite;
+
+static CTxDBBatch *NewBatch()
+{
+    LOCK(cs_batch);
+    if (vBatchPool.empty())
+        return new CTxDBBatch();
+    CTxDBBatch *pbatch = vBatchPool.back();
+    vBatchPool.pop_back();
+    return pbatch;
+}
+
+static void ReleaseBatch(CTxDBBatch *pbatch)
+{
+    LOCK(cs_batch);
+    pbatch->Clear();
+    if (vBatchPool.size() < 2)
+        vBatchPool.push_back(pbatch);
+    else
+        delete pbatch;
+}
+
+size_t nTxCacheSize = 32 * 1048576;
+
+/** Committed transaction index entries and the outputs of the transactions
+ *  they point to, least recently used first out. Writes reach it when their
+ *  batch commits (even one held back), so it always shows what the database
+ *  will hold once pending commits are written.
+ */
+class CTxCache
+{
+private:
+    struct CEntry
+    {
+        CTxIndex txindex;
+        CTransaction tx;        // outputs of the transaction at txindex.pos, if fHaveTx
+        bool fHaveTx;
+        size_t nUsage;
+        std::list<uint256>::iterator itLRU;
+    };
+    typedef boost::unordered_map<uint256, CEntry, BlockHasher> EntryMap;
+
+    CCriticalSection cs;
+    EntryMap mapEntries;
+    std::list<uint256> lruEntries; // front is newest
+    size_t nUsage;
+    uint64_t nGeneration; // bumped by every committed write
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    static size_t Usage(const CEntry& entry)
+    {
+        // Rough heap footprint: node, list entry and the vectors' contents
+        size_t n = sizeof(CEntry) + sizeof(uint256) + 64;
+        n += entry.txindex.vSpent.capacity() * sizeof(CDiskTxPos);
+        if (entry.fHaveTx)
+        {
+            n += entry.tx.vin.capacity() * sizeof(CTxIn) + entry.tx.vout.capacity() * sizeof(CTxOut);
+            BOOST_FOREACH(const CTxOut& txout, entry.tx.vout)
+                n += txout.scriptPubKey.capacity();
+        }
+        return n;
+    }
+
+    void Touch(EntryMap::iterator mi)
+    {
+        lruEntries.splice(lruEntries.begin(), lruEntries, mi->second.itLRU);
+    }
+
+    void Resize(CEntry& entry)
+    {
+        nUsage -= entry.nUsage;
+        entry.nUsage = Usage(entry);
+        nUsage += entry.nUsage;
+        while (nUsage > nTxCacheSize && !lruEntries.empty())
+            EraseEntry(mapEntries.find(lruEntries.back()));
+    }
+
+    void EraseEntry(EntryMap::iterator mi)
+    {
+        nUsage -= mi->second.nUsage;
+        lruEntries.erase(mi->second.itLRU);
+        mapEntries.erase(mi);
+    }
+
+    EntryMap::iterator Insert(const uint256& hash, const CTxIndex& txindex)
+    {
+        EntryMap::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end())
+        {
+            mi = mapEntries.insert(make_pair(hash, CEntry())).first;
+            lruEntries.push_front(hash);
+            mi->second.itLRU = lruEntries.begin();
+            mi->second.fHaveTx = false;
+            mi->second.nUsage = 0;
+        }
+        else
+        {
+            Touch(mi);
+            // The same transaction in another block after a reorganisation
+            if (mi->second.fHaveTx && mi->second.txindex.pos != txindex.pos)
+            {
+                mi->second.tx.SetNull();
+                mi->second.fHaveTx = false;
+            }
+        }
+        mi->second.txindex = txindex;
+        return mi;
+    }
+
+public:
+    CTxCache() : nUsage(0), nGeneration(0), nHits(0), nMisses(0) {}
+
+    uint64_t GetGeneration()
+    {
+        LOCK(cs);
+        return nGeneration;
+    }
+
+    bool GetIndex(const uint256& hash, CTxIndex& txindex)
+    {
+        LOCK(cs);
+        EntryMap::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end())
+        {
+            nMisses++;
+            return false;
+        }
+        nHits++;
+        Touch(mi);
+        txindex = mi->second.txindex;
+        return true;
+    }
+
+    bool GetTx(const uint256& hash, const CDiskTxPos& pos, CTransaction& tx)
+    {
+        LOCK(cs);
+        EntryMap::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end() || !mi->second.fHaveTx || mi->second.txindex.pos != pos)
+        {
+            nMisses++;
+            return false;
+        }
+        nHits++;
+        Touch(mi);
+        tx = mi->second.tx;
+        return true;
+    }
+
+    // Fill in from a database read started at nGenerationRead; dropped if a
+    // commit got in between, as the read may predate it
+    void PutIndex(const uint256& hash, const CTxIndex& txindex, uint64_t nGenerationRead)
+    {
+        LOCK(cs);
+        if (nTxCacheSize == 0 || nGeneration != nGenerationRead)
+            return;
+        EntryMap::iterator mi = Insert(hash, txindex);
+        Resize(mi->second);
+    }
+
+    void PutTx(const uint256& hash, const CDiskTxPos& pos, const CTransaction& tx)
+    {
+        LOCK(cs);
+        EntryMap::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end() || mi->second.txindex.pos != pos)
+            return;
+        mi->second.tx = tx;
+        mi->second.fHaveTx = true;
+        Resize(mi->second);
+    }
+
+    // Take over the transaction index writes of a committed batch
+    void Commit(const CTxDBBatch& batch)
+    {
+        if (batch.mapTxIndex.empty())
+            return;
+        LOCK(cs);
+        nGeneration++;
+        for (std::map<uint256, std::pair<bool, CTxIndex> >::const_iterator it = batch.mapTxIndex.begin(); it != batch.mapTxIndex.end(); ++it)
+        {
+            if (it->second.first || nTxCacheSize == 0)
+            {
+                EntryMap::iterator mi = mapEntries.find(it->first);
+                if (mi != mapEntries.end())
+                    EraseEntry(mi);
+                continue;
+            }
+            EntryMap::iterator mi = Insert(it->first, it->second.second);
+            Resize(mi->second);
+        }
+    }
+
+    void GetStats(uint64_t& nHitsRet, uint64_t& nMissesRet, size_t& nUsageRet)
+    {
+        LOCK(cs);
+        nHitsRet = nHits;
+        nMissesRet = nMisses;
+        nUsageRet = nUsage;
+    }
+};
+
+static CTxCache txcache;
+
+void GetTxCacheStats(uint64_t& nHits, uint64_t& nMisses, size_t& nUsage)
+{
+    txcache.GetStats(nHits, nMisses, nUsage);
 }
 
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
-    activeBatch = new leveldb::WriteBatch();
+    activeBatch = NewBatch();
     return true;
 }
 
-bool CTxDB::TxnCommit()
+bool CTxDB::TxnAbort()
 {
-    assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
-    delete activeBatch;
+    if (activeBatch)
+        ReleaseBatch(activeBatch);
     activeBatch = NULL;
-    if (!status.ok()) {
-        printf("LevelDB batch commit failure: %s\n", status.ToString().c_str());
-        return false;
-    }
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
+bool CTxDB::TxnCommit(bool fGroup)
+{
+    assert(activeBatch);
+    CTxDBBatch *pbatch = activeBatch;
+    activeBatch = NULL;
+
+    {
+        LOCK(cs_batch);
+        txcache.Commit(*pbatch);
+        if (pbatchGroup)
+        {
+            pbatchGroup->Append(*pbatch);
+            ReleaseBatch(pbatch);
+            pbatch = pbatchGroup;
+            pbatchGroup = NULL;
         }
+        if (fGroup && pbatch->nTipUpdates < nDBBatchBlocks)
+        {
+            pbatchGroup = pbatch;
+            return true;
+        }
+        vBatchWriting.push_back(pbatch);
+    }
+    return WritePending();
+}
+
+bool CTxDB::FlushBatch()
+{
+    {
+        LOCK(cs_batch);
+        if (pbatchGroup)
+            vBatchWriting.push_back(pbatchGroup);
+        pbatchGroup = NULL;
     }
+    return WritePending();
+}
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
+// Write out the queued commits, oldest first. Each stays visible to
+// ScanBatch until LevelDB has it, and the write itself happens without
+// cs_batch held.
+bool CTxDB::WritePending()
+{
+    LOCK(cs_batchWrite);
+    bool fOk = true;
+    while (true)
+    {
+        CTxDBBatch *pbatch;
+        {
+            LOCK(cs_batch);
+            if (vBatchWriting.empty())
+                break;
+            pbatch = vBatchWriting.front();
+        }
+        if (!CommitBatch(pbatch))
+            fOk = false;
+        {
+            LOCK(cs_batch);
+            vBatchWriting.pop_front();
+            ReleaseBatch(pbatch);
         }
     }
-};
+    return fOk;
+}
 
-// When performing a read, if we have an active batch we need to check it first
-// before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
-bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
-    *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
+bool CTxDB::CommitBatch(CTxDBBatch *pbatch)
+{
+    // Called with cs_batchWrite held, so one WriteBatch buffer serves every commit
+    static leveldb::WriteBatch batch;
+    int64_t nStart = GetTimeMicros();
+
+    batch.Clear();
+    for (CTxDBBatch::WriteMap::const_iterator mi = pbatch->mapWrites.begin(); mi != pbatch->mapWrites.end(); ++mi)
+    {
+        if (mi->second.first)
+            batch.Delete(mi->first);
+        else
+            batch.Put(mi->first, mi->second.second);
+    }
+
+    // A commit that moves the chain tip is synced unless -dbsyncall asks
+    // for every commit to be
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = fDBSyncAll || pbatch->nTipUpdates > 0;
+    leveldb::Status status = pdb->Write(writeOptions, &batch);
     if (!status.ok()) {
-        throw runtime_error(status.ToString());
+        printf("LevelDB batch commit failure: %s\n", status.ToString().c_str());
+        return false;
     }
-    return scanner.foundEntry;
+    if (fBenchmark)
+        printf("- LevelDB commit: %u blocks, %"PRIszu" keys%s: %.2fms\n",
+               pbatch->nTipUpdates, pbatch->mapWrites.size(),
+               writeOptions.sync ? " (sync)" : "", (GetTimeMicros() - nStart) * 0.001);
+    return true;
+}
+
+// When performing a read, if we have an active batch or held back commits we
+// need to check them first before reading from the database, as the rest of
+// the code assumes that once a database transaction begins reads are
+// consistent with it.
+bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
+    *deleted = false;
+    string strKey = key.str();
+    if (activeBatch && activeBatch->Find(strKey, value, deleted))
+        return true;
+    LOCK(cs_batch);
+    if (pbatchGroup && pbatchGroup->Find(strKey, value, deleted))
+        return true;
+    for (std::deque<CTxDBBatch*>::const_reverse_iterator it = vBatchWriting.rbegin(); it != vBatchWriting.rend(); ++it)
+        if ((*it)->Find(strKey, value, deleted))
+            return true;
+    return false;
+}
+
+// Keep the typed copy of a transaction index write. Outside a transaction
+// the write goes to disk at once and the cache takes it over right away.
+static void NoteTxIndexWrite(CTxDBBatch *pbatch, const uint256& hash, const CTxIndex* ptxindex)
+{
+    CTxDBBatch batch;
+    CTxDBBatch& target = pbatch ? *pbatch : batch;
+    target.mapTxIndex[hash] = ptxindex ? make_pair(false, *ptxindex) : make_pair(true, CTxIndex());
+    if (!pbatch)
+        txcache.Commit(batch);
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
+    if (activeBatch)
+    {
+        std::map<uint256, std::pair<bool, CTxIndex> >::iterator mi = activeBatch->mapTxIndex.find(hash);
+        if (mi != activeBatch->mapTxIndex.end())
+        {
+            txindex = mi->second.second;
+            return !mi->second.first;
+        }
+    }
+    if (txcache.GetIndex(hash, txindex))
+        return true;
+
+    uint64_t nGeneration = txcache.GetGeneration();
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+    if (!Read(make_pair(string("tx"), hash), txindex))
+        return false;
+    txcache.PutIndex(hash, txindex, nGeneration);
+    return true;
+}
+
+bool CTxDB::ReadTxOutputs(uint256 hash, const CDiskTxPos& pos, CTransaction& tx)
+{
+    assert(!fClient);
+    if (txcache.GetTx(hash, pos, tx))
+        return true;
+    if (!tx.ReadFromDisk(pos))
+        return false;
+    BOOST_FOREACH(CTxIn& txin, tx.vin)
+        txin.scriptSig.clear();
+    txcache.PutTx(hash, pos, tx);
+    return true;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
+    NoteTxIndexWrite(activeBatch, hash, &txindex);
     return Write(make_pair(string("tx"), hash), txindex);
 }
 
@@ -217,6 +543,7 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
+    NoteTxIndexWrite(activeBatch, hash, &txindex);
     return Write(make_pair(string("tx"), hash), txindex);
 }
 
@@ -225,12 +552,16 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
+    NoteTxIndexWrite(activeBatch, hash, NULL);
     return Erase(make_pair(string("tx"), hash));
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
+    CTxIndex txindex;
+    if (!activeBatch && txcache.GetIndex(hash, txindex))
+        return true;
     return Exists(make_pair(string("tx"), hash));
 }
 
@@ -272,6 +603,8 @@ bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 
 bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
 {
+    if (activeBatch)
+        activeBatch->nTipUpdates++;
     return Write(string("hashBestChain"), hashBestChain);
 }
 
@@ -311,7 +644,7 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
@@ -325,6 +658,86 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+// Block index records are read in chunks; hashing of one chunk overlaps
+// with decoding of the next.
+static const size_t BLOCKINDEX_CHUNK_SIZE = 4096;
+// Don't split a chunk's hashing finer than this per thread
+static const size_t BLOCKINDEX_MIN_HASH_BATCH = 256;
+
+struct CBlockIndexChunk
+{
+    vector<CDiskBlockIndex> vDiskIndex;
+    vector<uint256> vBlockHash;
+    vector<size_t> vToHash;
+};
+
+// Decode up to BLOCKINDEX_CHUNK_SIZE block index records straight from the
+// iterator's slices. Returns false once there is nothing more to read.
+static bool ReadBlockIndexChunk(leveldb::Iterator* iterator, CBlockIndexChunk& chunk)
+{
+    while (iterator->Valid() && chunk.vDiskIndex.size() < BLOCKINDEX_CHUNK_SIZE)
+    {
+        leveldb::Slice slKey = iterator->key();
+        CByteReader ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        string strType;
+        ssKey >> strType;
+        // Did we reach the end of the data to read?
+        if (fRequestShutdown || strType != "blockindex")
+            return false;
+        leveldb::Slice slValue = iterator->value();
+        CByteReader ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        chunk.vDiskIndex.push_back(CDiskBlockIndex());
+        ssValue >> chunk.vDiskIndex.back();
+        iterator->Next();
+    }
+    return iterator->Valid();
+}
+
+// Worker: hash the headers chunk.vToHash[nBegin, nEnd) into chunk.vBlockHash
+static void HashBlockIndexChunk(CBlockIndexChunk* pchunk, size_t nBegin, size_t nEnd, CHash9BatchStats* pstats)
+{
+    static const size_t nHeaderSize = 80;
+    vector<unsigned char> vHeaders((nEnd - nBegin) * nHeaderSize);
+    for (size_t j = nBegin; j < nEnd; j++)
+    {
+        CBlock header = pchunk->vDiskIndex[pchunk->vToHash[j]].GetBlockHeader();
+        assert(END(header.nNonce) - BEGIN(header.nVersion) == (ptrdiff_t)nHeaderSize);
+        memcpy(&vHeaders[(j - nBegin) * nHeaderSize], BEGIN(header.nVersion), nHeaderSize);
+    }
+    vector<uint256> vHashed(nEnd - nBegin);
+    Hash9Batch(&vHeaders[0], nHeaderSize, nHeaderSize, nEnd - nBegin, &vHashed[0], pstats);
+    for (size_t j = nBegin; j < nEnd; j++)
+        pchunk->vBlockHash[pchunk->vToHash[j]] = vHashed[j - nBegin];
+}
+
+// A run of one chunk's headers for the hashing workers
+class CBlockIndexHashJob
+{
+private:
+    CBlockIndexChunk* pchunk;
+    size_t nBegin, nEnd;
+    CHash9BatchStats* pstats;
+
+public:
+    CBlockIndexHashJob() : pchunk(NULL), nBegin(0), nEnd(0), pstats(NULL) {}
+    CBlockIndexHashJob(CBlockIndexChunk* pchunkIn, size_t nBeginIn, size_t nEndIn, CHash9BatchStats* pstatsIn) :
+        pchunk(pchunkIn), nBegin(nBeginIn), nEnd(nEndIn), pstats(pstatsIn) {}
+
+    bool operator()()
+    {
+        HashBlockIndexChunk(pchunk, nBegin, nEnd, pstats);
+        return true;
+    }
+
+    void swap(CBlockIndexHashJob& job)
+    {
+        std::swap(pchunk, job.pchunk);
+        std::swap(nBegin, job.nBegin);
+        std::swap(nEnd, job.nEnd);
+        std::swap(pstats, job.pstats);
+    }
+};
+
 bool CTxDB::LoadBlockIndex()
 {
     if (mapBlockIndex.size() > 0) {
@@ -340,80 +753,139 @@ bool CTxDB::LoadBlockIndex()
     CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
     ssStartKey << make_pair(string("blockindex"), uint256(0));
     iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
-    {
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (fRequestShutdown || strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-        }
+    // Now read each entry. While worker threads hash the headers of one
+    // chunk, the next chunk is decoded from leveldb on this thread, which
+    // then helps finish the hashing.
+    int nHashThreads = max(nScriptCheckThreads, 1);
+    vector<CHash9BatchStats> vHashStats(nHashThreads);
+    CCheckQueuePool<CBlockIndexHashJob> hashPool(nHashThreads, 1);
+    CBlockIndexChunk vChunk[2];
+    int nCur = 0;
+    size_t nRecords = 0, nHashed = 0;
+    int64_t nDecodeMicros = 0, nHashMicros = 0, nLinkMicros = 0;
+
+    int64_t nStart = GetTimeMicros();
+    bool fMore = ReadBlockIndexChunk(iterator, vChunk[nCur]);
+    nDecodeMicros += GetTimeMicros() - nStart;
+    while (!vChunk[nCur].vDiskIndex.empty())
+    {
+        CBlockIndexChunk& chunk = vChunk[nCur];
+        CBlockIndexChunk& chunkNext = vChunk[1 - nCur];
 
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        // Hand the headers without a usable cached hash to the workers
+        chunk.vBlockHash.assign(chunk.vDiskIndex.size(), 0);
+        chunk.vToHash.clear();
+        for (size_t i = 0; i < chunk.vDiskIndex.size(); i++)
+        {
+            if (chunk.vDiskIndex[i].IsBlockHashCached())
+                chunk.vBlockHash[i] = chunk.vDiskIndex[i].GetBlockHash();
+            else
+                chunk.vToHash.push_back(i);
+        }
+        vector<CBlockIndexHashJob> vJobs;
+        size_t nPerThread = max((chunk.vToHash.size() + nHashThreads - 1) / nHashThreads, BLOCKINDEX_MIN_HASH_BATCH);
+        for (int i = 0; i < nHashThreads && i * nPerThread < chunk.vToHash.size(); i++)
+            vJobs.push_back(CBlockIndexHashJob(&chunk, i * nPerThread, min(chunk.vToHash.size(), (i + 1) * nPerThread),
+                                               fBenchmark ? &vHashStats[i] : NULL));
+        hashPool.queue.Add(vJobs);
+
+        nStart = GetTimeMicros();
+        chunkNext.vDiskIndex.clear();
+        if (fMore)
+            fMore = ReadBlockIndexChunk(iterator, chunkNext);
+        int64_t nJoinStart = GetTimeMicros();
+        nDecodeMicros += nJoinStart - nStart;
+        hashPool.queue.Wait();
+        nHashMicros += GetTimeMicros() - nJoinStart;
+
+        nStart = GetTimeMicros();
+        for (size_t i = 0; i < chunk.vDiskIndex.size(); i++)
+        {
+            const CDiskBlockIndex& diskindex = chunk.vDiskIndex[i];
+            uint256 blockHash = chunk.vBlockHash[i];
+
+            // Construct block index object
+            CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nBlockPos      = diskindex.nBlockPos;
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nMint          = diskindex.nMint;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nFlags         = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake   = diskindex.prevoutStake;
+            pindexNew->nStakeTime     = diskindex.nStakeTime;
+            pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+                pindexGenesisBlock = pindexNew;
+
+            if (!pindexNew->CheckIndex()) {
+                delete iterator;
+                return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+            }
 
-        iterator->Next();
+            // NovaCoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        }
+        nLinkMicros += GetTimeMicros() - nStart;
+        nRecords += chunk.vDiskIndex.size();
+        nHashed += chunk.vToHash.size();
+        nCur = 1 - nCur;
     }
     delete iterator;
 
+    if (fBenchmark && nHashed)
+    {
+        CHash9BatchStats hashstats;
+        BOOST_FOREACH(const CHash9BatchStats& stats, vHashStats)
+        {
+            for (int i = 0; i < HASH9_STAGES; i++)
+                hashstats.nStageMicros[i] += stats.nStageMicros[i];
+            hashstats.nHashes += stats.nHashes;
+        }
+        printf("LoadBlockIndex(): header hashing (per thread) %s\n", hashstats.ToString().c_str());
+    }
+
     if (fRequestShutdown)
         return true;
 
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
+    // Calculate nChainTrust. A block is always exactly one above its parent,
+    // so bucketing the index by height orders parents before children
+    // without a comparison sort.
+    nStart = GetTimeMicros();
+    vector<size_t> vHeightStart;
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        size_t nHeight = item.second->nHeight;
+        if (nHeight + 1 >= vHeightStart.size())
+            vHeightStart.resize(nHeight + 2, 0);
+        vHeightStart[nHeight + 1]++;
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    for (size_t i = 1; i < vHeightStart.size(); i++)
+        vHeightStart[i] += vHeightStart[i - 1];
+    vector<CBlockIndex*> vOrdered(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vOrdered[vHeightStart[item.second->nHeight]++] = item.second;
+    BOOST_FOREACH(CBlockIndex* pindex, vOrdered)
     {
-        CBlockIndex* pindex = item.second;
         pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
         // NovaCoin: calculate stake modifier checksum
         pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
     }
+    int64_t nTrustMicros = GetTimeMicros() - nStart;
+
+    printf("LoadBlockIndex(): %"PRIszu" records, %"PRIszu" headers hashed on %d threads: decode %.2fms, hash %.2fms, link %.2fms, trust %.2fms\n",
+      nRecords, nHashed, nHashThreads, 0.001 * nDecodeMicros, 0.001 * nHashMicros, 0.001 * nLinkMicros, 0.001 * nTrustMicros);
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -427,6 +899,24 @@ bool CTxDB::LoadBlockIndex()
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
+    UpdateBlockIndexByHeight(pindexBest);
+
+    if (fBenchmark)
+    {
+        // Time a lookup of every block in the best chain
+        int64_t nLookupStart = GetTimeMicros();
+        unsigned int nFound = 0;
+        for (int nHeight = 0; nHeight <= nBestHeight; nHeight++)
+            nFound += mapBlockIndex.count(*FindBlockByHeight(nHeight)->phashBlock);
+        int64_t nLookupMicros = GetTimeMicros() - nLookupStart;
+
+        size_t nEntries, nArenaBytes;
+        GetBlockIndexArenaStats(nEntries, nArenaBytes);
+        printf("LoadBlockIndex(): %"PRIszu" entries in %"PRIszu" buckets (load %.2f), arena %"PRIszu" KiB\n",
+          mapBlockIndex.size(), mapBlockIndex.bucket_count(), mapBlockIndex.load_factor(), nArenaBytes / 1024);
+        printf("LoadBlockIndex(): %u lookups in %.2fms (%.1fns/lookup)\n",
+          nFound, 0.001 * nLookupMicros, nFound ? 1000.0 * nLookupMicros / nFound : 0.0);
+    }
 
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s  date=%s\n",
       hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
@@ -450,6 +940,7 @@ bool CTxDB::LoadBlockIndex()
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
     printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+    nStart = GetTimeMicros();
     CBlockIndex* pindexFork = NULL;
     map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
@@ -557,6 +1048,7 @@ bool CTxDB::LoadBlockIndex()
             }
         }
     }
+    printf("LoadBlockIndex(): verify %.2fms\n", 0.001 * (GetTimeMicros() - nStart));
     if (pindexFork && !fRequestShutdown)
     {
         // Reorg back to the fork
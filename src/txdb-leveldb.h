@@ -13,9 +13,87 @@
 #include <string>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+extern unsigned int nDBBatchBlocks;
+extern bool fDBSyncAll;
+extern size_t nTxCacheSize;
+
+void GetTxCacheStats(uint64_t& nHits, uint64_t& nMisses, size_t& nUsage);
+
+// Writes and deletes queued for one LevelDB commit. Only the latest state of
+// every key is kept, hashed by key, so reads inside an open transaction cost
+// one lookup instead of a replay of the whole batch. Batches are recycled
+// between blocks, so the serialization streams and the table keep their
+// capacity.
+class CTxDBBatch
+{
+public:
+    typedef boost::unordered_map<std::string, std::pair<bool, std::string> > WriteMap; // key -> (deleted, value)
+
+    WriteMap mapWrites;
+    // Transaction index writes again, typed, so reads inside the transaction
+    // skip deserialisation and the transaction cache can take them over on
+    // commit. Not carried over by Append.
+    std::map<uint256, std::pair<bool, CTxIndex> > mapTxIndex; // hash -> (erased, txindex)
+    CDataStream ssKey;
+    CDataStream ssValue;
+    unsigned int nTipUpdates; // number of hashBestChain writes folded in
+
+    CTxDBBatch() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION), nTipUpdates(0)
+    {
+        ssKey.reserve(1000);
+        ssValue.reserve(10000);
+    }
+
+    void Put(const std::string& strKey, const std::string& strValue)
+    {
+        std::pair<bool, std::string>& entry = mapWrites[strKey];
+        entry.first = false;
+        entry.second = strValue;
+    }
+
+    void Delete(const std::string& strKey)
+    {
+        std::pair<bool, std::string>& entry = mapWrites[strKey];
+        entry.first = true;
+        entry.second.clear();
+    }
+
+    // Returns true if the batch holds the key, setting *pfDeleted and, for a
+    // write, *pstrValue.
+    bool Find(const std::string& strKey, std::string* pstrValue, bool* pfDeleted) const
+    {
+        WriteMap::const_iterator mi = mapWrites.find(strKey);
+        if (mi == mapWrites.end())
+            return false;
+        *pfDeleted = mi->second.first;
+        if (!*pfDeleted)
+            *pstrValue = mi->second.second;
+        return true;
+    }
+
+    // Fold a later batch into this one
+    void Append(const CTxDBBatch& batch)
+    {
+        for (WriteMap::const_iterator mi = batch.mapWrites.begin(); mi != batch.mapWrites.end(); ++mi)
+            mapWrites[mi->first] = mi->second;
+        nTipUpdates += batch.nTipUpdates;
+    }
+
+    void Clear()
+    {
+        mapWrites.clear();
+        mapTxIndex.clear();
+        ssKey.clear();
+        ssValue.clear();
+        nTipUpdates = 0;
+    }
+};
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -35,7 +113,7 @@ public:
     ~CTxDB() {
         // Note that this is not the same as Close() because it deletes only
         // data scoped to this TxDB object.
-        delete activeBatch;
+        TxnAbort();
     }
 
     // Destroys the underlying shared global state accessed by this TxDB.
@@ -46,17 +124,23 @@ private:
 
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
-    leveldb::WriteBatch *activeBatch;
+    CTxDBBatch *activeBatch;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
 
 protected:
-    // Returns true and sets (value,false) if activeBatch contains the given key
-    // or leaves value alone and sets deleted = true if activeBatch contains a
+    // Returns true and sets (value,false) if activeBatch, the commits held
+    // back during initial download or those being written contain the given
+    // key, or leaves value alone and sets deleted = true if they contain a
     // delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
+    // Write a finished batch to LevelDB
+    bool CommitBatch(CTxDBBatch *pbatch);
+    // Write the queued commits in order
+    bool WritePending();
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
@@ -65,15 +149,12 @@ protected:
         ssKey << key;
         std::string strValue;
 
-        bool readFromDb = true;
-        if (activeBatch) {
-            // First we must search for it in the currently pending set of
-            // changes to the db. If not found in the batch, go on to read disk.
-            bool deleted = false;
-            readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
-            if (deleted) {
-                return false;
-            }
+        // First we must search for it in the currently pending set of
+        // changes to the db. If not found in the batch, go on to read disk.
+        bool deleted = false;
+        bool readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
+        if (deleted) {
+            return false;
         }
         if (readFromDb) {
             leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
@@ -104,6 +185,15 @@ protected:
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
 
+        if (activeBatch) {
+            activeBatch->ssKey.clear();
+            activeBatch->ssKey << key;
+            activeBatch->ssValue.clear();
+            activeBatch->ssValue << value;
+            activeBatch->Put(activeBatch->ssKey.str(), activeBatch->ssValue.str());
+            return true;
+        }
+
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
@@ -111,10 +201,9 @@ protected:
         ssValue.reserve(10000);
         ssValue << value;
 
-        if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
-            return true;
-        }
+        // Don't let a direct write overtake held back commits
+        if (!FlushBatch())
+            return false;
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
         if (!status.ok()) {
             printf("LevelDB write failure: %s\n", status.ToString().c_str());
@@ -131,13 +220,18 @@ protected:
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
 
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
         if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
+            activeBatch->ssKey.clear();
+            activeBatch->ssKey << key;
+            activeBatch->Delete(activeBatch->ssKey.str());
             return true;
         }
+
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(1000);
+        ssKey << key;
+        if (!FlushBatch())
+            return false;
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
         return (status.ok() || status.IsNotFound());
     }
@@ -150,13 +244,9 @@ protected:
         ssKey << key;
         std::string unused;
 
-        if (activeBatch) {
-            bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
-        }
-
+        bool deleted;
+        if (ScanBatch(ssKey, &unused, &deleted))
+            return !deleted;
 
         leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
         return status.IsNotFound() == false;
@@ -165,13 +255,14 @@ protected:
 
 public:
     bool TxnBegin();
-    bool TxnCommit();
-    bool TxnAbort()
-    {
-        delete activeBatch;
-        activeBatch = NULL;
-        return true;
-    }
+    // With fGroup set (initial download) and -dbbatchblocks above one, the
+    // batch is held back and written together with the following commits,
+    // until -dbbatchblocks chain tip updates have piled up or a commit
+    // without fGroup arrives.
+    bool TxnCommit(bool fGroup = false);
+    bool TxnAbort();
+    // Write out commits held back by TxnCommit(true)
+    bool FlushBatch();
 
     bool ReadVersion(int& nVersion)
     {
@@ -185,6 +276,11 @@ public:
     }
 
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
+    // Read the transaction stored at pos for its outputs, through the
+    // transaction cache. Inputs keep their prevouts but not their scriptSigs,
+    // so the result is good for vout, nTime and IsCoinBase/IsCoinStake but
+    // must not be hashed.
+    bool ReadTxOutputs(uint256 hash, const CDiskTxPos& pos, CTransaction& tx);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
     bool EraseTxIndex(const CTransaction& tx);
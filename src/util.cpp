@@ -57,6 +57,7 @@ namespace boost {
 
 #ifndef WIN32
 #include <execinfo.h>
+#include <signal.h>
 #endif
 
 
@@ -199,6 +200,282 @@ uint256 GetRandHash()
 
 
 static FILE* fileout = NULL;
+set<string> setDebugCategories;
+
+bool LogAcceptCategory(const char* pszCategory)
+{
+    return fDebug || (pszCategory != NULL && setDebugCategories.count(pszCategory));
+}
+
+//
+// debug.log writer
+//
+// Callers format their message and hand it to a background writer through a
+// bounded lock-free multi-producer queue (Vyukov's array queue), so printf
+// never waits for the disk. The writer batches whatever has queued up into a
+// single write. Before the writer starts, after it stops, or if the queue is
+// full and the writer has gone away, lines are written synchronously instead.
+// Lines are formatted into a per-thread buffer and copied into their queue
+// slot, so a typical line costs no allocation. Slots are only freed once
+// written, so a crash handler can still write out what was queued.
+//
+struct CDebugLogSlot
+{
+    volatile size_t nSeq;
+    int64_t nTime;
+    size_t nSize;
+    string* pstrLong; // lines that don't fit in pch
+    char pch[240];
+};
+
+static const size_t DEBUGLOG_QUEUE_SIZE = 4096; // must be a power of two
+static CDebugLogSlot vDebugLogQueue[DEBUGLOG_QUEUE_SIZE];
+static volatile size_t nDebugLogTail = 0; // next slot producers claim
+static volatile size_t nDebugLogHead = 0; // next slot to drain, under DebugLogMutex()
+static volatile bool fDebugLogWriter = false;
+static volatile int nDebugLogFd = -1;     // fileno(fileout), for the crash handler
+
+// This routine may be called by global destructors during shutdown.
+// Since the order of destruction of static/global objects is undefined,
+// the mutex, condition and format buffers are allocated on the heap and
+// never freed.
+static boost::mutex& DebugLogMutex()
+{
+    static boost::mutex* mutexDebugLog = new boost::mutex();
+    return *mutexDebugLog;
+}
+
+static boost::condition_variable& DebugLogCondition()
+{
+    static boost::condition_variable* condDebugLog = new boost::condition_variable();
+    return *condDebugLog;
+}
+
+static boost::thread_specific_ptr<vector<char> >& DebugLogFormatBuffer()
+{
+    static boost::thread_specific_ptr<vector<char> >* pvchFormat = new boost::thread_specific_ptr<vector<char> >();
+    return *pvchFormat;
+}
+
+// Format into the calling thread's buffer, which keeps its capacity from
+// one line to the next. Returns the length of the line.
+static size_t DebugLogFormat(vector<char>& vch, const char* pszFormat, va_list ap)
+{
+    if (vch.size() < 1024)
+        vch.resize(1024);
+    while (true)
+    {
+        va_list arg_ptr;
+        va_copy(arg_ptr, ap);
+#ifdef WIN32
+        int ret = _vsnprintf(&vch[0], vch.size(), pszFormat, arg_ptr);
+#else
+        int ret = vsnprintf(&vch[0], vch.size(), pszFormat, arg_ptr);
+#endif
+        va_end(arg_ptr);
+        if (ret >= 0 && (size_t)ret < vch.size())
+            return ret;
+        vch.resize(ret >= 0 ? ret + 1 : vch.size() * 2);
+    }
+}
+
+static bool DebugLogPush(int64_t nTime, const char* pch, size_t nSize)
+{
+    size_t nPos = nDebugLogTail;
+    while (true)
+    {
+        CDebugLogSlot& slot = vDebugLogQueue[nPos & (DEBUGLOG_QUEUE_SIZE - 1)];
+        size_t nSeq = slot.nSeq;
+        __sync_synchronize();
+        ptrdiff_t nDiff = (ptrdiff_t)nSeq - (ptrdiff_t)nPos;
+        if (nDiff == 0)
+        {
+            if (__sync_bool_compare_and_swap(&nDebugLogTail, nPos, nPos + 1))
+            {
+                slot.nTime = nTime;
+                slot.nSize = nSize;
+                if (nSize <= sizeof(slot.pch))
+                {
+                    memcpy(slot.pch, pch, nSize);
+                    slot.pstrLong = NULL;
+                }
+                else
+                    slot.pstrLong = new string(pch, nSize);
+                __sync_synchronize();
+                slot.nSeq = nPos + 1;
+                return true;
+            }
+        }
+        else if (nDiff < 0)
+            return false; // full
+        nPos = nDebugLogTail;
+    }
+}
+
+static const char* DebugLogSlotData(const CDebugLogSlot& slot)
+{
+    return slot.pstrLong ? slot.pstrLong->data() : slot.pch;
+}
+
+// Hand the slots before nEnd back to producers; caller must hold
+// DebugLogMutex()
+static void DebugLogRelease(size_t nEnd)
+{
+    while (nDebugLogHead != nEnd)
+    {
+        CDebugLogSlot& slot = vDebugLogQueue[nDebugLogHead & (DEBUGLOG_QUEUE_SIZE - 1)];
+        delete slot.pstrLong;
+        slot.pstrLong = NULL;
+        __sync_synchronize();
+        slot.nSeq = nDebugLogHead + DEBUGLOG_QUEUE_SIZE;
+        nDebugLogHead++;
+    }
+}
+
+// Caller must hold DebugLogMutex()
+static void DebugLogAppend(string& strOut, int64_t nTime, const char* pch, size_t nSize)
+{
+    static bool fStartedNewLine = true;
+    if (nSize == 0)
+        return;
+    // Debug print useful for profiling
+    if (fLogTimestamps && fStartedNewLine)
+        strOut += DateTimeStrFormat("%x %H:%M:%S", nTime) + " ";
+    strOut.append(pch, nSize);
+    fStartedNewLine = (pch[nSize - 1] == '\n');
+}
+
+// Write out everything queued so far plus pchExtra; caller must hold
+// DebugLogMutex(). Returns false if there was nothing to write.
+static bool DebugLogWrite(const char* pchExtra = NULL, size_t nExtra = 0, int64_t nTimeExtra = 0)
+{
+    if (!fileout)
+    {
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        fileout = fopen(pathDebug.string().c_str(), "a");
+        nDebugLogFd = fileout ? fileno(fileout) : -1;
+    }
+
+    // reopen the log file, if requested
+    if (fileout && fReopenDebugLog) {
+        fReopenDebugLog = false;
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        if (freopen(pathDebug.string().c_str(), "a", fileout) == NULL)
+            fileout = NULL;
+        nDebugLogFd = fileout ? fileno(fileout) : -1;
+    }
+
+    static string strOut;
+    strOut.clear();
+    size_t nPos = nDebugLogHead;
+    while (true)
+    {
+        const CDebugLogSlot& slot = vDebugLogQueue[nPos & (DEBUGLOG_QUEUE_SIZE - 1)];
+        size_t nSeq = slot.nSeq;
+        __sync_synchronize();
+        if (nSeq != nPos + 1)
+            break;
+        DebugLogAppend(strOut, slot.nTime, DebugLogSlotData(slot), slot.nSize);
+        nPos++;
+    }
+    DebugLogAppend(strOut, nTimeExtra, pchExtra, nExtra);
+    if (fileout && !strOut.empty())
+    {
+        fwrite(strOut.data(), 1, strOut.size(), fileout);
+        fflush(fileout);
+    }
+
+    // Only now that they are written, so the crash handler still finds them
+    DebugLogRelease(nPos);
+    return !strOut.empty();
+}
+
+#ifndef WIN32
+// On a crash, write out what is still queued before the default action
+// kills the process. Only write() is used here, without the mutex, so a
+// line the writer is busy with may come out twice and without a timestamp.
+static void DebugLogCrashHandler(int nSignal)
+{
+    int fd = nDebugLogFd;
+    if (fd != -1)
+    {
+        for (size_t nPos = nDebugLogHead; nPos != nDebugLogTail; nPos++)
+        {
+            const CDebugLogSlot& slot = vDebugLogQueue[nPos & (DEBUGLOG_QUEUE_SIZE - 1)];
+            if (slot.nSeq != nPos + 1)
+                break;
+            if (write(fd, DebugLogSlotData(slot), slot.nSize) < 0)
+                break;
+        }
+    }
+    // SA_RESETHAND has put back the default action
+    raise(nSignal);
+}
+#endif
+
+static void ThreadDebugLogWriter(void* parg)
+{
+    RenameThread("XDECoin-log");
+    boost::unique_lock<boost::mutex> lock(DebugLogMutex());
+    while (fDebugLogWriter)
+    {
+        // Producers don't take the mutex to notify, so don't sleep forever
+        if (!DebugLogWrite())
+            DebugLogCondition().timed_wait(lock, boost::posix_time::milliseconds(100));
+    }
+    DebugLogWrite();
+}
+
+void FlushDebugLog()
+{
+    boost::mutex::scoped_lock scoped_lock(DebugLogMutex());
+    DebugLogWrite();
+}
+
+static void StopDebugLogWriter()
+{
+    fDebugLogWriter = false;
+    DebugLogCondition().notify_one();
+    FlushDebugLog();
+}
+
+void StartDebugLogWriter()
+{
+    if (fDebugLogWriter || fPrintToConsole || fPrintToDebugger)
+        return;
+    {
+        boost::mutex::scoped_lock scoped_lock(DebugLogMutex());
+        DebugLogWrite();
+        for (size_t nPos = nDebugLogTail; nPos < nDebugLogTail + DEBUGLOG_QUEUE_SIZE; nPos++)
+            vDebugLogQueue[nPos & (DEBUGLOG_QUEUE_SIZE - 1)].nSeq = nPos;
+        nDebugLogHead = nDebugLogTail;
+        fDebugLogWriter = true;
+    }
+    if (!NewThread(ThreadDebugLogWriter, NULL))
+    {
+        fDebugLogWriter = false;
+        return;
+    }
+    // Whatever is still queued goes out at exit()
+    atexit(StopDebugLogWriter);
+
+#ifndef WIN32
+    // ... or on a crash. Signals that already have a handler are left
+    // alone; SIGTERM normally has init's, which shuts down cleanly and so
+    // gets to exit()
+    struct sigaction sa;
+    sa.sa_handler = DebugLogCrashHandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESETHAND;
+    const int vSignal[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, SIGTERM };
+    BOOST_FOREACH(int nSignal, vSignal)
+    {
+        struct sigaction saOld;
+        if (sigaction(nSignal, NULL, &saOld) == 0 && saOld.sa_handler == SIG_DFL)
+            sigaction(nSignal, &sa, NULL);
+    }
+#endif
+}
 
 inline int OutputDebugStringF(const char* pszFormat, ...)
 {
@@ -214,45 +491,32 @@ inline int OutputDebugStringF(const char* pszFormat, ...)
     else if (!fPrintToDebugger)
     {
         // print to debug.log
+        int64_t nTime = fLogTimestamps ? GetTime() : 0;
+        vector<char>* pvch = DebugLogFormatBuffer().get();
+        if (!pvch)
+        {
+            pvch = new vector<char>();
+            DebugLogFormatBuffer().reset(pvch);
+        }
+        va_list arg_ptr;
+        va_start(arg_ptr, pszFormat);
+        size_t nSize = DebugLogFormat(*pvch, pszFormat, arg_ptr);
+        va_end(arg_ptr);
+        ret = nSize;
 
-        if (!fileout)
+        bool fQueued = false;
+        while (fDebugLogWriter && !(fQueued = DebugLogPush(nTime, &(*pvch)[0], nSize)))
         {
-            boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-            fileout = fopen(pathDebug.string().c_str(), "a");
-            if (fileout) setbuf(fileout, NULL); // unbuffered
+            // Queue full: let the writer catch up
+            DebugLogCondition().notify_one();
+            MilliSleep(1);
         }
-        if (fileout)
+        if (fQueued)
+            DebugLogCondition().notify_one();
+        else
         {
-            static bool fStartedNewLine = true;
-
-            // This routine may be called by global destructors during shutdown.
-            // Since the order of destruction of static/global objects is undefined,
-            // allocate mutexDebugLog on the heap the first time this routine
-            // is called to avoid crashes during shutdown.
-            static boost::mutex* mutexDebugLog = NULL;
-            if (mutexDebugLog == NULL) mutexDebugLog = new boost::mutex();
-            boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
-
-            // reopen the log file, if requested
-            if (fReopenDebugLog) {
-                fReopenDebugLog = false;
-                boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-                if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
-                    setbuf(fileout, NULL); // unbuffered
-            }
-
-            // Debug print useful for profiling
-            if (fLogTimestamps && fStartedNewLine)
-                fprintf(fileout, "%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
-            if (pszFormat[strlen(pszFormat) - 1] == '\n')
-                fStartedNewLine = true;
-            else
-                fStartedNewLine = false;
-
-            va_list arg_ptr;
-            va_start(arg_ptr, pszFormat);
-            ret = vfprintf(fileout, pszFormat, arg_ptr);
-            va_end(arg_ptr);
+            boost::mutex::scoped_lock scoped_lock(DebugLogMutex());
+            DebugLogWrite(&(*pvch)[0], nSize, nTime);
         }
     }
 
@@ -982,11 +1246,13 @@ void PrintException(std::exception* pex, const char* pszThread)
     printf("\n\n************************\n%s\n", message.c_str());
     fprintf(stderr, "\n\n************************\n%s\n", message.c_str());
     strMiscWarning = message;
+    FlushDebugLog();
     throw;
 }
 
 void LogStackTrace() {
     printf("\n\n******* exception encountered *******\n");
+    FlushDebugLog();
     if (fileout)
     {
 #ifndef WIN32
@@ -17,6 +17,7 @@
 #endif
 
 #include <map>
+#include <set>
 #include <vector>
 #include <string>
 
@@ -152,10 +153,19 @@ extern bool fTestNet;
 extern bool fNoListen;
 extern bool fLogTimestamps;
 extern bool fReopenDebugLog;
+extern std::set<std::string> setDebugCategories;
 
 void RandAddSeed();
 void RandAddSeedPerfmon();
 int ATTR_WARN_PRINTF(1,2) OutputDebugStringF(const char* pszFormat, ...);
+/** Hand debug.log writes to a background thread from now on */
+void StartDebugLogWriter();
+/** Write out everything logged so far */
+void FlushDebugLog();
+/** Whether -debug or -debug=<category> asks for messages in pszCategory */
+bool LogAcceptCategory(const char* pszCategory);
+/** Log only if the category is enabled; the arguments aren't even formatted otherwise */
+#define LogPrint(category, ...) do { if (LogAcceptCategory(category)) OutputDebugStringF(__VA_ARGS__); } while (0)
 
 /*
   Rationale for the real_strprintf / strprintf construction:
@@ -350,6 +360,12 @@ inline int64_t GetTimeMillis()
             boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_milliseconds();
 }
 
+inline int64_t GetTimeMicros()
+{
+    return (boost::posix_time::ptime(boost::posix_time::microsec_clock::universal_time()) -
+            boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds();
+}
+
 inline std::string DateTimeStrFormat(const char* pszFormat, int64_t nTime)
 {
     time_t n = nTime;
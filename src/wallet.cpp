@@ -12,6 +12,7 @@
 #include "base58.h"
 #include "kernel.h"
 #include "coincontrol.h"
+#include "checkqueue.h"
 #include <boost/algorithm/string/replace.hpp>
 
 using namespace std;
@@ -34,6 +35,101 @@ struct CompareValueOnly
     }
 };
 
+// Serialized sizes of a pay-to-pubkey-hash input and output, to price
+// coins by what spending them costs
+static const unsigned int TX_INPUT_SIZE = 148;
+static const unsigned int TX_OUTPUT_SIZE = 34;
+
+// Branches the coin selection search may visit before falling back to
+// the stochastic approximation
+static const int BNB_MAX_TRIES = 100000;
+
+// Fee for nBytes of transaction at the rate CreateTransaction pays
+static int64_t GetFeeForBytes(unsigned int nBytes)
+{
+    return max(nTransactionFee, MIN_TX_FEE) * nBytes / 1000;
+}
+
+// Keys generated and written to the wallet per database transaction when
+// topping up the key pool
+static const unsigned int KEYPOOL_BATCH_SIZE = 250;
+
+// Fewest keys worth starting a key making thread for. Smaller fills, such as
+// the one ReserveKeyFromKeyPool makes under cs_wallet when the pool is
+// empty, run on the calling thread alone.
+static const unsigned int KEYPOOL_KEYS_PER_THREAD = 50;
+
+// Wakes the key pool refill thread
+static boost::mutex mutexKeyPoolRefill;
+static boost::condition_variable condKeyPoolRefill;
+static bool fKeyPoolRefillWake = false;
+
+static unsigned int GetKeyPoolTarget()
+{
+    return max(GetArg("-keypool", 100), (int64_t)0);
+}
+
+// A run of new keys for the key generation workers
+class CMakeKeysJob
+{
+private:
+    vector<CKey>* pvKey;
+    vector<CPubKey>* pvPubKey;
+    bool fCompressed;
+    unsigned int nBegin, nEnd;
+
+public:
+    CMakeKeysJob() : pvKey(NULL), pvPubKey(NULL), fCompressed(false), nBegin(0), nEnd(0) {}
+    CMakeKeysJob(vector<CKey>* pvKeyIn, vector<CPubKey>* pvPubKeyIn, bool fCompressedIn, unsigned int nBeginIn, unsigned int nEndIn) :
+        pvKey(pvKeyIn), pvPubKey(pvPubKeyIn), fCompressed(fCompressedIn), nBegin(nBeginIn), nEnd(nEndIn) {}
+
+    bool operator()()
+    {
+        for (unsigned int i = nBegin; i < nEnd; i++)
+        {
+            (*pvKey)[i].MakeNewKey(fCompressed);
+            (*pvPubKey)[i] = (*pvKey)[i].GetPubKey();
+        }
+        return true;
+    }
+
+    void swap(CMakeKeysJob& job)
+    {
+        std::swap(pvKey, job.pvKey);
+        std::swap(pvPubKey, job.pvPubKey);
+        std::swap(fCompressed, job.fCompressed);
+        std::swap(nBegin, job.nBegin);
+        std::swap(nEnd, job.nEnd);
+    }
+};
+
+// Makes the keys of every batch of one key pool fill, on workers started
+// once for the fill plus the calling thread
+class CKeyMaker
+{
+private:
+    unsigned int nThreads;
+    CCheckQueuePool<CMakeKeysJob> pool;
+
+public:
+    CKeyMaker(unsigned int nKeysTotal) :
+        nThreads(max(min((unsigned int)max(nScriptCheckThreads, 1), nKeysTotal / KEYPOOL_KEYS_PER_THREAD), 1U)),
+        pool(nThreads - 1, 1) {}
+
+    // Fill vKey with new keys and vPubKey with their public keys
+    void Make(vector<CKey>& vKey, vector<CPubKey>& vPubKey, bool fCompressed)
+    {
+        vPubKey.resize(vKey.size());
+        vector<CMakeKeysJob> vJobs;
+        unsigned int nPerThread = (vKey.size() + nThreads - 1) / nThreads;
+        for (unsigned int i = 0; i < nThreads && i * nPerThread < vKey.size(); i++)
+            vJobs.push_back(CMakeKeysJob(&vKey, &vPubKey, fCompressed, i * nPerThread,
+                                         min((unsigned int)vKey.size(), (i + 1) * nPerThread)));
+        pool.queue.Add(vJobs);
+        pool.queue.Wait();
+    }
+};
+
 CPubKey CWallet::GenerateNewKey()
 {
     bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
@@ -68,7 +164,13 @@ bool CWallet::AddKey(const CKey& key)
     if (!fFileBacked)
         return true;
     if (!IsCrypted())
-        return CWalletDB(strWalletFile).WriteKey(pubkey, key.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
+    {
+        LOCK(cs_wallet);
+        if (pwalletdbEncryption)
+            return pwalletdbEncryption->WriteKey(pubkey, key.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
+        else
+            return CWalletDB(strWalletFile).WriteKey(pubkey, key.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
+    }
     return true;
 }
 
@@ -383,6 +485,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                     printf("WalletUpdateSpent found spent coin %s XDE %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    UpdateUnspent(wtx);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -403,6 +506,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                     NotifyTransactionChanged(this, hash, CT_UPDATED);
                 }
             }
+            UpdateUnspent(wtx);
         }
 
     }
@@ -414,9 +518,32 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // Imported keys can make outputs already in the wallet ours
+        RebuildUnspent();
     }
 }
 
+void CWallet::UpdateUnspent(const CWalletTx& wtx)
+{
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+            setUnspent.insert(COutPoint(hash, i));
+        else
+            setUnspent.erase(COutPoint(hash, i));
+    }
+    fBalanceCached = false;
+    fStakeWeightCached = false;
+}
+
+void CWallet::RebuildUnspent()
+{
+    setUnspent.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateUnspent((*it).second);
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
@@ -526,6 +653,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
         }
 #endif
+        UpdateUnspent(wtx);
+
         // since AddToWallet is called directly for self-originating transactions, check for consumption of own coins
         WalletUpdateSpent(wtx, (wtxIn.hashBlock != 0));
 
@@ -577,6 +706,11 @@ bool CWallet::EraseFromWallet(uint256 hash)
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        set<COutPoint>::iterator it = setUnspent.lower_bound(COutPoint(hash, 0));
+        while (it != setUnspent.end() && (*it).hash == hash)
+            setUnspent.erase(it++);
+        fBalanceCached = false;
+        fStakeWeightCached = false;
     }
     return true;
 }
@@ -836,35 +970,212 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+// Blocks each rescan thread reads ahead of the wallet
+static const size_t RESCAN_BLOCKS_PER_THREAD = 64;
+
+// How far before a key's birth a rescan looks, for block time variability
+static const int64_t RESCAN_TIME_MARGIN = 7200;
+
+// The block a rescan for keys born at nTimeBirth starts from, going back
+// from pindexTip
+CBlockIndex* FindRescanStart(CBlockIndex* pindexTip, int64_t nTimeBirth)
+{
+    CBlockIndex* pindex = pindexTip;
+    while (pindex && pindex->pprev && pindex->nTime > nTimeBirth - RESCAN_TIME_MARGIN)
+        pindex = pindex->pprev;
+    return pindex;
+}
+
+// A run of blocks read by the rescan threads. vfMatch flags the
+// transactions that already are in the wallet or have an output that
+// might pay it; the rest only need their inputs checked.
+struct CRescanChunk
+{
+    std::vector<CBlockIndex*> vIndex;
+    std::vector<CBlock> vBlock;
+    std::vector<std::vector<char> > vfMatch;
+};
+
+// Whether a script pushes one of our key or script IDs, or a public key
+// hashing to one. Every script IsMine accepts does; most others don't.
+bool MayPayWallet(const CScript& script, const set<uint160>& setID)
+{
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    valtype vch;
+    while (pc < script.end())
+    {
+        if (!script.GetOp(pc, opcode, vch))
+            return false;
+        if (vch.size() == 20 && setID.count(uint160(vch)))
+            return true;
+        if ((vch.size() == 33 || vch.size() == 65) && setID.count(Hash160(vch)))
+            return true;
+    }
+    return false;
+}
+
+static void ReadRescanChunk(CRescanChunk* pchunk, size_t nBegin, size_t nEnd,
+                            const set<uint160>* psetID, const set<uint256>* psetWalletTx)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+    {
+        CBlock& block = pchunk->vBlock[i];
+        block.ReadFromDisk(pchunk->vIndex[i], true);
+        pchunk->vfMatch[i].assign(block.vtx.size(), false);
+        for (unsigned int j = 0; j < block.vtx.size(); j++)
+        {
+            const CTransaction& tx = block.vtx[j];
+            bool fMatch = psetWalletTx->count(tx.GetHash());
+            for (unsigned int k = 0; k < tx.vout.size() && !fMatch; k++)
+                fMatch = MayPayWallet(tx.vout[k].scriptPubKey, *psetID);
+            pchunk->vfMatch[i][j] = fMatch;
+        }
+    }
+}
+
+// A run of one chunk's blocks for the rescan workers
+class CRescanJob
+{
+private:
+    CRescanChunk* pchunk;
+    size_t nBegin, nEnd;
+    const set<uint160>* psetID;
+    const set<uint256>* psetWalletTx;
+
+public:
+    CRescanJob() : pchunk(NULL), nBegin(0), nEnd(0), psetID(NULL), psetWalletTx(NULL) {}
+    CRescanJob(CRescanChunk* pchunkIn, size_t nBeginIn, size_t nEndIn,
+               const set<uint160>* psetIDIn, const set<uint256>* psetWalletTxIn) :
+        pchunk(pchunkIn), nBegin(nBeginIn), nEnd(nEndIn), psetID(psetIDIn), psetWalletTx(psetWalletTxIn) {}
+
+    bool operator()()
+    {
+        ReadRescanChunk(pchunk, nBegin, nEnd, psetID, psetWalletTx);
+        return true;
+    }
+
+    void swap(CRescanJob& job)
+    {
+        std::swap(pchunk, job.pchunk);
+        std::swap(nBegin, job.nBegin);
+        std::swap(nEnd, job.nEnd);
+        std::swap(psetID, job.psetID);
+        std::swap(psetWalletTx, job.psetWalletTx);
+    }
+};
+
+static void StartRescanChunk(CCheckQueue<CRescanJob>& queue, CRescanChunk& chunk, const vector<CBlockIndex*>& vIndex,
+                             size_t& nNext, int nThreads, const set<uint160>& setID, const set<uint256>& setWalletTx)
+{
+    size_t nEnd = min(vIndex.size(), nNext + nThreads * RESCAN_BLOCKS_PER_THREAD);
+    chunk.vIndex.assign(vIndex.begin() + nNext, vIndex.begin() + nEnd);
+    chunk.vBlock.assign(chunk.vIndex.size(), CBlock());
+    chunk.vfMatch.assign(chunk.vIndex.size(), vector<char>());
+    nNext = nEnd;
+
+    vector<CRescanJob> vJobs;
+    size_t nPerThread = (chunk.vIndex.size() + nThreads - 1) / nThreads;
+    for (int i = 0; i < nThreads && i * nPerThread < chunk.vIndex.size(); i++)
+        vJobs.push_back(CRescanJob(&chunk, i * nPerThread, min(chunk.vIndex.size(), (i + 1) * nPerThread),
+                                   &setID, &setWalletTx));
+    queue.Add(vJobs);
+}
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+//
+// Blocks are read and prefiltered by a pool of threads while the wallet
+// takes the matches of the chunk before, in chain order. Only blocks with
+// a possible match take cs_wallet.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
 
-    CBlockIndex* pindex = pindexStart;
+    set<uint160> setID;
+    set<uint256> setWalletTx, setWalletTxStart;
     {
         LOCK(cs_wallet);
-        while (pindex)
-        {
-            // no need to read and scan block, if block was created before
-            // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->pnext;
-                continue;
-            }
+        set<CKeyID> setKeyID;
+        GetKeys(setKeyID);
+        BOOST_FOREACH(const CKeyID& keyID, setKeyID)
+            setID.insert(keyID);
+        set<CScriptID> setScriptID;
+        GetCScripts(setScriptID);
+        BOOST_FOREACH(const CScriptID& scriptID, setScriptID)
+            setID.insert(scriptID);
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setWalletTx.insert((*it).first);
+    }
+    // The threads look at this copy, the wallet adds to setWalletTx as it goes
+    setWalletTxStart = setWalletTx;
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+    vector<CBlockIndex*> vIndex;
+    for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+    {
+        // no need to read and scan block, if block was created before
+        // our wallet birthday (as adjusted for block time variability)
+        if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - RESCAN_TIME_MARGIN)))
+            continue;
+        vIndex.push_back(pindex);
+    }
+
+    int nThreads = max(nScriptCheckThreads, 1);
+    int64_t nStart = GetTimeMillis(), nLastProgress = nStart;
+    size_t nBlocks = 0, nTx = 0;
+    CRescanChunk vChunk[2];
+    int nCur = 0;
+    size_t nNext = 0;
+    // Declared after everything the workers use, so they are stopped first
+    CCheckQueuePool<CRescanJob> pool(nThreads, 1);
+    bool fPending = !vIndex.empty();
+    if (fPending)
+        StartRescanChunk(pool.queue, vChunk[0], vIndex, nNext, nThreads, setID, setWalletTxStart);
+    while (fPending)
+    {
+        CRescanChunk& chunk = vChunk[nCur];
+        pool.queue.Wait();
+        fPending = (nNext < vIndex.size());
+        if (fPending)
+            StartRescanChunk(pool.queue, vChunk[1 - nCur], vIndex, nNext, nThreads, setID, setWalletTxStart);
+
+        for (size_t i = 0; i < chunk.vIndex.size(); i++)
+        {
+            const CBlock& block = chunk.vBlock[i];
+            BOOST_FOREACH(const CTransaction& tx, block.vtx)
             {
+                bool fMatch = chunk.vfMatch[i][&tx - &block.vtx[0]];
+                for (unsigned int k = 0; k < tx.vin.size() && !fMatch; k++)
+                    fMatch = setWalletTx.count(tx.vin[k].prevout.hash);
+                if (!fMatch)
+                    continue;
+
+                LOCK(cs_wallet);
                 if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
                     ret++;
+                uint256 hash = tx.GetHash();
+                if (mapWallet.count(hash))
+                    setWalletTx.insert(hash);
             }
-            pindex = pindex->pnext;
+            nTx += block.vtx.size();
         }
+        nBlocks += chunk.vIndex.size();
+        chunk.vBlock.clear();
+
+        if (GetTimeMillis() - nLastProgress > 10000)
+        {
+            nLastProgress = GetTimeMillis();
+            printf("ScanForWalletTransactions : %"PRIszu"/%"PRIszu" blocks (%d%%), %.1f blocks/s\n",
+                   nBlocks, vIndex.size(), (int)(nBlocks * 100 / vIndex.size()),
+                   nBlocks * 1000.0 / max(nLastProgress - nStart, (int64_t)1));
+        }
+        nCur = 1 - nCur;
     }
+
+    int64_t nTime = max(GetTimeMillis() - nStart, (int64_t)1);
+    printf("ScanForWalletTransactions : scanned %"PRIszu" blocks, %"PRIszu" transactions in %"PRId64"ms (%.1f blocks/s, %.1f tx/s) with %d threads, %d found\n",
+           nBlocks, nTx, nTime, nBlocks * 1000.0 / nTime, nTx * 1000.0 / nTime, nThreads, ret);
     return ret;
 }
 
@@ -918,6 +1229,7 @@ void CWallet::ReacceptWalletTransactions()
                     printf("ReacceptWalletTransactions found spent coin %s XDE %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    UpdateUnspent(wtx);
                 }
             }
             else
@@ -1022,50 +1334,76 @@ void CWallet::ResendWalletTransactions(bool fForce)
 //
 
 
-int64_t CWallet::GetBalance() const
+void CWallet::CacheBalances() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    if (fBalanceCached && hashBalanceBest == hashBestChain)
+        return;
+
+    nBalanceTrusted = nBalanceUnconfirmed = nBalanceImmature = nBalanceStake = nBalanceNewMint = 0;
+    bool fFinalOnly = true;
+    const CWalletTx* pcoin = NULL;
+    uint256 hashTx;
+    bool fTrusted = false;
+    int nDepth = 0;
+    for (set<COutPoint>::const_iterator it = setUnspent.begin(); it != setUnspent.end(); ++it)
+    {
+        // Outputs of one transaction are next to each other in the set
+        if (!pcoin || (*it).hash != hashTx)
+        {
+            hashTx = (*it).hash;
+            pcoin = &mapWallet.find(hashTx)->second;
+            fTrusted = pcoin->IsTrusted();
+            nDepth = pcoin->GetDepthInMainChain();
+            // Finality by time can change without a new block
+            if (!pcoin->IsFinal())
+                fFinalOnly = false;
+        }
+
+        int64_t nValue = pcoin->vout[(*it).n].nValue;
+        if (!MoneyRange(nValue))
+            throw std::runtime_error("CWallet::CacheBalances() : value out of range");
+        if (pcoin->GetBlocksToMaturity() > 0)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            // Must wait until coinbase is safely deep enough in the chain before valuing it
+            if (nDepth <= 0)
+                continue;
+            if (pcoin->IsCoinBase())
+            {
+                nBalanceImmature += nValue;
+                nBalanceNewMint += nValue;
+            }
+            else
+                nBalanceStake += nValue;
         }
+        else if (fTrusted)
+            nBalanceTrusted += nValue;
+        else
+            nBalanceUnconfirmed += nValue;
     }
 
-    return nTotal;
+    hashBalanceBest = hashBestChain;
+    fBalanceCached = fFinalOnly;
+}
+
+int64_t CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nBalanceTrusted;
 }
 
 int64_t CWallet::GetUnconfirmedBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nBalanceUnconfirmed;
 }
 
 int64_t CWallet::GetImmatureBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nBalanceImmature;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1075,31 +1413,26 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const CWalletTx* pcoin = NULL;
+        uint256 hashTx;
+        bool fSpendable = false;
+        int nDepth = 0;
+        for (set<COutPoint>::const_iterator it = setUnspent.begin(); it != setUnspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!pcoin->IsFinal())
-                continue;
-
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
-
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
-
-            if(pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
-
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
+            if (!pcoin || (*it).hash != hashTx)
+            {
+                hashTx = (*it).hash;
+                pcoin = &mapWallet.find(hashTx)->second;
+                nDepth = pcoin->GetDepthInMainChain();
+                fSpendable = pcoin->IsFinal() && (!fOnlyConfirmed || pcoin->IsTrusted()) &&
+                             pcoin->GetBlocksToMaturity() == 0 && nDepth >= 0;
+            }
+            if (!fSpendable)
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                    vCoins.push_back(COutput(pcoin, i, nDepth));
-
+            if (pcoin->vout[(*it).n].nValue >= nMinimumInputValue &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).hash, (*it).n)))
+                vCoins.push_back(COutput(pcoin, (*it).n, nDepth));
         }
     }
 }
@@ -1110,41 +1443,53 @@ void CWallet::AvailableCoinsMinConf(vector<COutput>& vCoins, int nConf) const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const CWalletTx* pcoin = NULL;
+        uint256 hashTx;
+        bool fSpendable = false;
+        int nDepth = 0;
+        for (set<COutPoint>::const_iterator it = setUnspent.begin(); it != setUnspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!pcoin->IsFinal())
-                continue;
-
-            if(pcoin->GetDepthInMainChain() < nConf)
-                continue;
-
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue)
-                    vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
+            if (!pcoin || (*it).hash != hashTx)
+            {
+                hashTx = (*it).hash;
+                pcoin = &mapWallet.find(hashTx)->second;
+                nDepth = pcoin->GetDepthInMainChain();
+                fSpendable = pcoin->IsFinal() && nDepth >= nConf;
+            }
+            if (fSpendable && pcoin->vout[(*it).n].nValue >= nMinimumInputValue)
+                vCoins.push_back(COutput(pcoin, (*it).n, nDepth));
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >vValue, int64_t nTotalLower, int64_t nTargetValue,
+static void ApproximateBestSubset(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTotalLower, int64_t nTargetValue,
                                   vector<char>& vfBest, int64_t& nBest, int iterations = 1000)
 {
-    vector<char> vfIncluded;
+    vector<char> vfIncluded(vValue.size());
 
     vfBest.assign(vValue.size(), true);
     nBest = nTotalLower;
 
+    // xorshift, seeded once: one draw decides the first pass for 64 coins
+    uint64_t nRand = GetRand(std::numeric_limits<uint64_t>::max()) | 1;
     for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
     {
-        vfIncluded.assign(vValue.size(), false);
+        std::fill(vfIncluded.begin(), vfIncluded.end(), false);
         int64_t nTotal = 0;
         bool fReachedTarget = false;
         for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
         {
+            uint64_t nBits = 0;
             for (unsigned int i = 0; i < vValue.size(); i++)
             {
-                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
+                if (nPass == 0 && i % 64 == 0)
+                {
+                    nRand ^= nRand << 13;
+                    nRand ^= nRand >> 7;
+                    nRand ^= nRand << 17;
+                    nBits = nRand;
+                }
+                if (nPass == 0 ? (nBits >> (i % 64)) & 1 : !vfIncluded[i])
                 {
                     nTotal += vValue[i].first;
                     vfIncluded[i] = true;
@@ -1165,31 +1510,88 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
     }
 }
 
+// Depth first branch and bound over coins sorted largest first, for a
+// subset landing in [nTargetValue, nTargetValue + nCostOfChange], which
+// needs no change output. Of those it keeps the one wasting least: the
+// excess given up to the fee plus the fee for spending each input.
+bool SelectCoinsBnB(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTargetValue,
+                    int64_t nCostOfChange, int64_t nInputCost, vector<char>& vfBest, int64_t& nBest)
+{
+    int64_t nRemaining = 0;
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        nRemaining += vValue[i].first;
+    vfBest.clear();
+    nBest = 0;
+    if (nRemaining < nTargetValue)
+        return false;
+
+    vector<char> vfSelected(vValue.size(), false);
+    int64_t nSelected = 0;
+    int64_t nWasteBest = std::numeric_limits<int64_t>::max();
+    int64_t nInputs = 0;
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < BNB_MAX_TRIES; nTries++)
+    {
+        // Leave the branch once it can't reach the target, overshoots the
+        // window or already has more inputs than the best costs in all
+        bool fBacktrack = false;
+        if (nSelected + nRemaining < nTargetValue || nSelected > nTargetValue + nCostOfChange ||
+            nInputs * nInputCost >= nWasteBest)
+            fBacktrack = true;
+        else if (nSelected >= nTargetValue)
+        {
+            int64_t nWaste = nSelected - nTargetValue + nInputs * nInputCost;
+            if (nWaste < nWasteBest)
+            {
+                nWasteBest = nWaste;
+                vfBest = vfSelected;
+                nBest = nSelected;
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // Go back to the last coin taken and try leaving it out instead
+            while (i > 0 && !vfSelected[i - 1])
+                nRemaining += vValue[--i].first;
+            if (i == 0)
+                break;
+            i--;
+            vfSelected[i] = false;
+            nSelected -= vValue[i].first;
+            nInputs--;
+        }
+        else
+        {
+            nRemaining -= vValue[i].first;
+            // Taking a coin worth the same as one just left out repeats a
+            // branch already searched
+            if (i == 0 || vfSelected[i - 1] || vValue[i].first != vValue[i - 1].first)
+            {
+                vfSelected[i] = true;
+                nSelected += vValue[i].first;
+                nInputs++;
+            }
+        }
+        i++;
+    }
+    return !vfBest.empty();
+}
+
 // XDECoin: total coins staked (non-spendable until maturity)
 int64_t CWallet::GetStake() const
 {
-    int64_t nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    CacheBalances();
+    return nBalanceStake;
 }
 
 int64_t CWallet::GetNewMint() const
 {
-    int64_t nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    CacheBalances();
+    return nBalanceNewMint;
 }
 
 bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
@@ -1204,6 +1606,10 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
     vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vValue;
     int64_t nTotalLower = 0;
 
+    // All coins worth more than the fee for spending them, for the search
+    vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vCandidate;
+    int64_t nInputCost = GetFeeForBytes(TX_INPUT_SIZE);
+
     random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
 
     BOOST_FOREACH(COutput output, vCoins)
@@ -1223,6 +1629,9 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
 
         pair<int64_t,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
 
+        if (n > nInputCost)
+            vCandidate.push_back(coin);
+
         if (n == nTargetValue)
         {
             setCoinsRet.insert(coin.second);
@@ -1240,6 +1649,24 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
         }
     }
 
+    // A subset that needs no change output beats whatever the
+    // approximation below comes up with
+    {
+        sort(vCandidate.rbegin(), vCandidate.rend(), CompareValueOnly());
+        vector<char> vfBest;
+        int64_t nBest;
+        if (SelectCoinsBnB(vCandidate, nTargetValue, GetFeeForBytes(TX_OUTPUT_SIZE + TX_INPUT_SIZE), nInputCost, vfBest, nBest))
+        {
+            for (unsigned int i = 0; i < vCandidate.size(); i++)
+                if (vfBest[i])
+                {
+                    setCoinsRet.insert(vCandidate[i].second);
+                    nValueRet += vCandidate[i].first;
+                }
+            return true;
+        }
+    }
+
     if (nTotalLower == nTargetValue)
     {
         for (unsigned int i = 0; i < vValue.size(); ++i)
@@ -1417,6 +1844,14 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
                     nFeeRet += nMoveToFee;
                 }
 
+                // Change worth less than adding it and spending it later
+                // would cost goes to the fee instead
+                if (nChange > 0 && nChange <= GetFeeForBytes(TX_OUTPUT_SIZE + TX_INPUT_SIZE))
+                {
+                    nFeeRet += nChange;
+                    nChange = 0;
+                }
+
                 if (nChange > 0)
                 {
                     // Fill a vout to ourself
@@ -1496,58 +1931,197 @@ bool CWallet::CreateTransaction(CScript scriptPubKey, int64_t nValue, CWalletTx&
 }
 
 // NovaCoin: get current stake weight
-bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight)
+CUint128 CUint128::Mul(uint64_t a, uint64_t b)
+{
+    CUint128 r;
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 n = (unsigned __int128)a * b;
+    r.nHigh = (uint64_t)(n >> 64);
+    r.nLow = (uint64_t)n;
+#else
+    uint64_t a0 = (uint32_t)a, a1 = a >> 32, b0 = (uint32_t)b, b1 = b >> 32;
+    uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    uint64_t nMid = (p00 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+    r.nLow = (nMid << 32) | (uint32_t)p00;
+    r.nHigh = p11 + (p01 >> 32) + (p10 >> 32) + (nMid >> 32);
+#endif
+    return r;
+}
+
+CUint128& CUint128::operator+=(const CUint128& b)
 {
-    // Choose coins to use
-    int64_t nBalance = GetBalance();
+    nLow += b.nLow;
+    nHigh += b.nHigh + (nLow < b.nLow);
+    return *this;
+}
 
-    if (nBalance <= nReserveBalance)
-        return false;
+CUint128& CUint128::operator-=(const CUint128& b)
+{
+    nHigh -= b.nHigh + (nLow < b.nLow);
+    nLow -= b.nLow;
+    return *this;
+}
 
-    vector<const CWalletTx*> vwtxPrev;
+uint64_t CUint128::Div(uint64_t nDivisor) const
+{
+    if (nHigh >= nDivisor)
+        return std::numeric_limits<uint64_t>::max();
+#if defined(__SIZEOF_INT128__)
+    return (uint64_t)((((unsigned __int128)nHigh << 64) | nLow) / nDivisor);
+#else
+    uint64_t nRem = nHigh, nQuot = 0;
+    for (int i = 63; i >= 0; i--)
+    {
+        nRem = (nRem << 1) | ((nLow >> i) & 1);
+        nQuot <<= 1;
+        if (nRem >= nDivisor)
+        {
+            nRem -= nDivisor;
+            nQuot |= 1;
+        }
+    }
+    return nQuot;
+#endif
+}
 
-    set<pair<const CWalletTx*,unsigned int> > setCoins;
-    int64_t nValueIn = 0;
+void CStakeWeight::Update(int64_t nTime)
+{
+    nTimeFrom = nTime;
+    nTimeUntil = std::numeric_limits<int64_t>::max();
+    nFullWeight = 0;
+    nGrowingValue = 0;
+    nGrowingTimeValue = 0;
+    for (unsigned int i = 0; i < vCoin.size(); i++)
+    {
+        int64_t nTimeStart = vCoin[i].first + nStakeMinAge;
+        int64_t nValue = vCoin[i].second;
+        int64_t nTimeWeight = GetWeight(vCoin[i].first, nTime);
+        if (nTimeWeight <= 0)
+            nTimeUntil = min(nTimeUntil, nTimeStart + 1);
+        else if (nTimeWeight < (int64_t)nStakeMaxAge)
+        {
+            nGrowingValue += nValue;
+            nGrowingTimeValue += CUint128::Mul(nValue, nTimeStart);
+            nTimeUntil = min(nTimeUntil, nTimeStart + (int64_t)nStakeMaxAge);
+        }
+        else
+            nFullWeight += CUint128::Mul(nValue, nStakeMaxAge).Div(COIN * 24 * 60 * 60);
+    }
+}
 
-    if (!SelectCoinsSimple(nBalance - nReserveBalance, GetTime(), nCoinbaseMaturity + 10, setCoins, nValueIn))
-        return false;
+void CStakeWeight::Get(int64_t nTime, uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight)
+{
+    if (nTime < nTimeFrom || nTime >= nTimeUntil)
+        Update(nTime);
 
-    if (setCoins.empty())
-        return false;
+    // The coins between min and max age weigh value * (nTime - nTimeStart)
+    // each, summed before the division rather than after
+    CUint128 nTimeValue = CUint128::Mul(nGrowingValue, nTime);
+    nTimeValue -= nGrowingTimeValue;
+    uint64_t nGrowingWeight = nTimeValue.Div(COIN * 24 * 60 * 60);
 
-    CTxDB txdb("r");
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    nMinWeight += nGrowingWeight;
+    nMaxWeight += nFullWeight;
+    nWeight += nGrowingWeight + nFullWeight;
+}
+
+bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight)
+{
+    LOCK(cs_wallet);
+    if (!fStakeWeightCached || hashStakeWeightBest != hashBestChain || nStakeWeightReserve != nReserveBalance)
     {
-        CTxIndex txindex;
+        fStakeWeightCached = true;
+        hashStakeWeightBest = hashBestChain;
+        nStakeWeightReserve = nReserveBalance;
+        stakeWeight.SetNull();
+
+        // Choose coins to use
+        int64_t nBalance = GetBalance();
+        set<pair<const CWalletTx*,unsigned int> > setCoins;
+        int64_t nValueIn = 0;
+        if (nBalance > nReserveBalance &&
+            SelectCoinsSimple(nBalance - nReserveBalance, GetTime(), nCoinbaseMaturity + 10, setCoins, nValueIn))
         {
-            LOCK2(cs_main, cs_wallet);
-            if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-                continue;
+            BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+                stakeWeight.Add(pcoin.first->nTime, pcoin.first->vout[pcoin.second].nValue);
         }
+    }
 
-        int64_t nTimeWeight = GetWeight((int64_t)pcoin.first->nTime, (int64_t)GetTime());
-        CBigNum bnCoinDayWeight = CBigNum(pcoin.first->vout[pcoin.second].nValue) * nTimeWeight / COIN / (24 * 60 * 60);
+    if (stakeWeight.IsEmpty())
+        return false;
 
-        // Weight is greater than zero
-        if (nTimeWeight > 0)
-        {
-            nWeight += bnCoinDayWeight.getuint64();
-        }
+    stakeWeight.Get(GetTime(), nMinWeight, nMaxWeight, nWeight);
+    return true;
+}
 
-        // Weight is greater than zero, but the maximum value isn't reached yet
-        if (nTimeWeight > 0 && nTimeWeight < nStakeMaxAge)
+// Cache the kernel hash inputs for coins that are new to the stake search, and
+// drop entries for coins that were spent or whose block left the main chain.
+// Only coins missing from the cache cost a tx index read.
+void CWallet::UpdateStakeCandidates(const set<pair<const CWalletTx*,unsigned int> >& setCoins)
+{
+    for (map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.begin(); it != mapStakeCandidates.end(); )
+    {
+        const CStakeCandidate& candidate = it->second;
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(candidate.prevout.hash);
+        BlockMap::const_iterator bi = mapBlockIndex.find(candidate.hashBlockFrom);
+        if (mi == mapWallet.end() || mi->second.IsSpent(candidate.prevout.n) ||
+            bi == mapBlockIndex.end() || !bi->second->IsInMainChain())
+            mapStakeCandidates.erase(it++);
+        else
+            ++it;
+    }
+
+    CTxDB txdb("r");
+    BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin, setCoins)
+    {
+        COutPoint prevout(pcoin.first->GetHash(), pcoin.second);
+        map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.find(prevout);
+        if (it == mapStakeCandidates.end())
         {
-            nMinWeight += bnCoinDayWeight.getuint64();
+            CTxIndex txindex;
+            if (!txdb.ReadTxIndex(prevout.hash, txindex))
+                continue;
+
+            // The wallet usually knows the containing block already; only
+            // fall back to reading the header if it doesn't match the index
+            uint256 hashBlockFrom = 0;
+            unsigned int nTimeBlockFrom = 0;
+            BlockMap::iterator mi = mapBlockIndex.find(pcoin.first->hashBlock);
+            if (mi != mapBlockIndex.end() && mi->second->nFile == txindex.pos.nFile && mi->second->nBlockPos == txindex.pos.nBlockPos)
+            {
+                hashBlockFrom = mi->first;
+                nTimeBlockFrom = mi->second->GetBlockTime();
+            }
+            else
+            {
+                CBlock block;
+                if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+                    continue;
+                hashBlockFrom = block.GetHash();
+                nTimeBlockFrom = block.GetBlockTime();
+            }
+
+            CStakeCandidate candidate;
+            candidate.prevout = prevout;
+            candidate.hashBlockFrom = hashBlockFrom;
+            candidate.nTimeBlockFrom = nTimeBlockFrom;
+            candidate.nTxPrevOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+            candidate.nTimeTxPrev = pcoin.first->nTime;
+            candidate.nValue = pcoin.first->vout[pcoin.second].nValue;
+            it = mapStakeCandidates.insert(make_pair(prevout, candidate)).first;
         }
 
-        // Maximum weight was reached
-        if (nTimeWeight == nStakeMaxAge)
+        // The modifier becomes available once the chain has moved far enough
+        // past the coin's block; a reorg past the block it was read from
+        // can change it, so it is looked up again in that case
+        CStakeCandidate& candidate = it->second;
+        if (!candidate.IsModifierCurrent())
         {
-            nMaxWeight += bnCoinDayWeight.getuint64();
+            int nStakeModifierHeight = 0;
+            int64_t nStakeModifierTime = 0;
+            candidate.fStakeModifier = GetKernelStakeModifier(candidate.hashBlockFrom, candidate.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, candidate.hashModifierBlock, false);
         }
     }
-
-    return true;
 }
 
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key)
@@ -1582,104 +2156,102 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (setCoins.empty())
         return false;
 
-    int64_t nCredit = 0;
-    CScript scriptPubKeyKernel;
-    CTxDB txdb("r");
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    // Snapshot the candidates so the search itself runs without any locks
+    vector<pair<PAIRTYPE(const CWalletTx*, unsigned int), CStakeCandidate> > vCandidates;
     {
-        CTxIndex txindex;
+        LOCK2(cs_main, cs_wallet);
+        UpdateStakeCandidates(setCoins);
+        vCandidates.reserve(setCoins.size());
+        BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
         {
-            LOCK2(cs_main, cs_wallet);
-            if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-                continue;
+            map<COutPoint, CStakeCandidate>::const_iterator it = mapStakeCandidates.find(COutPoint(pcoin.first->GetHash(), pcoin.second));
+            if (it != mapStakeCandidates.end() && it->second.fStakeModifier)
+                vCandidates.push_back(make_pair(pcoin, it->second));
         }
+    }
 
-        // Read block header
-        CBlock block;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                continue;
-        }
+    int64_t nCredit = 0;
+    CScript scriptPubKeyKernel;
+    for (unsigned int nCandidate = 0; nCandidate < vCandidates.size(); nCandidate++)
+    {
+        const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin = vCandidates[nCandidate].first;
+        const CStakeCandidate& candidate = vCandidates[nCandidate].second;
 
         static int nMaxStakeSearchInterval = 60;
-        if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
+        if (candidate.nTimeBlockFrom + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
             continue; // only count coins meeting min age requirement
 
+        // Search backward in time from the given txNew timestamp
+        // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
         bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown && pindexPrev == pindexBest; n++)
-        {
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake = 0, targetProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake, targetProofOfStake))
+        unsigned int nTimeTx = 0;
+        uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+        if (!fShutdown && pindexPrev == pindexBest &&
+            SearchStakeKernelHash(nBits, candidate, txNew.nTime, min(nSearchInterval,(int64_t)nMaxStakeSearchInterval), nTimeTx, hashProofOfStake, targetProofOfStake))
+        {
+            // Found a kernel
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : kernel found\n");
+            vector<valtype> vSolutions;
+            txnouttype whichType;
+            CScript scriptPubKeyOut;
+            scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+            if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
             {
-                // Found a kernel
                 if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
+                    printf("CreateCoinStake : failed to parse kernel\n");
+                continue;
+            }
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+            if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+            {
                 if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+                    printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+                continue;  // only support pay to public key and pay to address
+            }
+            if (whichType == TX_PUBKEYHASH) // pay to address type
+            {
+                // convert to pay to public key type
+                if (!keystore.GetKey(uint160(vSolutions[0]), key))
                 {
                     if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
+                        printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                    continue;  // unable to find corresponding public key
                 }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                if (key.GetPubKey() != vchPubKey)
+                scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+            }
+            if (whichType == TX_PUBKEY)
+            {
+                valtype& vchPubKey = vSolutions[0];
+                if (!keystore.GetKey(Hash160(vchPubKey), key))
                 {
                     if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
-
-                    scriptPubKeyOut = scriptPubKeyKernel;
+                        printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                    continue;  // unable to find corresponding public key
                 }
 
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-
-                if (GetWeight(block.GetBlockTime(), (int64_t)txNew.nTime) < nStakeSplitAge)
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+            if (key.GetPubKey() != vchPubKey)
+            {
                 if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+                    printf("CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                    continue; // keys mismatch
+                }
+
+                scriptPubKeyOut = scriptPubKeyKernel;
             }
+
+            txNew.nTime = nTimeTx;
+            txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+            nCredit += pcoin.first->vout[pcoin.second].nValue;
+            vwtxPrev.push_back(pcoin.first);
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+            if (GetWeight((int64_t)candidate.nTimeBlockFrom, (int64_t)txNew.nTime) < nStakeSplitAge)
+                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : added kernel type=%d\n", whichType);
+            fKernelFound = true;
         }
 
         if (fKernelFound || fShutdown)
@@ -1788,6 +2360,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateUnspent(coin);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -1876,6 +2449,10 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return DB_LOAD_OK;
     fFirstRunRet = false;
     DBErrors nLoadWalletRet = CWalletDB(strWalletFile,"cr+").LoadWallet(this);
+    {
+        LOCK(cs_wallet);
+        RebuildUnspent();
+    }
     if (nLoadWalletRet == DB_NEED_REWRITE)
     {
         if (CDB::Rewrite(strWalletFile, "\x04pool"))
@@ -1984,49 +2561,137 @@ bool CWallet::NewKeyPool()
         if (IsLocked())
             return false;
 
-        int64_t nKeys = max(GetArg("-keypool", 100), (int64_t)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
-        printf("CWallet::NewKeyPool wrote %"PRId64" new keys\n", nKeys);
+        unsigned int nKeys = GetKeyPoolTarget();
+        CKeyMaker keymaker(nKeys);
+        for (unsigned int i = 0; i < nKeys; i += KEYPOOL_BATCH_SIZE)
+            if (!GenerateKeyPoolBatch(keymaker, min(nKeys - i, KEYPOOL_BATCH_SIZE)))
+                return false;
+        printf("CWallet::NewKeyPool wrote %u new keys\n", nKeys);
     }
     return true;
 }
 
-bool CWallet::TopUpKeyPool(unsigned int nSize)
+//
+// Generate nKeys keys, without the wallet lock unless the caller holds it,
+// then add them to the key pool in one wallet transaction
+//
+bool CWallet::GenerateKeyPoolBatch(CKeyMaker& keymaker, unsigned int nKeys)
 {
+    bool fCompressed;
+    {
+        LOCK(cs_wallet);
+        fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    }
+
+    RandAddSeedPerfmon();
+    vector<CKey> vKey(nKeys);
+    vector<CPubKey> vPubKey;
+    keymaker.Make(vKey, vPubKey, fCompressed);
+
     {
         LOCK(cs_wallet);
 
+        // Locked while the keys were being made
         if (IsLocked())
             return false;
 
+        // Compressed public keys were introduced in version 0.6.0
+        if (fCompressed)
+            SetMinVersion(FEATURE_COMPRPUBKEY);
+
+        int64_t nCreationTime = GetTime();
+        if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
+            nTimeFirstKey = nCreationTime;
+
         CWalletDB walletdb(strWalletFile);
+        if (!walletdb.TxnBegin())
+            throw runtime_error("GenerateKeyPoolBatch() : TxnBegin failed");
 
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (nSize > 0)
-            nTargetSize = nSize;
-        else
-            nTargetSize = max(GetArg("-keypool", 100), (int64_t)0);
+        // AddKey and AddCryptedKey write through the open transaction
+        int64_t nEnd = setKeyPool.empty() ? 1 : *setKeyPool.rbegin() + 1;
+        bool fOk = true;
+        pwalletdbEncryption = &walletdb;
+        for (unsigned int i = 0; i < nKeys && fOk; i++)
+        {
+            mapKeyMetadata[vPubKey[i].GetID()] = CKeyMetadata(nCreationTime);
+            fOk = AddKey(vKey[i]) && walletdb.WritePool(nEnd + i, CKeyPool(vPubKey[i]));
+        }
+        pwalletdbEncryption = NULL;
+        if (!fOk)
+        {
+            walletdb.TxnAbort();
+            throw runtime_error("GenerateKeyPoolBatch() : writing generated keys failed");
+        }
+        if (!walletdb.TxnCommit())
+            throw runtime_error("GenerateKeyPoolBatch() : TxnCommit failed");
+
+        for (unsigned int i = 0; i < nKeys; i++)
+            setKeyPool.insert(nEnd + i);
+    }
+    return true;
+}
 
-        while (setKeyPool.size() < (nTargetSize + 1))
+bool CWallet::TopUpKeyPool(unsigned int nSize)
+{
+    unsigned int nTargetSize = nSize > 0 ? nSize : GetKeyPoolTarget();
+    unsigned int nAdded = 0;
+    int64_t nStart = GetTimeMillis();
+    CKeyMaker keymaker(nTargetSize + 1 - min(GetKeyPoolSize(), nTargetSize + 1));
+
+    while (true)
+    {
+        unsigned int nKeys;
         {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %"PRId64", size=%"PRIszu"\n", nEnd, setKeyPool.size());
+            LOCK(cs_wallet);
+
+            if (IsLocked() || fShutdown)
+                return false;
+            if (setKeyPool.size() >= nTargetSize + 1)
+                break;
+            nKeys = min((unsigned int)(nTargetSize + 1 - setKeyPool.size()), KEYPOOL_BATCH_SIZE);
         }
+        if (!GenerateKeyPoolBatch(keymaker, nKeys))
+            return false;
+        nAdded += nKeys;
     }
+    if (nAdded > 0)
+        printf("keypool added %u keys in %"PRId64"ms, size=%u\n", nAdded, GetTimeMillis() - nStart, GetKeyPoolSize());
     return true;
 }
 
+void CWallet::RequestKeyPoolRefill()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexKeyPoolRefill);
+        fKeyPoolRefillWake = true;
+    }
+    condKeyPoolRefill.notify_one();
+}
+
+void KeyPoolRefiller(CWallet* pwallet)
+{
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+
+    // Make this thread recognisable as the key pool refill thread
+    RenameThread("XDECoin-keypool");
+
+    // Fill the pool once at startup, then whenever it runs low
+    bool fRefill = true;
+    while (true)
+    {
+        if (fShutdown)
+            return;
+        if (fRefill)
+            pwallet->TopUpKeyPool();
+
+        boost::unique_lock<boost::mutex> lock(mutexKeyPoolRefill);
+        if (!fKeyPoolRefillWake)
+            condKeyPoolRefill.timed_wait(lock, boost::posix_time::seconds(1));
+        fRefill = fKeyPoolRefillWake;
+        fKeyPoolRefillWake = false;
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -2034,8 +2699,12 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
-            TopUpKeyPool();
+        // Only an empty pool waits for new keys, the refill thread tops it
+        // up once it falls to the low watermark
+        if (setKeyPool.empty() && !IsLocked())
+            TopUpKeyPool(1);
+        if (setKeyPool.size() <= GetKeyPoolTarget() / 2 + 1)
+            RequestKeyPoolRefill();
 
         // Get the oldest key
         if(setKeyPool.empty())
@@ -2283,6 +2952,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdateUnspent(*pcoin);
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -2295,6 +2965,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    UpdateUnspent(*pcoin);
                 }
             }
         }
@@ -2318,6 +2989,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateUnspent(prev);
             }
         }
     }
@@ -2416,7 +3088,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
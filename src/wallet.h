@@ -12,6 +12,7 @@
 #include <stdlib.h>
 
 #include "main.h"
+#include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -26,6 +27,7 @@ class CWalletTx;
 class CReserveKey;
 class COutput;
 class CCoinControl;
+class CKeyMaker;
 
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
@@ -65,6 +67,64 @@ public:
     )
 };
 
+/** Unsigned 128 bit number, for sums of coin value times time */
+class CUint128
+{
+public:
+    uint64_t nHigh;
+    uint64_t nLow;
+
+    CUint128(uint64_t n = 0) : nHigh(0), nLow(n) {}
+
+    static CUint128 Mul(uint64_t a, uint64_t b);
+    CUint128& operator+=(const CUint128& b);
+    CUint128& operator-=(const CUint128& b);
+    // Quotient by a divisor below 2^63, saturating at 2^64 - 1
+    uint64_t Div(uint64_t nDivisor) const;
+};
+
+/** Stake weight of a set of coins. The coins still gaining weight are kept
+ * as sums, so reading the weight is a few 128 bit operations until one of
+ * the coins crosses the min or max stake age and the sums are redone.
+ */
+class CStakeWeight
+{
+private:
+    std::vector<std::pair<int64_t, int64_t> > vCoin; // transaction time and value
+
+    // The sums hold from nTimeFrom until just before nTimeUntil
+    int64_t nTimeFrom;
+    int64_t nTimeUntil;
+    uint64_t nFullWeight;       // coin days of the coins at max age
+    int64_t nGrowingValue;      // value of the coins between min and max age
+    CUint128 nGrowingTimeValue; // and the sum of their value times the time their weight started
+
+    void Update(int64_t nTime);
+
+public:
+    CStakeWeight()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        vCoin.clear();
+        nTimeFrom = nTimeUntil = 0;
+    }
+
+    bool IsEmpty() const { return vCoin.empty(); }
+
+    void Add(int64_t nTime, int64_t nValue)
+    {
+        vCoin.push_back(std::make_pair(nTime, nValue));
+        nTimeFrom = nTimeUntil = 0;
+    }
+
+    // Adds the weights at nTime, as GetWeight counts them, to the arguments
+    void Get(int64_t nTime, uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight);
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -74,8 +134,42 @@ private:
     bool SelectCoinsSimple(int64_t nTargetValue, unsigned int nSpendTime, int nMinConf, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
     bool SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl=NULL) const;
 
+    // Open transaction that key writes go through while the wallet is being
+    // encrypted or the key pool topped up (protected by cs_wallet)
     CWalletDB *pwalletdbEncryption;
 
+    bool GenerateKeyPoolBatch(CKeyMaker& keymaker, unsigned int nKeys);
+
+    // Kernel hash inputs of staking coins, so the stake search doesn't have to
+    // read blocks and tx indexes on every round (protected by cs_wallet)
+    std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+    void UpdateStakeCandidates(const std::set<std::pair<const CWalletTx*,unsigned int> >& setCoins);
+
+    // Owned outputs not yet spent, kept up to date as transactions are added,
+    // spent and disabled, so balances and coin selection look at these instead
+    // of every transaction in mapWallet (protected by cs_wallet)
+    std::set<COutPoint> setUnspent;
+    void UpdateUnspent(const CWalletTx& wtx);
+    void RebuildUnspent();
+
+    // Balances by confirmation and maturity, summed over setUnspent at most
+    // once per best block since depths only change when the chain does
+    mutable bool fBalanceCached;
+    mutable uint256 hashBalanceBest;
+    mutable int64_t nBalanceTrusted;
+    mutable int64_t nBalanceUnconfirmed;
+    mutable int64_t nBalanceImmature;
+    mutable int64_t nBalanceStake;
+    mutable int64_t nBalanceNewMint;
+    void CacheBalances() const;
+
+    // Coins GetStakeWeight weighs, chosen as CreateCoinStake chooses them
+    // and refreshed when the wallet, the best block or the reserve changes
+    bool fStakeWeightCached;
+    uint256 hashStakeWeightBest;
+    int64_t nStakeWeightReserve;
+    CStakeWeight stakeWeight;
+
     // the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -104,6 +198,9 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fBalanceCached = false;
+        fStakeWeightCached = false;
+        nTimeFirstKey = 0;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -114,6 +211,9 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fBalanceCached = false;
+        fStakeWeightCached = false;
+        nTimeFirstKey = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -197,6 +297,7 @@ public:
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int nSize = 0);
+    void RequestKeyPoolRefill();
     int64_t AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
@@ -876,5 +977,7 @@ private:
 };
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
+void KeyPoolRefiller(CWallet* pwallet);
+CBlockIndex* FindRescanStart(CBlockIndex* pindexTip, int64_t nTimeBirth);
 
 #endif
\ No newline at end of file